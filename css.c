@@ -1,8 +1,13 @@
 #include "css.h"
+#include "tag_tables.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 // --- Utility Functions ---
 
@@ -17,77 +22,244 @@ static char* trim(const char* str) {
     return result;
 }
 
+// Copy [start, end) into a new string with surrounding whitespace removed.
+static char* copy_trimmed(const char* start, const char* end) {
+    int len = end - start;
+    char* raw = malloc(len + 1);
+    strncpy(raw, start, len);
+    raw[len] = '\0';
+    char* trimmed = trim(raw);
+    free(raw);
+    return trimmed;
+}
+
+// Return a copy of the CSS text with /* comments */ blanked out.
+static char* strip_comments(const char* css_text) {
+    char* out = strdup(css_text);
+    char* p = out;
+    while ((p = strstr(p, "/*")) != NULL) {
+        char* end = strstr(p + 2, "*/");
+        char* stop = end ? end + 2 : p + strlen(p);
+        memset(p, ' ', stop - p);
+        p = stop;
+    }
+    return out;
+}
+
 // --- CSS Parsing ---
 
-// This is a very naive parser. It assumes that the CSS is well-formed and uses the format:
-// selector { property: value; property: value; }
-CSSStyleSheet* parse_css(const char* css_text) {
-    CSSStyleSheet* sheet = malloc(sizeof(CSSStyleSheet));
-    sheet->rules = NULL;
-    sheet->rule_count = 0;
+// Parse "property: value; ..." up to a closing '}' (not consumed) or the end
+// of the string. Returns the number of declarations stored in *out.
+static int parse_declarations(const char** pp, CSSDeclaration** out) {
+    const char* p = *pp;
+    CSSDeclaration* declarations = NULL;
+    int decl_count = 0;
+    while (*p && *p != '}') {
+        // Skip whitespace.
+        while (*p && isspace(*p)) p++;
+        if (!*p || *p == '}') break;
+        // Read property name until ':'
+        const char* prop_start = p;
+        while (*p && *p != ':' && *p != ';' && *p != '}') p++;
+        if (*p != ':') {
+            if (*p == ';') { p++; continue; } // skip malformed declaration
+            break;
+        }
+        char* property = copy_trimmed(prop_start, p);
+        p++; // skip ':'
+        // Read value until ';'
+        const char* val_start = p;
+        while (*p && *p != ';' && *p != '}') p++;
+        char* value = copy_trimmed(val_start, p);
+        // Skip ';'
+        if (*p == ';') p++;
 
-    const char* p = css_text;
+        // Append declaration
+        declarations = realloc(declarations, sizeof(CSSDeclaration) * (decl_count + 1));
+        declarations[decl_count].property = property;
+        declarations[decl_count].value = value;
+        decl_count++;
+    }
+    *pp = p;
+    *out = declarations;
+    return decl_count;
+}
+
+// Skip a {...} block including nested blocks. p points at the '{'.
+static const char* skip_block(const char* p) {
+    int depth = 0;
+    for (; *p; p++) {
+        if (*p == '{') depth++;
+        else if (*p == '}' && --depth == 0) return p + 1;
+    }
+    return p;
+}
+
+// Parse a width like "600px" or "37.5em" into pixels.
+static int parse_media_length(const char* v) {
+    char* end;
+    double n = strtod(v, &end);
+    while (isspace((unsigned char)*end)) end++;
+    if (strncasecmp(end, "em", 2) == 0 || strncasecmp(end, "rem", 3) == 0)
+        n *= 16;
+    return (int)n;
+}
+
+// Parse one query of a media list, e.g. "screen and (max-width: 600px)".
+static void parse_media_query(CSSMediaQuery* q, const char* start, const char* end) {
+    q->min_width = 0;
+    q->max_width = INT_MAX;
+    q->negated = 0;
+    q->never = 0;
+
+    const char* p = start;
+    while (p < end) {
+        while (p < end && isspace((unsigned char)*p)) p++;
+        if (p >= end) break;
+        if (*p == '(') {
+            const char* close = memchr(p, ')', end - p);
+            if (!close) close = end;
+            char* feature = copy_trimmed(p + 1, close);
+            char* colon = strchr(feature, ':');
+            int px = colon ? parse_media_length(colon + 1) : 0;
+            if (colon) *colon = '\0';
+            char* name = trim(feature);
+            if (colon && strcasecmp(name, "min-width") == 0) {
+                if (px > q->min_width) q->min_width = px;
+            } else if (colon && strcasecmp(name, "max-width") == 0) {
+                if (px < q->max_width) q->max_width = px;
+            } else if (colon && strcasecmp(name, "width") == 0) {
+                q->min_width = q->max_width = px;
+            } else {
+                q->never = 1; // unsupported feature: never matches
+            }
+            free(name);
+            free(feature);
+            p = close < end ? close + 1 : end;
+            continue;
+        }
+        const char* word = p;
+        while (p < end && !isspace((unsigned char)*p) && *p != '(') p++;
+        int n = p - word;
+        if (n == 3 && strncasecmp(word, "not", 3) == 0) q->negated = 1;
+        else if (n == 4 && strncasecmp(word, "only", 4) == 0) continue;
+        else if (n == 3 && strncasecmp(word, "and", 3) == 0) continue;
+        else if (n == 3 && strncasecmp(word, "all", 3) == 0) continue;
+        else if (n == 6 && strncasecmp(word, "screen", 6) == 0) continue;
+        else q->never = 1; // print, speech, ...
+    }
+}
+
+// Parse the prelude of an @media rule and return its index in sheet->media.
+// A nested block keeps its enclosing block's index as parent.
+static int add_media_list(CSSStyleSheet* sheet, const char* start, const char* end, int parent) {
+    CSSMediaList list;
+    list.queries = NULL;
+    list.query_count = 0;
+    list.parent = parent;
+    list.active = 0;
+    const char* p = start;
+    while (p < end) {
+        const char* comma = memchr(p, ',', end - p);
+        const char* stop = comma ? comma : end;
+        list.queries = realloc(list.queries, sizeof(CSSMediaQuery) * (list.query_count + 1));
+        parse_media_query(&list.queries[list.query_count++], p, stop);
+        p = comma ? comma + 1 : end;
+    }
+    sheet->media = realloc(sheet->media, sizeof(CSSMediaList) * (sheet->media_count + 1));
+    sheet->media[sheet->media_count] = list;
+    return sheet->media_count++;
+}
+
+int css_media_matches(const CSSMediaList* list, int viewport_width) {
+    if (list->query_count == 0) return 1; // "@media {" applies everywhere
+    for (int i = 0; i < list->query_count; i++) {
+        const CSSMediaQuery* q = &list->queries[i];
+        int match = !q->never && viewport_width >= q->min_width &&
+                    viewport_width <= q->max_width;
+        if (q->negated) match = !match;
+        if (match) return 1;
+    }
+    return 0;
+}
+
+// A nested @media block applies only where every enclosing block does too.
+static int media_applies(const CSSStyleSheet* sheet, int index, int viewport_width) {
+    for (; index >= 0; index = sheet->media[index].parent) {
+        if (!css_media_matches(&sheet->media[index], viewport_width)) return 0;
+    }
+    return 1;
+}
+
+// Parse rules until the end of the text, or until the '}' closing an
+// enclosing @media block when nested. Rules get the given media index.
+static const char* parse_rules(CSSStyleSheet* sheet, const char* p, int media, int nested) {
     while (*p) {
-        // Skip whitespace and comments if desired.
+        // Skip whitespace.
         while (*p && isspace(*p)) p++;
+        if (!*p) break;
+        if (*p == '}') {
+            p++;
+            if (nested) break;
+            continue; // stray '}'
+        }
+
+        // At-rules: @media blocks nest rules, everything else is skipped.
+        if (*p == '@') {
+            const char* name = ++p;
+            while (*p && (isalnum((unsigned char)*p) || *p == '-')) p++;
+            int name_len = p - name;
+            const char* prelude = p;
+            while (*p && *p != '{' && *p != ';') p++;
+            if (*p == ';') { p++; continue; } // @import, @charset, ...
+            if (!*p) break;
+            if (name_len == 5 && strncasecmp(name, "media", 5) == 0) {
+                int index = add_media_list(sheet, prelude, p, media);
+                p = parse_rules(sheet, p + 1, index, 1);
+            } else {
+                p = skip_block(p);
+            }
+            continue;
+        }
 
         // Read selector until '{'
         const char* sel_start = p;
-        while (*p && *p != '{') p++;
+        while (*p && *p != '{' && *p != '}') p++;
+        if (*p == '}') continue; // junk before a closing brace
         if (*p != '{') break; // end if no '{'
-        int sel_len = p - sel_start;
-        char* selector = malloc(sel_len + 1);
-        strncpy(selector, sel_start, sel_len);
-        selector[sel_len] = '\0';
-        char* trimmed_selector = trim(selector);
-        free(selector);
+        char* selector = copy_trimmed(sel_start, p);
 
         p++; // skip '{'
         // Parse declarations until '}'
         CSSDeclaration* declarations = NULL;
-        int decl_count = 0;
-        while (*p && *p != '}') {
-            // Skip whitespace.
-            while (*p && isspace(*p)) p++;
-            if (*p == '}') break;
-            // Read property name until ':'
-            const char* prop_start = p;
-            while (*p && *p != ':' && *p != '}') p++;
-            if (*p != ':') break;
-            int prop_len = p - prop_start;
-            char* property = malloc(prop_len + 1);
-            strncpy(property, prop_start, prop_len);
-            property[prop_len] = '\0';
-            char* trimmed_property = trim(property);
-            free(property);
-            p++; // skip ':'
-            // Read value until ';'
-            const char* val_start = p;
-            while (*p && *p != ';' && *p != '}') p++;
-            int val_len = p - val_start;
-            char* value = malloc(val_len + 1);
-            strncpy(value, val_start, val_len);
-            value[val_len] = '\0';
-            char* trimmed_value = trim(value);
-            free(value);
-            // Skip ';'
-            if (*p == ';') p++;
-
-            // Append declaration
-            declarations = realloc(declarations, sizeof(CSSDeclaration) * (decl_count + 1));
-            declarations[decl_count].property = trimmed_property;
-            declarations[decl_count].value = trimmed_value;
-            decl_count++;
-        }
+        int decl_count = parse_declarations(&p, &declarations);
         if (*p == '}') p++; // skip '}'
 
         // Append rule.
         sheet->rules = realloc(sheet->rules, sizeof(CSSRule) * (sheet->rule_count + 1));
-        sheet->rules[sheet->rule_count].selector = trimmed_selector;
+        sheet->rules[sheet->rule_count].selector = selector;
         sheet->rules[sheet->rule_count].declarations = declarations;
         sheet->rules[sheet->rule_count].declaration_count = decl_count;
+        sheet->rules[sheet->rule_count].media = media;
         sheet->rule_count++;
     }
+    return p;
+}
+
+// This is a very naive parser. It assumes that the CSS is mostly well-formed and uses the format:
+// selector { property: value; property: value; }
+// @media <queries> { selector { ... } ... }
+CSSStyleSheet* parse_css(const char* css_text) {
+    CSSStyleSheet* sheet = malloc(sizeof(CSSStyleSheet));
+    sheet->rules = NULL;
+    sheet->rule_count = 0;
+    sheet->media = NULL;
+    sheet->media_count = 0;
+    sheet->viewport_width = -1;
+
+    char* text = strip_comments(css_text);
+    parse_rules(sheet, text, -1, 0);
+    free(text);
     return sheet;
 }
 
@@ -101,72 +273,674 @@ void free_stylesheet(CSSStyleSheet* sheet) {
         }
         free(sheet->rules[i].declarations);
     }
+    for (int i = 0; i < sheet->media_count; i++)
+        free(sheet->media[i].queries);
+    free(sheet->media);
     free(sheet->rules);
     free(sheet);
 }
 
+int css_breakpoint_crossed(const CSSStyleSheet* sheet, int viewport_width) {
+    if (sheet->viewport_width < 0) return 1; // never applied
+    for (int i = 0; i < sheet->media_count; i++) {
+        if (media_applies(sheet, i, viewport_width) != sheet->media[i].active)
+            return 1;
+    }
+    return 0;
+}
+
 // --- CSS Application ---
 
-// A very basic matching function: supports matching by tag name (or "#text") and by class if the DOM node
-// has a "class" attribute (if you extended your DOM). For now, we assume the selector is a tag name.
+// Does the whitespace-separated class list contain the class cls[0..len)?
+static int has_class(const char* list, const char* cls, size_t len) {
+    const char* p = list;
+    while (p && *p) {
+        while (*p && isspace((unsigned char)*p)) p++;
+        const char* start = p;
+        while (*p && !isspace((unsigned char)*p)) p++;
+        if ((size_t)(p - start) == len && strncmp(start, cls, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Match one compound selector like "li", ".item", "#main" or "span.tag".
+// Combinators, attribute selectors and pseudo-classes never match.
+static int matches_compound(DOMNode* node, const char* sel, size_t len) {
+    const char* end = sel + len;
+    const char* p = sel;
+    while (p < end && *p != '.' && *p != '#') {
+        if (isspace((unsigned char)*p) || strchr(">+~:[*", *p))
+            return 0;
+        p++;
+    }
+    size_t tag_len = p - sel;
+    if (tag_len > 0 &&
+        (strlen(node->name) != tag_len || strncasecmp(node->name, sel, tag_len) != 0))
+        return 0;
+    if (tag_len == 0 && p == end)
+        return 0;
+
+    while (p < end) {
+        char kind = *p++;
+        const char* start = p;
+        while (p < end && *p != '.' && *p != '#') {
+            if (isspace((unsigned char)*p) || strchr(">+~:[*", *p))
+                return 0;
+            p++;
+        }
+        size_t n = p - start;
+        if (n == 0) return 0;
+        if (kind == '.') {
+            if (!has_class(node->class_name, start, n)) return 0;
+        } else {
+            if (!node->id || strlen(node->id) != n || strncmp(node->id, start, n) != 0)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// Match a selector (possibly a comma-separated group) against a node.
 static int matches_selector(DOMNode* node, const char* selector) {
     if (!node || !node->name) return 0;
-    // For now, case-insensitive string comparison for tag names.
-    return (strcasecmp(node->name, selector) == 0);
+    const char* p = selector;
+    while (*p) {
+        while (*p && (isspace((unsigned char)*p) || *p == ',')) p++;
+        const char* start = p;
+        while (*p && *p != ',') p++;
+        const char* end = p;
+        while (end > start && isspace((unsigned char)end[-1])) end--;
+        if (end > start && matches_compound(node, start, end - start))
+            return 1;
+    }
+    return 0;
+}
+
+static ComputedStyle* new_computed_style(void) {
+    ComputedStyle* style = malloc(sizeof(ComputedStyle));
+    style->width = NULL;
+    style->height = NULL;
+    style->background = NULL;
+    style->text_align = NULL;
+    style->font_size = NULL;
+    style->display = NULL;
+    style->refcount = 1;
+    return style;
 }
 
 // Attach computed style structure to the DOM node if it does not already have one.
 void ensure_computed_style(DOMNode* node) {
     // Assume node->style is NULL if not computed.
     if (!node) return;
-    if (!node->style) {
-        node->style = malloc(sizeof(ComputedStyle));
-        node->style->width = NULL;
-        node->style->height = NULL;
-        node->style->background = NULL;
-        node->style->text_align = NULL;
-        node->style->font_size = NULL;
-    }
+    if (!node->style)
+        node->style = new_computed_style();
 }
 
-static void apply_rule_to_node(CSSRule* rule, DOMNode* node) {
-    if (!matches_selector(node, rule->selector))
-        return;
+static void set_style_string(char** field, const char* value) {
+    if (*field) free(*field);
+    *field = strdup(value);
+}
 
-    ensure_computed_style(node);
+// Apply a declaration block, allocating the style on first use.
+static void apply_declarations(const CSSDeclaration* declarations, int count,
+                               ComputedStyle** style) {
+    if (!*style) *style = new_computed_style();
 
-    for (int i = 0; i < rule->declaration_count; i++) {
-        CSSDeclaration* decl = &rule->declarations[i];
+    for (int i = 0; i < count; i++) {
+        const CSSDeclaration* decl = &declarations[i];
         if (strcasecmp(decl->property, "width") == 0) {
-            if (node->style->width) free(node->style->width);
-            node->style->width = strdup(decl->value);
+            set_style_string(&(*style)->width, decl->value);
         } else if (strcasecmp(decl->property, "height") == 0) {
-            if (node->style->height) free(node->style->height);
-            node->style->height = strdup(decl->value);
+            set_style_string(&(*style)->height, decl->value);
         } else if (strcasecmp(decl->property, "background") == 0) {
-            if (node->style->background) free(node->style->background);
-            node->style->background = strdup(decl->value);
+            set_style_string(&(*style)->background, decl->value);
         } else if (strcasecmp(decl->property, "font-size") == 0) {
-            if (node->style->font_size) free(node->style->font_size);
-            node->style->font_size = strdup(decl->value);
+            set_style_string(&(*style)->font_size, decl->value);
         } else if (strcasecmp(decl->property, "text-align") == 0) {
-            if (node->style->text_align) free(node->style->text_align);
-            node->style->text_align = strdup(decl->value);
+            set_style_string(&(*style)->text_align, decl->value);
+        } else if (strcasecmp(decl->property, "display") == 0) {
+            set_style_string(&(*style)->display, decl->value);
         }
     }
 }
 
+// --- Display ---
+
+static int tag_in_table(const char* tag, const char* const table[], size_t n) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = strcasecmp(tag, table[mid]);
+        if (cmp == 0) return 1;
+        if (cmp < 0) hi = mid; else lo = mid + 1;
+    }
+    return 0;
+}
+
+static DisplayType default_display(const char* tag) {
+    if (!tag) return DISPLAY_NONE;
+    if (tag_in_table(tag, block_tags, BLOCK_TAGS_N)) return DISPLAY_BLOCK;
+    if (tag_in_table(tag, inline_tags, INLINE_TAGS_N)) return DISPLAY_INLINE;
+    if (tag_in_table(tag, hidden_tags, HIDDEN_TAGS_N)) return DISPLAY_NONE;
+    return DISPLAY_CONTENTS;
+}
+
+// Map a CSS display value onto the box types layout knows about.
+static DisplayType compute_display(const ComputedStyle* style, const char* tag) {
+    const char* v = style ? style->display : NULL;
+    if (!v) return default_display(tag);
+    if (strcasecmp(v, "none") == 0) return DISPLAY_NONE;
+    if (strcasecmp(v, "contents") == 0) return DISPLAY_CONTENTS;
+    if (strncasecmp(v, "inline", 6) == 0) return DISPLAY_INLINE;
+    if (strcasecmp(v, "block") == 0 || strcasecmp(v, "list-item") == 0 ||
+        strcasecmp(v, "flex") == 0 || strcasecmp(v, "grid") == 0 ||
+        strncasecmp(v, "table", 5) == 0 || strcasecmp(v, "flow-root") == 0)
+        return DISPLAY_BLOCK;
+    return default_display(tag);
+}
+
+DisplayType css_node_display(const DOMNode* node) {
+    if (node->display != DISPLAY_UNSET) return node->display;
+    return default_display(node->name);
+}
+
+// --- Inline styles ---
+//
+// style="..." attributes are parsed with the stylesheet declaration parser.
+// Generated pages repeat the same attribute text on thousands of nodes, so
+// parsed blocks are cached per cascade in a small open-addressing table keyed
+// by the attribute string (borrowed from the DOM, which outlives the cascade).
+
+typedef struct {
+    const char* key;
+    unsigned hash;
+    CSSDeclaration* declarations;
+    int declaration_count;
+} InlineStyleEntry;
+
+typedef struct {
+    InlineStyleEntry* slots;
+    int capacity;   // power of two
+    int count;
+} InlineStyleCache;
+
+static unsigned hash_string(const char* s) {
+    unsigned h = 2166136261u;  // FNV-1a
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static InlineStyleEntry* find_inline_slot(InlineStyleEntry* slots, int capacity,
+                                          const char* key, unsigned hash) {
+    unsigned i = hash & (capacity - 1);
+    while (slots[i].key &&
+           (slots[i].hash != hash || strcmp(slots[i].key, key) != 0))
+        i = (i + 1) & (capacity - 1);
+    return &slots[i];
+}
+
+static void grow_inline_cache(InlineStyleCache* cache) {
+    int capacity = cache->capacity ? cache->capacity * 2 : 64;
+    InlineStyleEntry* slots = calloc(capacity, sizeof(InlineStyleEntry));
+    for (int i = 0; i < cache->capacity; i++) {
+        InlineStyleEntry* e = &cache->slots[i];
+        if (e->key) *find_inline_slot(slots, capacity, e->key, e->hash) = *e;
+    }
+    free(cache->slots);
+    cache->slots = slots;
+    cache->capacity = capacity;
+}
+
+static InlineStyleEntry* lookup_inline_style(InlineStyleCache* cache, const char* text,
+                                             CSSStyleStats* stats) {
+    if (cache->count * 2 >= cache->capacity) grow_inline_cache(cache);
+    unsigned hash = hash_string(text);
+    InlineStyleEntry* e = find_inline_slot(cache->slots, cache->capacity, text, hash);
+    if (e->key) {
+        stats->inline_cache_hits++;
+        return e;
+    }
+    const char* p = text;
+    e->key = text;
+    e->hash = hash;
+    e->declaration_count = parse_declarations(&p, &e->declarations);
+    cache->count++;
+    stats->inline_blocks_parsed++;
+    return e;
+}
+
+static void free_inline_cache(InlineStyleCache* cache) {
+    for (int i = 0; i < cache->capacity; i++) {
+        InlineStyleEntry* e = &cache->slots[i];
+        if (!e->key) continue;
+        for (int j = 0; j < e->declaration_count; j++) {
+            free(e->declarations[j].property);
+            free(e->declarations[j].value);
+        }
+        free(e->declarations);
+    }
+    free(cache->slots);
+}
+
+// --- Style sharing ---
+//
+// Computed styles are immutable once the cascade has produced them, so nodes
+// whose matching inputs are identical can point at the same ComputedStyle.
+// The inputs are the tag name, the class list, the inline style attribute and
+// the parent's style; nodes with an id never share because "#id" rules could
+// single them out. A small ring of recently styled nodes catches runs of
+// siblings (and cousins under identically styled parents) like <li>, <td>,
+// <p> and word #text nodes.
+
+#define STYLE_SHARE_SLOTS 16
+
+typedef struct {
+    const char* tag;
+    const char* class_name;
+    const char* style_attr;
+    const ComputedStyle* parent_style;
+    ComputedStyle* style;    // may be NULL: "no rule matches"
+    DisplayType display;
+} StyleShareEntry;
+
+typedef struct {
+    StyleShareEntry entries[STYLE_SHARE_SLOTS];
+    int count;
+    int next;
+    InlineStyleCache inline_styles;
+    CSSStyleStats stats;
+} StyleSharingCache;
+
+static CSSStyleStats last_stats;
+
+static int same_string(const char* a, const char* b) {
+    if (!a || !b) return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static StyleShareEntry* find_shared_style(StyleSharingCache* cache, DOMNode* node,
+                                          const ComputedStyle* parent_style) {
+    if (node->id) return NULL;
+    for (int i = 0; i < cache->count; i++) {
+        StyleShareEntry* e = &cache->entries[i];
+        if (e->parent_style == parent_style &&
+            strcasecmp(e->tag, node->name) == 0 &&
+            same_string(e->class_name, node->class_name) &&
+            same_string(e->style_attr, node->style_attr))
+            return e;
+    }
+    return NULL;
+}
+
+static void remember_style(StyleSharingCache* cache, DOMNode* node,
+                           const ComputedStyle* parent_style) {
+    if (node->id) return;
+    StyleShareEntry* e = &cache->entries[cache->next];
+    e->tag = node->name;
+    e->class_name = node->class_name;
+    e->style_attr = node->style_attr;
+    e->parent_style = parent_style;
+    e->style = node->style;
+    e->display = node->display;
+    cache->next = (cache->next + 1) % STYLE_SHARE_SLOTS;
+    if (cache->count < STYLE_SHARE_SLOTS) cache->count++;
+}
+
+static void compute_style(CSSStyleSheet* sheet, DOMNode* node,
+                          const ComputedStyle* parent_style, StyleSharingCache* cache) {
+    free_computed_style(node->style);
+    node->style = NULL;
+
+    StyleShareEntry* shared = find_shared_style(cache, node, parent_style);
+    if (shared) {
+        node->style = shared->style;
+        node->display = shared->display;
+        if (node->style) __atomic_add_fetch(&node->style->refcount, 1, __ATOMIC_RELAXED);
+        cache->stats.share_hits++;
+    } else {
+        for (int i = 0; i < sheet->rule_count; i++) {
+            CSSRule* rule = &sheet->rules[i];
+            if (rule->media >= 0 && !sheet->media[rule->media].active)
+                continue;
+            if (matches_selector(node, rule->selector))
+                apply_declarations(rule->declarations, rule->declaration_count, &node->style);
+        }
+        // Inline style wins over every stylesheet rule.
+        if (node->style_attr) {
+            InlineStyleEntry* block = lookup_inline_style(&cache->inline_styles,
+                                                          node->style_attr, &cache->stats);
+            if (block->declaration_count > 0)
+                apply_declarations(block->declarations, block->declaration_count, &node->style);
+        }
+        node->display = compute_display(node->style, node->name);
+        if (node->style) cache->stats.styles_allocated++;
+        remember_style(cache, node, parent_style);
+    }
+    if (node->style) cache->stats.nodes_styled++;
+    if (node->display == DISPLAY_NONE) cache->stats.subtrees_pruned++;
+}
+
 // Recursively apply the stylesheet rules to a DOM tree.
-static void apply_rules(CSSStyleSheet* sheet, DOMNode* node) {
+static void apply_rules(CSSStyleSheet* sheet, DOMNode* node,
+                        const ComputedStyle* parent_style, StyleSharingCache* cache) {
     if (!node) return;
-    for (int i = 0; i < sheet->rule_count; i++) {
-        apply_rule_to_node(&sheet->rules[i], node);
+    if (node->name)
+        compute_style(sheet, node, parent_style, cache);
+    if (node->display == DISPLAY_NONE) return;  // descendants are never rendered
+    for (int i = 0; i < node->children_count; i++) {
+        apply_rules(sheet, node->children[i], node->style, cache);
     }
+}
+
+// --- Parallel cascade ---
+//
+// Large documents are styled on a small work-stealing pool. Each worker owns a
+// deque of subtree tasks: it pops its newest task (depth first) and, when
+// empty, steals the oldest task of another worker. A task styles its root and
+// then either recurses into a child inline or, while few tasks are queued,
+// pushes the child as a new task for idle workers to pick up. Every node is
+// written by exactly one task, so computed styles need no locking; each worker
+// keeps a private style sharing cache.
+
+#define STYLE_MAX_THREADS        8
+#define STYLE_PARALLEL_MIN_NODES 4096  // smaller DOMs are styled serially
+#define STYLE_TASK_LOW_WATER     4     // queued tasks per worker before inlining
+
+typedef struct {
+    DOMNode* node;
+    const ComputedStyle* parent_style;
+} StyleTask;
+
+typedef struct StylePool StylePool;
+
+typedef struct {
+    pthread_mutex_t lock;
+    StyleTask* tasks;          // live tasks are tasks[head..tail)
+    int head, tail, capacity;
+    StyleSharingCache cache;
+    StylePool* pool;
+    pthread_t thread;
+} StyleWorker;
+
+struct StylePool {
+    CSSStyleSheet* sheet;
+    StyleWorker* workers;
+    int worker_count;
+    int pending;               // tasks pushed but not yet finished
+};
+
+static int style_threads = 0;  // 0 = one per online CPU
+
+void css_set_style_threads(int threads) {
+    style_threads = threads < 0 ? 0 : threads;
+}
+
+static int resolve_style_threads(void) {
+    int n = style_threads;
+    if (n == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (int)cpus : 1;
+    }
+    return n > STYLE_MAX_THREADS ? STYLE_MAX_THREADS : n;
+}
+
+static int count_nodes_upto(DOMNode* node, int limit) {
+    int n = 1;
+    for (int i = 0; i < node->children_count && n < limit; i++)
+        n += count_nodes_upto(node->children[i], limit - n);
+    return n;
+}
+
+static void push_task(StyleWorker* w, DOMNode* node, const ComputedStyle* parent_style) {
+    __atomic_add_fetch(&w->pool->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&w->lock);
+    if (w->head == w->tail) {
+        w->head = w->tail = 0;
+    } else if (w->tail == w->capacity && w->head > 0) {
+        memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof(StyleTask));
+        w->tail -= w->head;
+        w->head = 0;
+    }
+    if (w->tail == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 64;
+        w->tasks = realloc(w->tasks, w->capacity * sizeof(StyleTask));
+    }
+    w->tasks[w->tail].node = node;
+    w->tasks[w->tail].parent_style = parent_style;
+    w->tail++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Owner end (newest task) when lifo, thief end (oldest task) otherwise.
+static int take_task(StyleWorker* w, StyleTask* out, int lifo) {
+    int found = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail) {
+        *out = lifo ? w->tasks[--w->tail] : w->tasks[w->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+static void style_subtree(StyleWorker* w, DOMNode* node, const ComputedStyle* parent_style) {
+    if (node->name)
+        compute_style(w->pool->sheet, node, parent_style, &w->cache);
+    if (node->display == DISPLAY_NONE) return;
     for (int i = 0; i < node->children_count; i++) {
-        apply_rules(sheet, node->children[i]);
+        DOMNode* child = node->children[i];
+        if (child->children_count > 0 &&
+            __atomic_load_n(&w->pool->pending, __ATOMIC_RELAXED) <
+                w->pool->worker_count * STYLE_TASK_LOW_WATER)
+            push_task(w, child, node->style);
+        else
+            style_subtree(w, child, node->style);
+    }
+}
+
+static void* style_worker_run(void* arg) {
+    StyleWorker* w = arg;
+    StylePool* pool = w->pool;
+    int self = (int)(w - pool->workers);
+    unsigned victim = (unsigned)self;
+    StyleTask task;
+
+    while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0) {
+        int found = take_task(w, &task, 1);
+        for (int i = 1; !found && i < pool->worker_count; i++) {
+            victim = (victim + 1) % pool->worker_count;
+            if ((int)victim != self)
+                found = take_task(&pool->workers[victim], &task, 0);
+        }
+        if (!found) {
+            sched_yield();
+            continue;
+        }
+        style_subtree(w, task.node, task.parent_style);
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void apply_rules_parallel(CSSStyleSheet* sheet, DOMNode* dom, int threads,
+                                 CSSStyleStats* stats) {
+    StylePool pool;
+    pool.sheet = sheet;
+    pool.worker_count = threads;
+    pool.pending = 0;
+    pool.workers = calloc(threads, sizeof(StyleWorker));
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+        pool.workers[i].pool = &pool;
+    }
+
+    push_task(&pool.workers[0], dom, NULL);
+    int started = 1;
+    for (int i = 1; i < threads; i++, started++) {
+        if (pthread_create(&pool.workers[i].thread, NULL, style_worker_run, &pool.workers[i]) != 0)
+            break;
+    }
+    style_worker_run(&pool.workers[0]);
+
+    for (int i = 1; i < started; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+
+    memset(stats, 0, sizeof *stats);
+    for (int i = 0; i < threads; i++) {
+        stats->nodes_styled += pool.workers[i].cache.stats.nodes_styled;
+        stats->styles_allocated += pool.workers[i].cache.stats.styles_allocated;
+        stats->share_hits += pool.workers[i].cache.stats.share_hits;
+        stats->subtrees_pruned += pool.workers[i].cache.stats.subtrees_pruned;
+        stats->inline_blocks_parsed += pool.workers[i].cache.stats.inline_blocks_parsed;
+        stats->inline_cache_hits += pool.workers[i].cache.stats.inline_cache_hits;
+        free_inline_cache(&pool.workers[i].cache.inline_styles);
+        pthread_mutex_destroy(&pool.workers[i].lock);
+        free(pool.workers[i].tasks);
+    }
+    free(pool.workers);
+}
+
+void apply_stylesheet_to_dom(CSSStyleSheet* sheet, DOMNode* dom, int viewport_width) {
+    if (!dom) return;
+    sheet->viewport_width = viewport_width;
+    for (int i = 0; i < sheet->media_count; i++)
+        sheet->media[i].active = media_applies(sheet, i, viewport_width);
+
+    int threads = resolve_style_threads();
+    if (threads > 1 && count_nodes_upto(dom, STYLE_PARALLEL_MIN_NODES) >= STYLE_PARALLEL_MIN_NODES) {
+        apply_rules_parallel(sheet, dom, threads, &last_stats);
+        return;
+    }
+
+    StyleSharingCache cache;
+    memset(&cache, 0, sizeof cache);
+    apply_rules(sheet, dom, NULL, &cache);
+    free_inline_cache(&cache.inline_styles);
+    last_stats = cache.stats;
+}
+
+// Restyle one subtree against the media state of the last full cascade.
+// Used after scripts change the DOM: only rules on the node itself match, so
+// nodes outside the changed subtree keep their styles.
+void css_restyle_subtree(CSSStyleSheet* sheet, DOMNode* node) {
+    if (!sheet || !node) return;
+    StyleSharingCache cache;
+    memset(&cache, 0, sizeof cache);
+    apply_rules(sheet, node, node->parent ? node->parent->style : NULL, &cache);
+    free_inline_cache(&cache.inline_styles);
+}
+
+int css_matches_selector(DOMNode* node, const char* selector) {
+    return selector && matches_selector(node, selector);
+}
+
+void css_style_stats(CSSStyleStats* out) {
+    if (out) *out = last_stats;
+}
+
+#ifdef STYLEBENCH
+// Scaling of the parallel cascade with the number of style threads.
+// cc -O2 -DSTYLEBENCH -Igumbo_src -o stylebench css.c parser.c gumbo_src/*.c -lpthread -lm
+// ./stylebench [elements]
+// Every run styles a freshly built copy of the same synthetic page, so the
+// style sharing caches start cold each time. The best of five runs is kept.
+
+#include <time.h>
+
+static double bench_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// A page of nested sections: blocks of div/p/span/a with a mix of classes,
+// ids and style attributes, up to nine levels deep.
+static void bench_build(DOMNode* parent, int depth, int* budget, unsigned* seed) {
+    static const char* tags[] = { "div", "p", "span", "a", "li", "section" };
+    char buf[64];
+    while (*budget > 0) {
+        *seed = *seed * 1103515245u + 12345u;
+        unsigned r = *seed >> 8;
+        DOMNode* el = create_dom_node(tags[r % 6], NULL);
+        snprintf(buf, sizeof buf, "c%u item%s", r % 97, r % 5 ? "" : " hot");
+        el->class_name = strdup(buf);
+        if (r % 23 == 0) {
+            snprintf(buf, sizeof buf, "n%u", r % 1000);
+            el->id = strdup(buf);
+        }
+        if (r % 11 == 0) {
+            snprintf(buf, sizeof buf, "width: %upx; background: #%06x", 100 + r % 50, r & 0xffffff);
+            el->style_attr = strdup(buf);
+        }
+        add_child(parent, el);
+        add_child(el, create_dom_node("#text", "Lorem ipsum dolor sit amet"));
+        (*budget)--;
+        if (depth < 8 && r % 3 != 0)
+            bench_build(el, depth + 1, budget, seed);
+        if (r % 4 == 0)
+            return;
+    }
+}
+
+// Compound selectors only (tag, classes, id), since the cascade matches no
+// combinators. Every rule outside the @media block matches part of the page.
+static char* bench_stylesheet(void) {
+    size_t cap = 1 << 16, len = 0;
+    char* css = malloc(cap);
+    for (int i = 0; i < 97; i++) {
+        len += snprintf(css + len, cap - len,
+                        ".c%d { width: %dpx; }\n"
+                        "p.c%d { font-size: %dpx; }\n"
+                        "section.c%d.hot { background: #%06x; }\n",
+                        i, 200 + i, i, 10 + i % 20, i, i * 0x010203);
     }
+    len += snprintf(css + len, cap - len,
+                    "#n7, #n77, #n777 { text-align: center; }\n"
+                    "li.hot { display: inline; }\n"
+                    "@media (max-width: 600px) { .item { width: 100%%; } }\n");
+    return css;
 }
 
-void apply_stylesheet_to_dom(CSSStyleSheet* sheet, DOMNode* dom) {
-    apply_rules(sheet, dom);
+int main(int argc, char** argv) {
+    int elements = argc > 1 ? atoi(argv[1]) : 50000;
+    static const int thread_counts[] = { 1, 2, 4, 8 };
+    CSSStyleSheet* sheet;
+    char* css = bench_stylesheet();
+    double serial = 0;
+
+    sheet = parse_css(css);
+    printf("%d elements, %d rules, %ld online CPUs\n",
+           elements, sheet->rule_count, sysconf(_SC_NPROCESSORS_ONLN));
+
+    for (int t = 0; t < (int)(sizeof thread_counts / sizeof *thread_counts); t++) {
+        int threads = thread_counts[t];
+        double best = 1e30;
+        CSSStyleStats stats;
+        css_set_style_threads(threads);
+        for (int run = 0; run < 5; run++) {
+            DOMNode* dom = create_dom_node("html", NULL);
+            DOMNode* body = create_dom_node("body", NULL);
+            int budget = elements;
+            unsigned seed = 1;
+            add_child(dom, body);
+            while (budget > 0)
+                bench_build(body, 0, &budget, &seed);
+            double start = bench_now_ms();
+            apply_stylesheet_to_dom(sheet, dom, 1024);
+            double ms = bench_now_ms() - start;
+            if (ms < best) best = ms;
+            css_style_stats(&stats);
+            free_dom(dom);
+        }
+        if (threads == 1) serial = best;
+        printf("%d thread%s: %8.2f ms  speedup %.2fx  (%d styled, %d shared)\n",
+               threads, threads == 1 ? " " : "s", best, serial / best,
+               stats.nodes_styled, stats.share_hits);
+    }
+
+    free_stylesheet(sheet);
+    free(css);
+    return 0;
 }
+#endif
@@ -14,12 +14,32 @@ typedef struct {
     char* selector;             // e.g. "div", ".classname", "#id"
     CSSDeclaration* declarations; // Array of declarations.
     int declaration_count;
+    int media;                  // index into sheet->media, -1 if unconditional
 } CSSRule;
 
+// One query of a media list, e.g. "screen and (max-width: 600px)".
+typedef struct {
+    int min_width;   // px, 0 if unbounded
+    int max_width;   // px, INT_MAX if unbounded
+    int negated;     // "not ..."
+    int never;       // media type or feature we never match (print, hover, ...)
+} CSSMediaQuery;
+
+// The comma-separated query list of an @media block.
+typedef struct {
+    CSSMediaQuery* queries;
+    int query_count;
+    int parent;      // enclosing @media block, -1 if at top level
+    int active;      // result for the width of the last cascade, with parents
+} CSSMediaList;
+
 // A stylesheet is an array of CSS rules.
 typedef struct {
     CSSRule* rules;
     int rule_count;
+    CSSMediaList* media;
+    int media_count;
+    int viewport_width;  // width of the last cascade, -1 if never applied
 } CSSStyleSheet;
 
 // Parse a CSS string and return a stylesheet.
@@ -28,14 +48,48 @@ CSSStyleSheet* parse_css(const char* css_text);
 // Free the stylesheet.
 void free_stylesheet(CSSStyleSheet* sheet);
 
+// Does a media list match a viewport of the given width?
+int css_media_matches(const CSSMediaList* list, int viewport_width);
+
+// Would any @media block evaluate differently at this width than in the last
+// cascade? If not, existing computed styles are still valid after a resize.
+int css_breakpoint_crossed(const CSSStyleSheet* sheet, int viewport_width);
+
 // For simplicity, add computed style fields to your DOMNode structure.
 // In production, you might want a separate structure.
 // For this example, we assume a simple approach: we add a pointer for a style
 // (here we just store a string for each property, but you could use more advanced types).
 typedef struct ComputedStyle ComputedStyle; // forward declaration
 
-// Attach computed style to a DOM node.
-void apply_stylesheet_to_dom(CSSStyleSheet* sheet, DOMNode* dom);
+// Attach computed style to a DOM node, evaluating @media against viewport_width.
+// style="..." attributes are applied after all stylesheet rules.
+// Nodes with identical matching inputs share one refcounted, immutable style.
+void apply_stylesheet_to_dom(CSSStyleSheet* sheet, DOMNode* dom, int viewport_width);
+
+// Restyle a subtree changed since the last cascade, e.g. by a script.
+void css_restyle_subtree(CSSStyleSheet* sheet, DOMNode* node);
+
+// Does the node match a selector (a comma-separated group of compound
+// selectors, as supported by the cascade)?
+int css_matches_selector(DOMNode* node, const char* selector);
+
+// Counters from the most recent apply_stylesheet_to_dom() call.
+typedef struct {
+    int nodes_styled;      // nodes that ended up with a computed style
+    int styles_allocated;  // distinct ComputedStyle objects created
+    int share_hits;        // nodes resolved through the style sharing cache
+    int subtrees_pruned;   // display:none subtrees skipped by style and layout
+    int inline_blocks_parsed; // distinct style="..." attributes parsed
+    int inline_cache_hits;    // style attributes served from the parse cache
+} CSSStyleStats;
+
+void css_style_stats(CSSStyleStats* out);
+
+// Worker threads used to style large documents (0 = one per CPU, 1 = serial).
+void css_set_style_threads(int threads);
+
+// Display of a node: the style pass result, or the tag default if unstyled.
+DisplayType css_node_display(const DOMNode* node);
 
 // A helper: if a DOM node has no computed style, allocate one.
 void ensure_computed_style(DOMNode* node);
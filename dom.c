@@ -0,0 +1,739 @@
+#include "dom.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+  Script access to the DOM:
+  - A node gets its JS wrapper the first time a script sees it. The wrapper is
+    remembered, so the same node always comes back as the same object.
+  - getElementById goes through an id -> node index that is updated as scripts
+    attach, detach and re-id nodes.
+  - Mutations only mark subtrees dirty. dom_flush restyles them in one batch
+    and the caller lays the page out once afterwards.
+  - Nodes that scripts create or remove may still be referenced from JS, so
+    they are only freed with the bindings unless nothing can reach them.
+  - The layout on screen points into the DOM until the page is laid out
+    again, so removed subtrees and replaced text are kept until then.
+*/
+
+// --- Node sets ---
+// Open addressing keyed by node pointer; entries are never removed.
+
+typedef struct {
+    DOMNode* node;
+    const char* ref;  // registry key of the node's wrapper
+} NodeSlot;
+
+typedef struct {
+    NodeSlot* slots;
+    int count, capacity;  // capacity is a power of two
+} NodeSet;
+
+static unsigned hash_node(const DOMNode* node) {
+    return (unsigned)(((uintptr_t)node >> 4) * 2654435761u);
+}
+
+static NodeSlot* node_slot(NodeSet* set, const DOMNode* node) {
+    unsigned mask = set->capacity - 1;
+    unsigned i = hash_node(node) & mask;
+    while (set->slots[i].node && set->slots[i].node != node)
+        i = (i + 1) & mask;
+    return &set->slots[i];
+}
+
+static NodeSlot* node_find(NodeSet* set, const DOMNode* node) {
+    if (set->count == 0) return NULL;
+    NodeSlot* slot = node_slot(set, node);
+    return slot->node ? slot : NULL;
+}
+
+// The slot of a node, added if it isn't there yet.
+static NodeSlot* node_add(NodeSet* set, DOMNode* node) {
+    if ((set->count + 1) * 2 > set->capacity) {
+        NodeSlot* old = set->slots;
+        int old_capacity = set->capacity;
+        set->capacity = old_capacity ? old_capacity * 2 : 64;
+        set->slots = calloc(set->capacity, sizeof(NodeSlot));
+        for (int i = 0; i < old_capacity; i++)
+            if (old[i].node) *node_slot(set, old[i].node) = old[i];
+        free(old);
+    }
+    NodeSlot* slot = node_slot(set, node);
+    if (!slot->node) {
+        slot->node = node;
+        slot->ref = NULL;
+        set->count++;
+    }
+    return slot;
+}
+
+static void node_clear(NodeSet* set) {
+    free(set->slots);
+    memset(set, 0, sizeof *set);
+}
+
+// --- Id index ---
+// Chained by hash of the id; nodes sharing an id stay in insertion order, so
+// the first one in the document wins.
+
+typedef struct IdEntry {
+    DOMNode* node;  // keyed by node->id
+    struct IdEntry* next;
+} IdEntry;
+
+typedef struct {
+    IdEntry** buckets;
+    int count, capacity;  // capacity is a power of two
+} IdIndex;
+
+static unsigned hash_id(const char* s) {
+    unsigned h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static void id_append(IdIndex* index, IdEntry* e) {
+    IdEntry** p = &index->buckets[hash_id(e->node->id) & (index->capacity - 1)];
+    while (*p) p = &(*p)->next;
+    e->next = NULL;
+    *p = e;
+}
+
+static void id_add(IdIndex* index, DOMNode* node) {
+    if (index->count >= index->capacity) {
+        IdEntry** old = index->buckets;
+        int old_capacity = index->capacity;
+        index->capacity = old_capacity ? old_capacity * 2 : 64;
+        index->buckets = calloc(index->capacity, sizeof(IdEntry*));
+        for (int i = 0; i < old_capacity; i++) {
+            IdEntry* e = old[i];
+            while (e) {
+                IdEntry* next = e->next;
+                id_append(index, e);
+                e = next;
+            }
+        }
+        free(old);
+    }
+    IdEntry* e = malloc(sizeof *e);
+    if (!e) return;
+    e->node = node;
+    id_append(index, e);
+    index->count++;
+}
+
+static void id_remove(IdIndex* index, DOMNode* node) {
+    if (!index->capacity) return;
+    IdEntry** p = &index->buckets[hash_id(node->id) & (index->capacity - 1)];
+    for (; *p; p = &(*p)->next) {
+        if ((*p)->node == node) {
+            IdEntry* e = *p;
+            *p = e->next;
+            free(e);
+            index->count--;
+            return;
+        }
+    }
+}
+
+static DOMNode* id_lookup(IdIndex* index, const char* id) {
+    if (!index->capacity) return NULL;
+    IdEntry* e = index->buckets[hash_id(id) & (index->capacity - 1)];
+    for (; e; e = e->next)
+        if (strcmp(e->node->id, id) == 0) return e->node;
+    return NULL;
+}
+
+static void id_clear(IdIndex* index) {
+    for (int i = 0; i < index->capacity; i++) {
+        IdEntry* e = index->buckets[i];
+        while (e) {
+            IdEntry* next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(index->buckets);
+    memset(index, 0, sizeof *index);
+}
+
+// --- Bindings ---
+
+// Something taken out of the page that the current layout may still use.
+typedef struct {
+    DOMNode* node;  // a detached subtree nothing else refers to, or
+    char* text;     // the old text of a text node
+} Grave;
+
+struct DOMBindings {
+    DOMNode* root;
+    CSSStyleSheet* sheet;
+    NodeSet wrappers;   // nodes scripts have seen, with their wrappers
+    NodeSet orphans;    // nodes scripts created or removed
+    NodeSet dirty;      // subtrees to restyle at the next flush
+    IdIndex ids;        // elements with an id in the document
+    Grave* graves;      // freed by dom_laid_out
+    int grave_count, grave_capacity;
+    int layout_dirty;
+};
+
+static int is_text(const DOMNode* node) {
+    return node->name && strcmp(node->name, "#text") == 0;
+}
+
+static int is_element(const DOMNode* node) {
+    return node->name && node->name[0] != '#';
+}
+
+static int is_connected(DOMBindings* dom, DOMNode* node) {
+    while (node->parent) node = node->parent;
+    return node == dom->root;
+}
+
+static int is_inclusive_ancestor(const DOMNode* ancestor, const DOMNode* node) {
+    for (; node; node = node->parent)
+        if (node == ancestor) return 1;
+    return 0;
+}
+
+static void index_subtree(DOMBindings* dom, DOMNode* node, int add) {
+    if (node->id) {
+        if (add) id_add(&dom->ids, node);
+        else id_remove(&dom->ids, node);
+    }
+    for (int i = 0; i < node->children_count; i++)
+        index_subtree(dom, node->children[i], add);
+}
+
+// Text is restyled (and split into words) by its parent.
+static void mark_dirty(DOMBindings* dom, DOMNode* node) {
+    if (is_text(node)) node = node->parent;
+    if (!node) return;
+    node_add(&dom->dirty, node);
+    dom->layout_dirty = 1;
+}
+
+// Can a script or one of the sets still get at a node of this subtree?
+static int is_referenced(DOMBindings* dom, DOMNode* node) {
+    if (node_find(&dom->wrappers, node) || node_find(&dom->orphans, node) ||
+        node_find(&dom->dirty, node))
+        return 1;
+    for (int i = 0; i < node->children_count; i++)
+        if (is_referenced(dom, node->children[i])) return 1;
+    return 0;
+}
+
+// Free a node or text at the next layout. If the queue can't grow it is
+// leaked, which is better than freeing it under the layout.
+static void bury(DOMBindings* dom, DOMNode* node, char* text) {
+    if (dom->grave_count >= dom->grave_capacity) {
+        int newcap = dom->grave_capacity ? dom->grave_capacity * 2 : 16;
+        Grave* tmp = realloc(dom->graves, sizeof(Grave) * newcap);
+        if (!tmp) return;
+        dom->graves = tmp;
+        dom->grave_capacity = newcap;
+    }
+    dom->graves[dom->grave_count].node = node;
+    dom->graves[dom->grave_count].text = text;
+    dom->grave_count++;
+}
+
+// Drop a node that has just left its parent.
+static void release(DOMBindings* dom, DOMNode* node) {
+    if (is_referenced(dom, node))
+        node_add(&dom->orphans, node);
+    else
+        bury(dom, node, NULL);
+}
+
+static void detach(DOMBindings* dom, DOMNode* node) {
+    DOMNode* parent = node->parent;
+    if (!parent) return;
+    if (is_connected(dom, parent)) {
+        index_subtree(dom, node, 0);
+        dom->layout_dirty = 1;
+    }
+    remove_child(parent, node);
+    node_add(&dom->orphans, node);
+}
+
+static void attach(DOMBindings* dom, DOMNode* parent, DOMNode* node) {
+    detach(dom, node);
+    add_child(parent, node);
+    if (node->parent != parent) return;  // out of memory: stays an orphan
+    if (is_connected(dom, parent)) index_subtree(dom, node, 1);
+    mark_dirty(dom, node);
+}
+
+static void remove_children(DOMBindings* dom, DOMNode* node) {
+    int connected = is_connected(dom, node);
+    for (int i = 0; i < node->children_count; i++) {
+        DOMNode* child = node->children[i];
+        if (connected) index_subtree(dom, child, 0);
+        child->parent = NULL;
+        release(dom, child);
+    }
+    node->children_count = 0;
+    dom->layout_dirty = 1;
+}
+
+// --- Wrappers ---
+
+static int node_has(js_State* J, void* data, const char* name);
+static int node_put(js_State* J, void* data, const char* name);
+
+static void push_node(js_State* J, DOMNode* node) {
+    DOMBindings* dom = js_getcontext(J);
+    if (!node) {
+        js_pushnull(J);
+        return;
+    }
+    NodeSlot* slot = node_find(&dom->wrappers, node);
+    if (slot) {
+        js_getregistry(J, slot->ref);
+        return;
+    }
+    js_getregistry(J, node == dom->root ? "Document" : "Element");
+    js_newuserdatax(J, "node", node, node_has, node_put, NULL, NULL);
+    js_copy(J, -1);
+    const char* ref = js_ref(J);
+    node_add(&dom->wrappers, node)->ref = ref;
+}
+
+static DOMNode* to_node(js_State* J, int idx) {
+    return js_touserdata(J, idx, "node");
+}
+
+// --- Text and markup ---
+
+typedef struct {
+    char* data;
+    size_t len, cap;
+} TextBuffer;
+
+static void append(TextBuffer* b, const char* s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (b->len + n + 1 > cap) cap *= 2;
+        char* data = realloc(b->data, cap);
+        if (!data) return;
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+}
+
+static void append_str(TextBuffer* b, const char* s) {
+    append(b, s, strlen(s));
+}
+
+static void append_escaped(TextBuffer* b, const char* s, int attribute) {
+    for (; *s; s++) {
+        switch (*s) {
+        case '&': append_str(b, "&amp;"); break;
+        case '<': append_str(b, "&lt;"); break;
+        case '>': append_str(b, "&gt;"); break;
+        case '"':
+            if (attribute) { append_str(b, "&quot;"); break; }
+            // fall through
+        default: append(b, s, 1); break;
+        }
+    }
+}
+
+static void push_buffer(js_State* J, TextBuffer* b) {
+    if (js_try(J)) {
+        free(b->data);
+        js_throw(J);
+    }
+    js_pushstring(J, b->data ? b->data : "");
+    js_endtry(J);
+    free(b->data);
+}
+
+// Text was split into one node per word, so adjacent text siblings get the
+// space back between them.
+static void collect_text(const DOMNode* node, TextBuffer* b) {
+    if (is_text(node)) {
+        if (node->text) append_str(b, node->text);
+        return;
+    }
+    for (int i = 0; i < node->children_count; i++) {
+        if (i > 0 && is_text(node->children[i]) && is_text(node->children[i - 1]))
+            append_str(b, " ");
+        collect_text(node->children[i], b);
+    }
+}
+
+static int is_void_element(const char* name) {
+    static const char* const tags[] = {"area", "br", "col", "embed", "hr", "img",
+                                       "input", "link", "meta", "source", "wbr"};
+    for (size_t i = 0; i < sizeof tags / sizeof tags[0]; i++)
+        if (strcasecmp(name, tags[i]) == 0) return 1;
+    return 0;
+}
+
+static void append_attribute(TextBuffer* b, const char* name, const char* value) {
+    if (!value) return;
+    append_str(b, " ");
+    append_str(b, name);
+    append_str(b, "=\"");
+    append_escaped(b, value, 1);
+    append_str(b, "\"");
+}
+
+static void serialize_children(const DOMNode* node, TextBuffer* b) {
+    for (int i = 0; i < node->children_count; i++) {
+        const DOMNode* child = node->children[i];
+        if (is_text(child)) {
+            if (i > 0 && is_text(node->children[i - 1])) append_str(b, " ");
+            if (child->text) append_escaped(b, child->text, 0);
+        } else if (is_element(child)) {
+            append_str(b, "<");
+            append_str(b, child->name);
+            append_attribute(b, "id", child->id);
+            append_attribute(b, "class", child->class_name);
+            append_attribute(b, "style", child->style_attr);
+            append_attribute(b, "href", child->href);
+            append_str(b, ">");
+            if (is_void_element(child->name)) continue;
+            serialize_children(child, b);
+            append_str(b, "</");
+            append_str(b, child->name);
+            append_str(b, ">");
+        }
+    }
+}
+
+static void set_text_content(js_State* J, DOMNode* node, const char* text) {
+    DOMBindings* dom = js_getcontext(J);
+    if (is_text(node)) {
+        char* copy = strdup(text);
+        if (!copy) js_error(J, "out of memory");
+        if (node->text) bury(dom, NULL, node->text);
+        node->text = copy;
+    } else {
+        remove_children(dom, node);
+        if (*text) add_child(node, create_dom_node("#text", text));
+    }
+    mark_dirty(dom, node);
+}
+
+static void set_inner_html(js_State* J, DOMNode* node, const char* html) {
+    DOMBindings* dom = js_getcontext(J);
+    DOMNode* fragment = parse_html_fragment(html);
+    if (!fragment) js_error(J, "cannot parse markup");
+
+    remove_children(dom, node);
+    int connected = is_connected(dom, node);
+    for (int i = 0; i < fragment->children_count; i++) {
+        DOMNode* child = fragment->children[i];
+        add_child(node, child);
+        if (child->parent != node) {
+            free_dom(child);
+            continue;
+        }
+        if (connected) index_subtree(dom, child, 1);
+    }
+    fragment->children_count = 0;
+    free_dom(fragment);
+    mark_dirty(dom, node);
+}
+
+static void set_id(js_State* J, DOMNode* node, const char* id) {
+    DOMBindings* dom = js_getcontext(J);
+    char* copy = NULL;
+    if (*id && !(copy = strdup(id))) js_error(J, "out of memory");
+    int indexed = node->id && is_connected(dom, node);
+    if (indexed) id_remove(&dom->ids, node);
+    free(node->id);
+    node->id = copy;
+    if (node->id && is_connected(dom, node)) id_add(&dom->ids, node);
+    mark_dirty(dom, node);
+}
+
+static void set_class_name(js_State* J, DOMNode* node, const char* class_name) {
+    char* copy = NULL;
+    if (*class_name && !(copy = strdup(class_name))) js_error(J, "out of memory");
+    free(node->class_name);
+    node->class_name = copy;
+    mark_dirty(js_getcontext(J), node);
+}
+
+static DOMNode* find_child(const DOMNode* node, const char* name) {
+    if (!node) return NULL;
+    for (int i = 0; i < node->children_count; i++)
+        if (node->children[i]->name && strcasecmp(node->children[i]->name, name) == 0)
+            return node->children[i];
+    return NULL;
+}
+
+// --- Properties ---
+
+static int node_has(js_State* J, void* data, const char* name) {
+    DOMBindings* dom = js_getcontext(J);
+    DOMNode* node = data;
+
+    if (strcmp(name, "textContent") == 0) {
+        TextBuffer b = {0};
+        collect_text(node, &b);
+        push_buffer(J, &b);
+    } else if (strcmp(name, "innerHTML") == 0) {
+        TextBuffer b = {0};
+        serialize_children(node, &b);
+        push_buffer(J, &b);
+    } else if (strcmp(name, "id") == 0) {
+        js_pushstring(J, node->id ? node->id : "");
+    } else if (strcmp(name, "className") == 0) {
+        js_pushstring(J, node->class_name ? node->class_name : "");
+    } else if (strcmp(name, "tagName") == 0) {
+        if (!is_element(node) || node == dom->root) {
+            js_pushundefined(J);
+        } else {
+            char tag[64];
+            size_t n = 0;
+            for (; node->name[n] && n < sizeof tag - 1; n++)
+                tag[n] = toupper((unsigned char)node->name[n]);
+            tag[n] = '\0';
+            js_pushstring(J, tag);
+        }
+    } else if (strcmp(name, "parentNode") == 0) {
+        push_node(J, node->parent);
+    } else if (strcmp(name, "children") == 0) {
+        js_newarray(J);
+        int n = 0;
+        for (int i = 0; i < node->children_count; i++) {
+            if (!is_element(node->children[i])) continue;
+            push_node(J, node->children[i]);
+            js_setindex(J, -2, n++);
+        }
+    } else if (node == dom->root && strcmp(name, "documentElement") == 0) {
+        push_node(J, find_child(node, "html"));
+    } else if (node == dom->root && strcmp(name, "body") == 0) {
+        push_node(J, find_child(find_child(node, "html"), "body"));
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static int node_put(js_State* J, void* data, const char* name) {
+    DOMNode* node = data;
+
+    if (strcmp(name, "textContent") == 0)
+        set_text_content(J, node, js_tostring(J, -1));
+    else if (strcmp(name, "innerHTML") == 0)
+        set_inner_html(J, node, js_tostring(J, -1));
+    else if (strcmp(name, "id") == 0)
+        set_id(J, node, js_tostring(J, -1));
+    else if (strcmp(name, "className") == 0)
+        set_class_name(J, node, js_tostring(J, -1));
+    else if (strcmp(name, "tagName") == 0 || strcmp(name, "parentNode") == 0 ||
+             strcmp(name, "children") == 0)
+        ;  // read-only
+    else
+        return 0;
+    return 1;
+}
+
+// --- Methods ---
+
+static void element_append_child(js_State* J) {
+    DOMBindings* dom = js_getcontext(J);
+    DOMNode* parent = to_node(J, 0);
+    DOMNode* child = to_node(J, 1);
+    if (child == dom->root || is_inclusive_ancestor(child, parent))
+        js_error(J, "HierarchyRequestError: the new child contains the parent");
+    if (is_text(parent))
+        js_error(J, "HierarchyRequestError: text nodes have no children");
+    attach(dom, parent, child);
+    js_copy(J, 1);
+}
+
+static void element_remove_child(js_State* J) {
+    DOMBindings* dom = js_getcontext(J);
+    DOMNode* parent = to_node(J, 0);
+    DOMNode* child = to_node(J, 1);
+    if (child->parent != parent)
+        js_error(J, "NotFoundError: the node is not a child of this node");
+    detach(dom, child);
+    js_copy(J, 1);
+}
+
+// "#name" alone can go through the id index.
+static const char* id_selector(const char* selector) {
+    if (selector[0] != '#' || !selector[1]) return NULL;
+    for (const char* p = selector + 1; *p; p++)
+        if (isspace((unsigned char)*p) || strchr(".#:[>+~,*", *p)) return NULL;
+    return selector + 1;
+}
+
+static DOMNode* find_first(DOMNode* node, const char* selector) {
+    for (int i = 0; i < node->children_count; i++) {
+        DOMNode* child = node->children[i];
+        if (!is_element(child)) continue;
+        if (css_matches_selector(child, selector)) return child;
+        DOMNode* found = find_first(child, selector);
+        if (found) return found;
+    }
+    return NULL;
+}
+
+static void find_all(js_State* J, DOMNode* node, const char* selector, int* n) {
+    for (int i = 0; i < node->children_count; i++) {
+        DOMNode* child = node->children[i];
+        if (!is_element(child)) continue;
+        if (css_matches_selector(child, selector)) {
+            push_node(J, child);
+            js_setindex(J, -2, (*n)++);
+        }
+        find_all(J, child, selector, n);
+    }
+}
+
+static void element_query_selector(js_State* J) {
+    DOMBindings* dom = js_getcontext(J);
+    DOMNode* node = to_node(J, 0);
+    const char* selector = js_tostring(J, 1);
+    const char* id = id_selector(selector);
+    if (id && is_connected(dom, node)) {
+        DOMNode* found = id_lookup(&dom->ids, id);
+        if (found && found != node && is_inclusive_ancestor(node, found)) {
+            push_node(J, found);
+            return;
+        }
+    }
+    push_node(J, find_first(node, selector));
+}
+
+static void element_query_selector_all(js_State* J) {
+    DOMNode* node = to_node(J, 0);
+    const char* selector = js_tostring(J, 1);
+    int n = 0;
+    js_newarray(J);
+    find_all(J, node, selector, &n);
+}
+
+static void document_get_element_by_id(js_State* J) {
+    DOMBindings* dom = js_getcontext(J);
+    push_node(J, id_lookup(&dom->ids, js_tostring(J, 1)));
+}
+
+static void document_create_element(js_State* J) {
+    DOMBindings* dom = js_getcontext(J);
+    const char* tag = js_tostring(J, 1);
+    if (!*tag || *tag == '#')
+        js_error(J, "InvalidCharacterError: bad tag name '%s'", tag);
+    DOMNode* node = create_dom_node(tag, NULL);
+    if (!node || !node->name) js_error(J, "out of memory");
+    for (char* p = node->name; *p; p++) *p = tolower((unsigned char)*p);
+    node_add(&dom->orphans, node);
+    push_node(J, node);
+}
+
+static void document_create_text_node(js_State* J) {
+    DOMBindings* dom = js_getcontext(J);
+    DOMNode* node = create_dom_node("#text", js_tostring(J, 1));
+    if (!node || !node->text) js_error(J, "out of memory");
+    node_add(&dom->orphans, node);
+    push_node(J, node);
+}
+
+static void add_method(js_State* J, const char* name, js_CFunction fun, int length) {
+    js_newcfunction(J, fun, name, length);
+    js_defproperty(J, -2, name, JS_DONTENUM);
+}
+
+void dom_init_prototypes(js_State* J) {
+    js_newobject(J);
+    add_method(J, "appendChild", element_append_child, 1);
+    add_method(J, "removeChild", element_remove_child, 1);
+    add_method(J, "querySelector", element_query_selector, 1);
+    add_method(J, "querySelectorAll", element_query_selector_all, 1);
+    js_copy(J, -1);
+    js_setregistry(J, "Element");
+
+    js_newobjectx(J);  // inherits from Element
+    add_method(J, "getElementById", document_get_element_by_id, 1);
+    add_method(J, "createElement", document_create_element, 1);
+    add_method(J, "createTextNode", document_create_text_node, 1);
+    js_setregistry(J, "Document");
+}
+
+// --- Page lifetime ---
+
+DOMBindings* dom_bind(js_State* J, DOMNode* root, CSSStyleSheet* sheet) {
+    DOMBindings* dom = calloc(1, sizeof *dom);
+    if (!dom) return NULL;
+    dom->root = root;
+    dom->sheet = sheet;
+    index_subtree(dom, root, 1);
+
+    js_setcontext(J, dom);
+    push_node(J, root);
+    js_setglobal(J, "document");
+    return dom;
+}
+
+int dom_changed(DOMBindings* dom) {
+    return dom && dom->layout_dirty;
+}
+
+int dom_flush(DOMBindings* dom) {
+    if (!dom) return 0;
+    for (int i = 0; i < dom->dirty.capacity; i++) {
+        DOMNode* node = dom->dirty.slots[i].node;
+        if (!node || !is_connected(dom, node)) continue;
+
+        // Restyling a dirty ancestor covers this one.
+        DOMNode* up = node->parent;
+        while (up && !node_find(&dom->dirty, up)) up = up->parent;
+        if (up) continue;
+
+        split_text_nodes(node);
+        css_restyle_subtree(dom->sheet, node);
+    }
+    node_clear(&dom->dirty);
+
+    int changed = dom->layout_dirty;
+    dom->layout_dirty = 0;
+    return changed;
+}
+
+void dom_laid_out(DOMBindings* dom) {
+    if (!dom) return;
+    for (int i = 0; i < dom->grave_count; i++) {
+        if (dom->graves[i].node) free_dom(dom->graves[i].node);
+        free(dom->graves[i].text);
+    }
+    dom->grave_count = 0;
+}
+
+void dom_unbind(DOMBindings* dom) {
+    if (!dom) return;
+    dom_laid_out(dom);
+    free(dom->graves);
+
+    // Free the roots of detached trees only: freeing one frees what is
+    // below it, and nodes that went back into the page stay there.
+    DOMNode** dead = malloc(sizeof(DOMNode*) * (dom->orphans.count + 1));
+    int n = 0;
+    for (int i = 0; dead && i < dom->orphans.capacity; i++) {
+        DOMNode* node = dom->orphans.slots[i].node;
+        if (node && !node->parent && node != dom->root) dead[n++] = node;
+    }
+    for (int i = 0; i < n; i++) free_dom(dead[i]);
+    free(dead);
+
+    node_clear(&dom->wrappers);
+    node_clear(&dom->orphans);
+    node_clear(&dom->dirty);
+    id_clear(&dom->ids);
+    free(dom);
+}
@@ -0,0 +1,33 @@
+#ifndef DOM_H
+#define DOM_H
+
+#include "parser.h"
+#include "css.h"
+#include "mujs/mujs.h"
+
+typedef struct DOMBindings DOMBindings;
+
+// Define the Element and Document prototypes in a realm. They don't depend on
+// any page, so this runs once in the realm that every page state is copied from.
+void dom_init_prototypes(js_State* J);
+
+// Expose the page under root as `document`. The sheet (may be NULL) restyles
+// subtrees that scripts change.
+DOMBindings* dom_bind(js_State* J, DOMNode* root, CSSStyleSheet* sheet);
+
+// Have scripts changed anything since the last flush?
+int dom_changed(DOMBindings* dom);
+
+// Restyle everything scripts changed since the last flush, in one batch.
+// Returns nonzero if the layout is out of date.
+int dom_flush(DOMBindings* dom);
+
+// The page has been laid out again: free the nodes and text scripts took out
+// of it, which the previous layout could still point at.
+void dom_laid_out(DOMBindings* dom);
+
+// Free the bindings and every node scripts created or removed that didn't
+// end up in the page. Call after the state is freed.
+void dom_unbind(DOMBindings* dom);
+
+#endif
@@ -1,18 +1,87 @@
 #include "javascript.h"
 #include "parser.h"
+#include "dom.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "mujs/mujs.h"
 
 /*
   A very naive approach:
-  - Create one MuJS state.
+  - Create one MuJS state per page, copied from a pristine snapshot.
   - Recursively find all <script> nodes in the DOM.
   - Evaluate the concatenated #text children as JavaScript source.
-  (No DOM integration, no browser APIs; just raw JavaScript evaluation.)
+  - Scripts see the page through `document` (dom.c); whatever they change is
+    restyled in one batch after the last script.
+  - A loader thread compiles the scripts while the page is laid out and
+    painted, then runs them in slices between frames. While a script runs
+    the render loop waits for it, so only one thread touches the DOM; the
+    restyles it causes are applied on the render thread by dom_flush. A
+    script that runs longer than XS_SCRIPT_BUDGET_MS in total is aborted.
+  - setTimeout/setInterval, requestAnimationFrame and queueMicrotask keep the
+    page's state alive after that. The render loop sleeps until the next
+    deadline and calls page_scripts_tick, which runs what is due and
+    restyles at most once per frame.
 */
 
+// Pages restyle and relayout at most this often, in milliseconds.
+#define FRAME_MS 16
+
+// Script time per frame while the page loads, in milliseconds.
+#define SLICE_MS 8
+
+// How often the render loop looks in while the loader compiles, in ms.
+#define COMPILE_POLL_MS 4
+
+// Default for XS_SCRIPT_BUDGET_MS; 0 means no limit.
+#define SCRIPT_BUDGET_MS 5000
+
+// Run limit checks (calls and loop iterations) between looks at the clock.
+#define SLICE_CHECK_INTERVAL 256
+
+// Longest garbage collector pause per step, in microseconds.
+#define JS_GC_BUDGET_USEC 2000
+
+// Compiled scripts are cached here across runs. XS_JS_CACHE names another
+// directory; set it empty to compile every script from source.
+static char *script_cache_dir(void) {
+    const char *env = getenv("XS_JS_CACHE");
+    char path[4096];
+
+    if (env) {
+        if (!*env) return NULL;
+        snprintf(path, sizeof path, "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        snprintf(path, sizeof path, "%s/xs/scripts", env);
+    } else if ((env = getenv("HOME")) && *env) {
+        snprintf(path, sizeof path, "%s/.cache/xs/scripts", env);
+    } else {
+        return NULL;
+    }
+
+    // mkdir -p
+    for (char *p = path + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            if (mkdir(path, 0755) != 0 && errno != EEXIST) return NULL;
+            *p = c;
+            if (!c) break;
+        }
+    }
+    return strdup(path);
+}
+
+static double script_budget_ms(void) {
+    const char *env = getenv("XS_SCRIPT_BUDGET_MS");
+    return env && *env ? atof(env) : SCRIPT_BUDGET_MS;
+}
+
 static char *collect_script_text(DOMNode *node) {
     if (!node) return NULL;
 
@@ -44,31 +113,584 @@ static char *collect_script_text(DOMNode *node) {
     return source;
 }
 
-static void traverse_and_run_scripts(DOMNode* node, js_State* J) {
+// --- Timers and task queues ---
+
+typedef struct {
+    double due;       // milliseconds on the monotonic clock
+    unsigned seq;     // orders timers with the same deadline
+    int id;
+    double interval;  // 0 for setTimeout
+} Timer;
+
+struct PageScripts {
+    js_State* J;
+    DOMBindings* dom;
+    Timer* timers;          // min-heap by (due, seq)
+    int timer_count, timer_capacity;
+    int* frames;            // requestAnimationFrame callbacks, in order
+    int frame_count, frame_capacity;
+    int* microtasks;
+    int microtask_count, microtask_capacity;
+    int next_id;
+    unsigned next_seq;
+    double next_frame;      // earliest time the next frame may run
+
+    // Page load: the sources are taken up front, since scripts may remove
+    // the <script> nodes that follow them.
+    char** sources;
+    int source_count, source_capacity;
+    int loading;            // the loader has scripts left to run
+    int threaded;           // ... on its own thread
+    int loader_turn;        // the loader has control
+    int cancel;             // stop loading, the page is going away
+    int aborting;           // the current script or callback ran out of budget
+    double budget;          // per script or callback, in ms of running time
+    double ran;             // running time of the current script so far
+    double slice_start, slice_end;
+    pthread_t loader;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Callbacks live in the registry under their id until they are cancelled or
+// have run for the last time; queues only hold ids.
+static void callback_key(char* buf, int id) {
+    sprintf(buf, "xs.cb.%d", id);
+}
+
+static int store_callback(js_State* J, PageScripts* page, int idx) {
+    char key[32];
+    if (js_isstring(J, idx))
+        js_loadstring(J, "[timer]", js_tostring(J, idx));
+    else if (js_iscallable(J, idx))
+        js_copy(J, idx);
+    else
+        js_typeerror(J, "callback is not a function");
+    int id = ++page->next_id;
+    callback_key(key, id);
+    js_setregistry(J, key);
+    return id;
+}
+
+static void push_id(js_State* J, int** list, int* count, int* capacity, int id) {
+    if (*count >= *capacity) {
+        int newcap = *capacity ? *capacity * 2 : 16;
+        int* tmp = realloc(*list, sizeof(int) * newcap);
+        if (!tmp) js_error(J, "out of memory");
+        *list = tmp;
+        *capacity = newcap;
+    }
+    (*list)[(*count)++] = id;
+}
+
+static int timer_before(const Timer* a, const Timer* b) {
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void push_timer(js_State* J, PageScripts* page, Timer t) {
+    if (page->timer_count >= page->timer_capacity) {
+        int newcap = page->timer_capacity ? page->timer_capacity * 2 : 16;
+        Timer* tmp = realloc(page->timers, sizeof(Timer) * newcap);
+        if (!tmp) js_error(J, "out of memory");
+        page->timers = tmp;
+        page->timer_capacity = newcap;
+    }
+    t.seq = page->next_seq++;
+    int i = page->timer_count++;
+    while (i > 0 && timer_before(&t, &page->timers[(i - 1) / 2])) {
+        page->timers[i] = page->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    page->timers[i] = t;
+}
+
+static Timer pop_timer(PageScripts* page) {
+    Timer top = page->timers[0];
+    Timer last = page->timers[--page->timer_count];
+    int n = page->timer_count, i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n) break;
+        if (child + 1 < n && timer_before(&page->timers[child + 1], &page->timers[child]))
+            child++;
+        if (!timer_before(&page->timers[child], &last)) break;
+        page->timers[i] = page->timers[child];
+        i = child;
+    }
+    if (n > 0) page->timers[i] = last;
+    return top;
+}
+
+static void script_interrupt(js_State* J, void* data);
+
+// Every script and callback gets the interrupt and its own budget, so one
+// that never returns is aborted instead of hanging the page.
+static void begin_task(PageScripts* page) {
+    page->ran = 0;
+    page->aborting = 0;
+    page->slice_start = now_ms();
+    js_setinterrupt(page->J, script_interrupt, page, SLICE_CHECK_INTERVAL);
+}
+
+static void end_task(PageScripts* page) {
+    js_setinterrupt(page->J, NULL, NULL, 0);
+}
+
+// Call a stored callback; one-shot callbacks are dropped before they run, so
+// cancelling them from inside is harmless. Returns 0 if it was cancelled.
+static int run_callback(PageScripts* page, int id, int keep, const char* what, double arg) {
+    js_State* J = page->J;
+    char key[32];
+    callback_key(key, id);
+    js_getregistry(J, key);
+    if (!js_iscallable(J, -1)) {
+        js_pop(J, 1);
+        return 0;
+    }
+    if (!keep) js_delregistry(J, key);
+    js_pushundefined(J);
+    int nargs = 0;
+    if (arg >= 0) {
+        js_pushnumber(J, arg);
+        nargs = 1;
+    }
+    begin_task(page);
+    if (js_pcall(J, nargs))
+        fprintf(stderr, "Script error in %s: %s\n", what, js_trystring(J, -1, "Error"));
+    end_task(page);
+    js_pop(J, 1);
+    return 1;
+}
+
+static void run_microtasks(PageScripts* page) {
+    // Microtasks queued while draining run in the same drain.
+    for (int i = 0; i < page->microtask_count; i++)
+        run_callback(page, page->microtasks[i], 0, "microtask", -1);
+    page->microtask_count = 0;
+}
+
+static void set_timer(js_State* J, int repeat) {
+    PageScripts* page = js_currentfunctiondata(J);
+    double delay = js_isdefined(J, 2) ? js_tonumber(J, 2) : 0;
+    if (!(delay >= 0)) delay = 0;
+    if (delay > 2147483647.0) delay = 2147483647.0;
+    if (repeat && delay < 1) delay = 1;
+
+    Timer t;
+    t.id = store_callback(J, page, 1);
+    t.due = now_ms() + delay;
+    t.interval = repeat ? delay : 0;
+    push_timer(J, page, t);
+    js_pushnumber(J, t.id);
+}
+
+static void set_timeout(js_State* J) { set_timer(J, 0); }
+static void set_interval(js_State* J) { set_timer(J, 1); }
+
+// Timers and frames share one id space, so one function cancels both.
+static void clear_callback(js_State* J) {
+    if (js_isnumber(J, 1)) {
+        char key[32];
+        callback_key(key, js_toint32(J, 1));
+        js_delregistry(J, key);
+    }
+    js_pushundefined(J);
+}
+
+static void request_animation_frame(js_State* J) {
+    PageScripts* page = js_currentfunctiondata(J);
+    if (!js_iscallable(J, 1)) js_typeerror(J, "callback is not a function");
+    int id = store_callback(J, page, 1);
+    push_id(J, &page->frames, &page->frame_count, &page->frame_capacity, id);
+    js_pushnumber(J, id);
+}
+
+static void queue_microtask(js_State* J) {
+    PageScripts* page = js_currentfunctiondata(J);
+    if (!js_iscallable(J, 1)) js_typeerror(J, "callback is not a function");
+    int id = store_callback(J, page, 1);
+    push_id(J, &page->microtasks, &page->microtask_count, &page->microtask_capacity, id);
+    js_pushundefined(J);
+}
+
+static void define_global(PageScripts* page, const char* name, js_CFunction fun, int length) {
+    js_newcfunctionx(page->J, fun, name, length, page, NULL);
+    js_setglobal(page->J, name);
+}
+
+static void collect_scripts(DOMNode* node, PageScripts* page) {
     if (!node)
         return;
 
     if (node->name && strcasecmp(node->name, "script") == 0) {
         char *source = collect_script_text(node);
         if (source) {
-            if (js_dostring(J, source)) {
-                fprintf(stderr, "Script error in <script> block\n");
+            if (page->source_count >= page->source_capacity) {
+                int newcap = page->source_capacity ? page->source_capacity * 2 : 8;
+                char** tmp = realloc(page->sources, sizeof(char*) * newcap);
+                if (!tmp) {
+                    free(source);
+                    return;
+                }
+                page->sources = tmp;
+                page->source_capacity = newcap;
             }
-            free(source);
+            page->sources[page->source_count++] = source;
         }
     }
 
     for (int i = 0; i < node->children_count; i++) {
-        traverse_and_run_scripts(node->children[i], J);
+        collect_scripts(node->children[i], page);
     }
 }
 
-void run_scripts_in_dom(DOMNode* root) {
-    js_State* J = js_newstate(NULL, NULL, 0);
-    if (!J) {
+// --- Sliced loading ---
+
+// Loader thread: give control back and wait for the next slice.
+static void yield_to_page(PageScripts* page) {
+    pthread_mutex_lock(&page->lock);
+    page->loader_turn = 0;
+    pthread_cond_broadcast(&page->turn);
+    while (!page->loader_turn)
+        pthread_cond_wait(&page->turn, &page->lock);
+    pthread_mutex_unlock(&page->lock);
+}
+
+// Render thread: let the loader run for up to slice_ms, once it is done
+// with what it does in parallel.
+static void resume_loader(PageScripts* page, double slice_ms) {
+    pthread_mutex_lock(&page->lock);
+    while (page->loader_turn)
+        pthread_cond_wait(&page->turn, &page->lock);
+    page->slice_end = now_ms() + slice_ms;
+    page->loader_turn = 1;
+    pthread_cond_broadcast(&page->turn);
+    while (page->loader_turn)
+        pthread_cond_wait(&page->turn, &page->lock);
+    pthread_mutex_unlock(&page->lock);
+    if (!page->loading && page->threaded) {
+        pthread_join(page->loader, NULL);
+        page->threaded = 0;
+    }
+}
+
+// Throw at every later check too, like an aborted script, so a script that
+// catches the error still can't keep the closing page's loader busy.
+static void page_closed(js_State* J, PageScripts* page) {
+    js_setinterrupt(J, script_interrupt, page, 1);
+    js_error(J, "page closed");
+}
+
+// Render thread: the loader still has its first turn, compiling. Nothing has
+// run yet, so there is nothing to wait for.
+static int loader_compiling(PageScripts* page) {
+    pthread_mutex_lock(&page->lock);
+    int compiling = page->loading && page->loader_turn;
+    pthread_mutex_unlock(&page->lock);
+    return compiling;
+}
+
+// Runs inside the interpreter, between statements of the current script.
+// An aborted script is thrown at every check, so catch blocks can't keep it
+// alive.
+static void script_interrupt(js_State* J, void* data) {
+    PageScripts* page = data;
+    if (page->cancel)
+        page_closed(J, page);
+    if (page->aborting)
+        js_error(J, "script aborted");
+
+    double now = now_ms();
+    if (page->budget > 0 && page->ran + (now - page->slice_start) > page->budget) {
+        page->aborting = 1;
+        js_setinterrupt(J, script_interrupt, page, 1);
+        fprintf(stderr, "Script aborted after %.0f ms (XS_SCRIPT_BUDGET_MS)\n", page->budget);
+        js_error(J, "script exceeded its %.0f ms budget", page->budget);
+    }
+    if (page->threaded && now >= page->slice_end) {
+        page->ran += now - page->slice_start;
+        yield_to_page(page);
+        if (page->cancel)
+            page_closed(J, page);
+        page->slice_start = now_ms();
+    }
+}
+
+static void script_key(char* buf, int index) {
+    sprintf(buf, "xs.script.%d", index);
+}
+
+// Compile every script up front. This touches nothing but the page's own
+// state, so the loader does it while the page is laid out and painted. A
+// script that fails to compile keeps its error in place of the function.
+// Only <script> blocks go through the bytecode cache: string timer callbacks
+// are often built on the fly and would each leave a file behind.
+static void compile_sources(PageScripts* page) {
+    js_State* J = page->J;
+    char key[32];
+    char *cache_dir = script_cache_dir();
+    js_setcodecache(J, cache_dir);
+    free(cache_dir);
+    for (int i = 0; i < page->source_count; i++) {
+        js_ploadstring(J, "[string]", page->sources[i]);
+        script_key(key, i);
+        js_setregistry(J, key);
+        free(page->sources[i]);
+    }
+    free(page->sources);
+    page->sources = NULL;
+    js_setcodecache(J, NULL);
+}
+
+// Like js_dostring, for a script compile_sources has already seen.
+static int run_script(js_State* J, int index) {
+    char key[32];
+    script_key(key, index);
+    if (js_try(J)) {
+        js_report(J, js_trystring(J, -1, "Error"));
+        js_pop(J, 1);
+        return 1;
+    }
+    js_getregistry(J, key);
+    js_delregistry(J, key);
+    if (!js_iscallable(J, -1))
+        js_throw(J);
+    js_pushundefined(J);
+    js_call(J, 0);
+    js_pop(J, 1);
+    js_endtry(J);
+    return 0;
+}
+
+static void run_sources(PageScripts* page) {
+    js_State* J = page->J;
+    for (int i = 0; i < page->source_count && !page->cancel; i++) {
+        begin_task(page);
+        if (run_script(J, i)) {
+            fprintf(stderr, "Script error in <script> block\n");
+        }
+        end_task(page);
+        run_microtasks(page);
+    }
+}
+
+static void* loader_main(void* arg) {
+    PageScripts* page = arg;
+    compile_sources(page);
+    yield_to_page(page);
+    run_sources(page);
+    pthread_mutex_lock(&page->lock);
+    page->loading = 0;
+    page->loader_turn = 0;
+    pthread_cond_broadcast(&page->turn);
+    pthread_mutex_unlock(&page->lock);
+    return NULL;
+}
+
+// Start compiling on the loader thread and return at once; the scripts run
+// from page_scripts_tick after the first paint. Without a thread, load in
+// one go.
+static void start_loader(PageScripts* page) {
+    pthread_attr_t attr;
+    page->loading = 1;
+    page->loader_turn = 1;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 8 << 20);  // the interpreter recurses
+    page->threaded = pthread_create(&page->loader, &attr, loader_main, page) == 0;
+    pthread_attr_destroy(&attr);
+
+    if (!page->threaded) {
+        compile_sources(page);
+        run_sources(page);
+        page->loading = 0;
+        page->loader_turn = 0;
+    }
+}
+
+static js_State *new_realm(void) {
+    js_State *J = js_newstate(NULL, NULL, 0);
+    if (J) {
+        // Collect incrementally so a big script heap doesn't stall the page.
+        js_setgcbudget(J, JS_GC_BUDGET_USEC);
+        dom_init_prototypes(J);
+    }
+    return J;
+}
+
+// Building the builtins takes longer than copying them, so the first page
+// builds a realm once and every page gets a copy of it.
+static js_State *new_page_state(void) {
+    static js_Snapshot *pristine;
+    static int tried;
+
+    if (!tried) {
+        tried = 1;
+        js_State *J = new_realm();
+        if (J) {
+            pristine = js_newsnapshot(J);
+            js_freestate(J);
+        }
+    }
+    if (pristine) {
+        js_State *J = js_clonesnapshot(pristine);
+        if (J)
+            return J;
+    }
+    return new_realm();
+}
+
+static void report_cache_stats(PageScripts* page) {
+    js_CodeCacheStats stats;
+    js_getcodecachestats(page->J, &stats);
+    if (stats.hits + stats.misses > 0) {
+        printf("Ran %u scripts (%u from the bytecode cache, %.2f ms compiling, "
+               "%.2f ms saved)\n",
+               stats.hits + stats.misses, stats.hits, stats.compile_ms,
+               stats.saved_ms);
+    }
+}
+
+PageScripts* run_scripts_in_dom(DOMNode* root, CSSStyleSheet* sheet) {
+    PageScripts* page = calloc(1, sizeof *page);
+    if (!page) return NULL;
+    page->J = new_page_state();
+    if (!page->J) {
         fprintf(stderr, "Failed to create a MuJS state.\n");
-        return;
+        free(page);
+        return NULL;
+    }
+    pthread_mutex_init(&page->lock, NULL);
+    pthread_cond_init(&page->turn, NULL);
+    page->budget = script_budget_ms();
+    js_State* J = page->J;
+    page->dom = dom_bind(J, root, sheet);
+
+    js_pushglobal(J);
+    js_setglobal(J, "window");
+    define_global(page, "setTimeout", set_timeout, 2);
+    define_global(page, "setInterval", set_interval, 2);
+    define_global(page, "clearTimeout", clear_callback, 1);
+    define_global(page, "clearInterval", clear_callback, 1);
+    define_global(page, "requestAnimationFrame", request_animation_frame, 1);
+    define_global(page, "cancelAnimationFrame", clear_callback, 1);
+    define_global(page, "queueMicrotask", queue_microtask, 1);
+
+    collect_scripts(root, page);
+    if (page->source_count > 0)
+        start_loader(page);
+    if (!page->loading) {
+        report_cache_stats(page);
+        dom_flush(page->dom);
+    }
+    page->next_frame = now_ms() + FRAME_MS;
+
+    // Nothing can call back into a page without timers or frames.
+    if (!page->loading && page->timer_count == 0 && page->frame_count == 0) {
+        free_page_scripts(page);
+        return NULL;
+    }
+    return page;
+}
+
+int page_scripts_timeout(PageScripts* page) {
+    if (!page) return -1;
+    if (page->loading) return loader_compiling(page) ? COMPILE_POLL_MS : 0;
+    double due = -1;
+    if (page->timer_count > 0)
+        due = page->timers[0].due;
+    if ((page->frame_count > 0 || dom_changed(page->dom)) && (due < 0 || page->next_frame < due))
+        due = page->next_frame;
+    if (due < 0) return -1;
+    double wait = due - now_ms();
+    return wait <= 0 ? 0 : (int)ceil(wait);
+}
+
+int page_scripts_tick(PageScripts* page) {
+    if (!page) return 0;
+    double now = now_ms();
+
+    // Timers and frames wait for the page to finish loading; until then the
+    // frames only show what the scripts have done so far. The render loop
+    // doesn't wait for compilation, only for the slices that follow it.
+    if (page->loading) {
+        if (loader_compiling(page))
+            return 0;
+        resume_loader(page, SLICE_MS);
+        if (!page->loading)
+            report_cache_stats(page);
+        if (now < page->next_frame || !dom_changed(page->dom))
+            return 0;
+        page->next_frame = now + FRAME_MS;
+        return dom_flush(page->dom);
+    }
+
+    // Timers added by these callbacks wait for the next tick, even at 0 ms.
+    unsigned last_seq = page->next_seq;
+    while (page->timer_count > 0 && page->timers[0].due <= now &&
+           page->timers[0].seq < last_seq) {
+        Timer t = pop_timer(page);
+        int repeat = t.interval > 0;
+        if (!run_callback(page, t.id, repeat, repeat ? "setInterval callback" : "setTimeout callback", -1))
+            continue;
+        run_microtasks(page);
+        if (repeat) {
+            char key[32];
+            callback_key(key, t.id);
+            js_getregistry(page->J, key);
+            int alive = js_iscallable(page->J, -1);
+            js_pop(page->J, 1);
+            if (alive) {
+                t.due = now + t.interval;
+                if (js_try(page->J)) {
+                    js_pop(page->J, 1);
+                } else {
+                    push_timer(page->J, page, t);
+                    js_endtry(page->J);
+                }
+            }
+        }
     }
-    traverse_and_run_scripts(root, J);
-    js_freestate(J);
+
+    if (now < page->next_frame || (page->frame_count == 0 && !dom_changed(page->dom)))
+        return 0;
+
+    // One frame: the callbacks queued so far, then one restyle for them and
+    // every timer since the last frame.
+    int* frames = page->frames;
+    int count = page->frame_count;
+    page->frames = NULL;
+    page->frame_count = page->frame_capacity = 0;
+    for (int i = 0; i < count; i++) {
+        run_callback(page, frames[i], 0, "requestAnimationFrame callback", now);
+        run_microtasks(page);
+    }
+    free(frames);
+
+    page->next_frame = now + FRAME_MS;
+    return dom_flush(page->dom);
+}
+
+void page_scripts_laid_out(PageScripts* page) {
+    if (page) dom_laid_out(page->dom);
+}
+
+void free_page_scripts(PageScripts* page) {
+    if (!page) return;
+    page->cancel = 1;
+    while (page->loading)
+        resume_loader(page, SLICE_MS);
+    pthread_mutex_destroy(&page->lock);
+    pthread_cond_destroy(&page->turn);
+    js_freestate(page->J);
+    dom_unbind(page->dom);
+    free(page->timers);
+    free(page->frames);
+    free(page->microtasks);
+    free(page);
 }
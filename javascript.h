@@ -2,7 +2,30 @@
 #define JAVASCRIPT_H
 
 #include "parser.h"
+#include "css.h"
 
-void run_scripts_in_dom(DOMNode* root);
+typedef struct PageScripts PageScripts;
+
+// Start the page's scripts. They compile on a loader thread while the caller
+// lays out and paints the page, and run from page_scripts_tick after that.
+// The sheet (may be NULL) restyles what they change. Returns the page's
+// script state, or NULL if there is nothing to run.
+PageScripts* run_scripts_in_dom(DOMNode* root, CSSStyleSheet* sheet);
+
+// Milliseconds until page_scripts_tick has work, or -1 if none is scheduled.
+int page_scripts_timeout(PageScripts* page);
+
+// Run the next slice of the page's scripts, or due timers and, at most once
+// per frame, animation frame callbacks, then the restyle for everything they
+// changed. Returns nonzero if the page must
+// be laid out again.
+int page_scripts_tick(PageScripts* page);
+
+// Call after every layout of the page: what scripts removed from the DOM is
+// only freed once no layout can point at it.
+void page_scripts_laid_out(PageScripts* page);
+
+// Call before the DOM and stylesheet it runs against are freed.
+void free_page_scripts(PageScripts* page);
 
 #endif
@@ -1,6 +1,5 @@
 #include "layout.h"
 #include "css.h"
-#include "tag_tables.h"
 #include <SDL2/SDL_ttf.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,21 +54,6 @@ static inline int icmp(const char *a, const char *b)
     return (unsigned char)*a - (unsigned char)*b;
 }
 
-static bool tag_in_table(const char *tag, const char *const table[], size_t n)
-{
-    if (!tag) return false;
-    size_t lo = 0, hi = n;
-    while (lo < hi) {
-        size_t mid = (lo + hi) / 2;
-        int cmp = icmp(tag, table[mid]);
-        if (cmp == 0) return true;
-        (cmp < 0) ? (hi = mid) : (lo = mid + 1);
-    }
-    return false;
-}
-#define IS_BLOCK(t)  tag_in_table((t), block_tags,  BLOCK_TAGS_N)
-#define IS_INLINE(t) tag_in_table((t), inline_tags, INLINE_TAGS_N)
-
 static int parse_dimension(const char *s, int default_value)
 {
     if (!s || !*s) return default_value;
@@ -181,9 +165,9 @@ layout_node(DOMNode *node, Layout *lay, void *font, LayoutContext *ctx)
 {
     if (!node || !node->name) return;
 
-    if (icmp(node->name, "script") == 0 || icmp(node->name, "style") == 0 ||
-        icmp(node->name, "head") == 0 || icmp(node->name, "meta") == 0 ||
-        icmp(node->name, "link") == 0 || icmp(node->name, "title") == 0)
+    /* display:none and never-rendered tags were resolved by the style pass */
+    DisplayType display = css_node_display(node);
+    if (display == DISPLAY_NONE)
         return;
 
     /* Determine href: either from this node (if <a>) or inherited */
@@ -215,7 +199,7 @@ layout_node(DOMNode *node, Layout *lay, void *font, LayoutContext *ctx)
     }
 
     /* -----------------------------  BLOCK  ------------------------- */
-    if (IS_BLOCK(node->name))
+    if (display == DISPLAY_BLOCK)
     {
         /* Flush inline cursor */
         if (ctx->cur_inline_x != ctx->base_x) {
@@ -362,7 +346,7 @@ layout_node(DOMNode *node, Layout *lay, void *font, LayoutContext *ctx)
     }
 
     /* -----------------------------  INLINE ------------------------- */
-    if (IS_INLINE(node->name))
+    if (display == DISPLAY_INLINE)
     {
         /* #text nodes produce a LayoutBox */
         if (strcmp(node->name, "#text") == 0) {
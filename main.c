@@ -21,6 +21,9 @@ int main(int argc, char* argv[]) {
 
     network_init();
 
+    const char* style_threads = getenv("XS_STYLE_THREADS");
+    if (style_threads) css_set_style_threads(atoi(style_threads));
+
     // 1. Fetch HTML
     char* html = fetch_url(url);
     if (!html) {
@@ -41,22 +44,26 @@ int main(int argc, char* argv[]) {
     // 2b. Split text nodes into words for wrapping
     split_text_nodes(dom);
 
-    // 3. Apply CSS from <style> tags
+    // 3. Apply CSS from <style> tags (always: the style pass also computes display)
     char* style_text = extract_style_text(dom);
-    if (style_text) {
-        CSSStyleSheet* sheet = parse_css(style_text);
-        if (sheet) {
-            apply_stylesheet_to_dom(sheet, dom);
-            free_stylesheet(sheet);
-        }
-        free(style_text);
+    CSSStyleSheet* sheet = parse_css(style_text ? style_text : "");
+    if (sheet) {
+        apply_stylesheet_to_dom(sheet, dom, INITIAL_WINDOW_W);
+
+        CSSStyleStats stats;
+        css_style_stats(&stats);
+        printf("Styled %d nodes with %d computed styles "
+               "(%d shared, %d hidden subtrees, %d inline blocks parsed)\n",
+               stats.nodes_styled, stats.styles_allocated, stats.share_hits,
+               stats.subtrees_pruned, stats.inline_blocks_parsed);
     }
+    free(style_text);
 
-    // 4. Execute any <script> tags (extremely simplified)
-    run_scripts_in_dom(dom);
+    // 4. Start any <script> tags; they run from the render loop after the first paint
+    PageScripts* scripts = run_scripts_in_dom(dom, sheet);
 
-    // 5. Render (SDL2) — takes ownership of dom
-    render_layout(dom, url);
+    // 5. Render (SDL2) — takes ownership of dom, sheet and scripts
+    render_layout(dom, sheet, scripts, url);
 
     network_cleanup();
     return EXIT_SUCCESS;
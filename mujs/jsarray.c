@@ -240,7 +240,7 @@ static void Ap_slice(js_State *J)
 static int Ap_sort_cmp(js_State *J, int idx_a, int idx_b)
 {
 	js_Object *obj = js_tovalue(J, 0)->u.object;
-	if (obj->u.a.simple) {
+	if (obj->type == JS_CARRAY && obj->u.a.simple) {
 		js_Value *val_a = &obj->u.a.array[idx_a];
 		js_Value *val_b = &obj->u.a.array[idx_b];
 		int und_a = val_a->t.type == JS_TUNDEFINED;
@@ -326,7 +326,7 @@ static int Ap_sort_cmp(js_State *J, int idx_a, int idx_b)
 static void Ap_sort_swap(js_State *J, int idx_a, int idx_b)
 {
 	js_Object *obj = js_tovalue(J, 0)->u.object;
-	if (obj->u.a.simple) {
+	if (obj->type == JS_CARRAY && obj->u.a.simple) {
 		js_Value tmp = obj->u.a.array[idx_a];
 		obj->u.a.array[idx_a] = obj->u.a.array[idx_b];
 		obj->u.a.array[idx_b] = tmp;
@@ -389,8 +389,352 @@ static void Ap_sort_heapsort(js_State *J, int n)
 	}
 }
 
+/*
+	Flat arrays are sorted outside the object: the elements are copied out
+	once, their order is sorted with a stable natural merge sort, and the
+	result is written back once.
+
+	The merge sort finds the runs already in the data (reversing descending
+	ones), extends short runs to a minimum length with binary insertion, and
+	merges runs on a stack whose lengths it keeps balanced, as in TimSort.
+	A merge first skips the prefix of the left run and the suffix of the
+	right run that are already in place.
+
+	The values are sorted in a scratch array on the stack, so the collector
+	sees them whatever a comparator does to the array. Without a comparator,
+	arrays of primitive values compare keys made once up front: strings as
+	they are, and other values converted once, except non-negative integers,
+	which compare by their digits without being converted.
+*/
+
+#define JS_SORTMINMERGE 32
+#define JS_SORTMAXRUNS 64
+
+typedef struct js_Sort js_Sort;
+
+struct js_Sort {
+	js_State *J;
+	int (*cmp)(js_Sort *S, int a, int b);
+	js_Value *val;
+	const char **key;	/* string keys, or ... */
+	unsigned int *num;	/* ... integer keys, by value index */
+	int *tmp;		/* merge buffer */
+	int nrun, runbase[JS_SORTMAXRUNS], runlen[JS_SORTMAXRUNS];
+};
+
+static int Ap_sort_cmpkey(js_Sort *S, int a, int b)
+{
+	return strcmp(S->key[a], S->key[b]);
+}
+
+/* Non-negative integers, in the order of their decimal strings. */
+static int Ap_sort_digits(unsigned int x)
+{
+	int n = 1;
+	while (x >= 10) {
+		x /= 10;
+		++n;
+	}
+	return n;
+}
+
+static int Ap_sort_cmpnum(js_Sort *S, int a, int b)
+{
+	unsigned long long x = S->num[a], y = S->num[b];
+	int dx = Ap_sort_digits(S->num[a]), dy = Ap_sort_digits(S->num[b]), d;
+	for (d = dx; d < dy; ++d)
+		x *= 10;
+	for (d = dy; d < dx; ++d)
+		y *= 10;
+	if (x != y)
+		return x < y ? -1 : 1;
+	return dx - dy; /* a prefix sorts first */
+}
+
+static int Ap_sort_cmpfun(js_Sort *S, int a, int b)
+{
+	js_State *J = S->J;
+	double v;
+	js_copy(J, 1); /* copy function */
+	js_pushundefined(J); /* no 'this' binding */
+	js_pushvalue(J, S->val[a]);
+	js_pushvalue(J, S->val[b]);
+	js_call(J, 2);
+	v = js_tonumber(J, -1);
+	js_pop(J, 1);
+	if (isnan(v))
+		return 0;
+	if (v == 0)
+		return 0;
+	return v < 0 ? -1 : 1;
+}
+
+static int Ap_sort_cmpstr(js_Sort *S, int a, int b)
+{
+	js_State *J = S->J;
+	int c;
+	js_pushvalue(J, S->val[a]);
+	js_pushvalue(J, S->val[b]);
+	c = strcmp(js_tostring(J, -2), js_tostring(J, -1));
+	js_pop(J, 2);
+	return c;
+}
+
+static void Ap_sort_insertion(js_Sort *S, int *a, int lo, int start, int hi)
+{
+	for (; start < hi; ++start) {
+		int x = a[start], l = lo, r = start;
+		while (l < r) {
+			int m = (l + r) >> 1;
+			if (S->cmp(S, x, a[m]) < 0)
+				r = m;
+			else
+				l = m + 1;
+		}
+		memmove(a + l + 1, a + l, (start - l) * sizeof *a);
+		a[l] = x;
+	}
+}
+
+/* Length of the run at lo; a strictly descending run is reversed in place. */
+static int Ap_sort_run(js_Sort *S, int *a, int lo, int hi)
+{
+	int i = lo + 1;
+	if (i == hi)
+		return 1;
+	if (S->cmp(S, a[i], a[lo]) < 0) {
+		int l, r;
+		while (++i < hi && S->cmp(S, a[i], a[i-1]) < 0)
+			;
+		for (l = lo, r = i - 1; l < r; ++l, --r) {
+			int t = a[l];
+			a[l] = a[r];
+			a[r] = t;
+		}
+	} else {
+		while (++i < hi && S->cmp(S, a[i], a[i-1]) >= 0)
+			;
+	}
+	return i - lo;
+}
+
+/* Number of elements in a[lo..hi) that sort before x (or not after, if upper). */
+static int Ap_sort_search(js_Sort *S, int x, int *a, int lo, int hi, int upper)
+{
+	int l = lo, r = hi;
+	while (l < r) {
+		int m = (l + r) >> 1;
+		int c = S->cmp(S, a[m], x);
+		if (c < 0 || (upper && c == 0))
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l - lo;
+}
+
+static void Ap_sort_mergeat(js_Sort *S, int *a, int k)
+{
+	int base1 = S->runbase[k], len1 = S->runlen[k];
+	int base2 = S->runbase[k+1], len2 = S->runlen[k+1];
+	int *tmp = S->tmp;
+	int i, j, d;
+
+	S->runlen[k] = len1 + len2;
+	if (k == S->nrun - 3) {
+		S->runbase[k+1] = S->runbase[k+2];
+		S->runlen[k+1] = S->runlen[k+2];
+	}
+	--S->nrun;
+
+	/* Left elements not after the first right one are in place already, ... */
+	i = Ap_sort_search(S, a[base2], a, base1, base2, 1);
+	base1 += i;
+	len1 -= i;
+	if (len1 == 0)
+		return;
+
+	/* ... and so are right elements not before the last left one. */
+	len2 = Ap_sort_search(S, a[base1 + len1 - 1], a, base2, base2 + len2, 0);
+	if (len2 == 0)
+		return;
+
+	if (len1 <= len2) {
+		memcpy(tmp, a + base1, len1 * sizeof *a);
+		i = 0, j = base2, d = base1;
+		while (i < len1 && j < base2 + len2) {
+			if (S->cmp(S, a[j], tmp[i]) < 0)
+				a[d++] = a[j++];
+			else
+				a[d++] = tmp[i++];
+		}
+		memcpy(a + d, tmp + i, (len1 - i) * sizeof *a);
+	} else {
+		memcpy(tmp, a + base2, len2 * sizeof *a);
+		i = base1 + len1 - 1, j = len2 - 1, d = base2 + len2 - 1;
+		while (i >= base1 && j >= 0) {
+			if (S->cmp(S, tmp[j], a[i]) < 0)
+				a[d--] = a[i--];
+			else
+				a[d--] = tmp[j--];
+		}
+		memcpy(a + base1, tmp, (j + 1) * sizeof *a);
+	}
+}
+
+/* Merge until each run is longer than the next two together. */
+static void Ap_sort_collapse(js_Sort *S, int *a)
+{
+	int *len = S->runlen;
+	while (S->nrun > 1) {
+		int k = S->nrun - 2;
+		if ((k > 0 && len[k-1] <= len[k] + len[k+1]) || (k > 1 && len[k-2] <= len[k-1] + len[k])) {
+			if (len[k-1] < len[k+1])
+				--k;
+		} else if (len[k] > len[k+1]) {
+			break;
+		}
+		Ap_sort_mergeat(S, a, k);
+	}
+}
+
+static void Ap_sort_merge(js_Sort *S, int *a, int n)
+{
+	int minrun, r = 0, lo = 0;
+
+	for (minrun = n; minrun >= JS_SORTMINMERGE; minrun >>= 1)
+		r |= minrun & 1;
+	minrun += r;
+
+	S->nrun = 0;
+	while (lo < n) {
+		int len = Ap_sort_run(S, a, lo, n);
+		if (len < minrun) {
+			int force = n - lo < minrun ? n - lo : minrun;
+			Ap_sort_insertion(S, a, lo, lo + len, lo + force);
+			len = force;
+		}
+		S->runbase[S->nrun] = lo;
+		S->runlen[S->nrun] = len;
+		++S->nrun;
+		Ap_sort_collapse(S, a);
+		lo += len;
+	}
+	while (S->nrun > 1) {
+		int k = S->nrun - 2;
+		if (k > 0 && S->runlen[k-1] < S->runlen[k+1])
+			--k;
+		Ap_sort_mergeat(S, a, k);
+	}
+}
+
+/* Make the keys for a sort without a comparator; 0 if a value is an object. */
+static int Ap_sort_keys(js_Sort *S, int *ix, int n)
+{
+	js_Value *val = S->val;
+	int i, isnum = 1;
+	for (i = 0; i < n; ++i) {
+		js_Value *v = &val[ix[i]];
+		if (v->t.type == JS_TOBJECT)
+			return 0;
+		if (v->t.type == JS_TNUMBER) {
+			double x = v->u.number;
+			if (!(x >= 0 && x <= UINT_MAX && x == (unsigned int)x))
+				isnum = 0;
+		} else {
+			isnum = 0;
+		}
+	}
+	if (isnum) {
+		for (i = 0; i < n; ++i)
+			S->num[ix[i]] = val[ix[i]].u.number;
+		S->cmp = Ap_sort_cmpnum;
+	} else {
+		/* converts the scratch copies, not the array's values */
+		for (i = 0; i < n; ++i)
+			S->key[ix[i]] = jsV_tostring(S->J, &val[ix[i]]);
+		S->cmp = Ap_sort_cmpkey;
+	}
+	return 1;
+}
+
+static void Ap_sort_flat(js_State *J, js_Object *obj)
+{
+	int n = obj->u.a.flat_length;
+	js_Object *scratch;
+	js_Value *val;
+	js_Sort S;
+	void *block;
+	int *ix;
+	int i, m;
+
+	js_newarray(J);
+	scratch = js_toobject(J, -1);
+	scratch->u.a.array = val = js_malloc(J, n * sizeof *val);
+	memcpy(val, obj->u.a.array, n * sizeof *val);
+	scratch->u.a.flat_capacity = scratch->u.a.flat_length = scratch->u.a.length = n;
+
+	/* keys, then the order, then the merge buffer */
+	block = js_malloc(J, n * sizeof(const char *) + (n + n / 2 + 1) * sizeof(int));
+	memset(&S, 0, sizeof S);
+	S.J = J;
+	S.val = val;
+	S.key = block;
+	S.num = block;
+	ix = (int *)(S.key + n);
+	S.tmp = ix + n;
+
+	if (js_try(J)) {
+		js_free(J, block);
+		js_throw(J);
+	}
+
+	/* Undefined values go last. */
+	for (i = m = 0; i < n; ++i)
+		if (val[i].t.type != JS_TUNDEFINED)
+			ix[m++] = i;
+
+	if (js_iscallable(J, 1))
+		S.cmp = Ap_sort_cmpfun;
+	else if (!Ap_sort_keys(&S, ix, m))
+		S.cmp = Ap_sort_cmpstr;
+
+	Ap_sort_merge(&S, ix, m);
+
+	if (S.cmp == Ap_sort_cmpnum || S.cmp == Ap_sort_cmpkey) {
+		/* Nothing ran that could change the array, but the scratch copies
+		   may have been converted to strings. */
+		for (i = 0; i < m; ++i)
+			val[i] = obj->u.a.array[ix[i]];
+		memcpy(obj->u.a.array, val, m * sizeof *val);
+		for (i = m; i < n; ++i)
+			obj->u.a.array[i].t.type = JS_TUNDEFINED;
+	} else if (obj->u.a.simple && obj->u.a.flat_length == n) {
+		for (i = 0; i < m; ++i) {
+			obj->u.a.array[i] = val[ix[i]];
+			jsG_barrier(J, &val[ix[i]]);
+		}
+		for (i = m; i < n; ++i)
+			obj->u.a.array[i].t.type = JS_TUNDEFINED;
+	} else {
+		/* The comparator changed the shape of the array. */
+		for (i = 0; i < n; ++i) {
+			if (i < m)
+				js_pushvalue(J, val[ix[i]]);
+			else
+				js_pushundefined(J);
+			js_setindex(J, 0, i);
+		}
+	}
+
+	js_endtry(J);
+	js_free(J, block);
+	js_pop(J, 1);
+}
+
 static void Ap_sort(js_State *J)
 {
+	js_Object *obj;
 	int len;
 
 	len = js_getlength(J, 0);
@@ -405,7 +749,13 @@ static void Ap_sort(js_State *J)
 	if (len >= INT_MAX)
 		js_rangeerror(J, "array is too large to sort");
 
-	Ap_sort_heapsort(J, len);
+	obj = js_toobject(J, 0);
+	if (!JS_HEAPSORT && obj->type == JS_CARRAY && obj->u.a.simple) {
+		if (obj->u.a.flat_length > 1)
+			Ap_sort_flat(J, obj);
+	} else {
+		Ap_sort_heapsort(J, len);
+	}
 
 	js_copy(J, 0);
 }
@@ -831,3 +1181,45 @@ void jsB_initarray(js_State *J)
 	}
 	js_defglobal(J, "Array", JS_DONTENUM);
 }
+
+#ifdef SORTBENCH
+
+#include <time.h>
+
+/* cc -O2 -DSORTBENCH -o sortbench one.c -lm */
+
+static const char *sortbench[] = {
+	"numbers, a - b", "a.sort(function (x, y) { return x - y; })",
+	"numbers", "a.sort()",
+	"strings", "s.sort()",
+	"sorted numbers, a - b", "a.sort(function (x, y) { return x - y; })",
+	"objects by key", "o.sort(function (x, y) { return x.k - y.k; })",
+};
+
+int main(int argc, char **argv)
+{
+	int i, n = argc > 1 ? atoi(argv[1]) : 1000000;
+	js_State *J = js_newstate(NULL, NULL, 0);
+	char setup[512];
+	struct timespec t0, t1;
+
+	snprintf(setup, sizeof setup,
+		"var n = %d, seed = 1, a = [], s = [], o = [];"
+		"function rnd() { seed = (seed * 1103515245 + 12345) %% 2147483648; return seed; }"
+		"for (var i = 0; i < n; ++i) { var r = rnd(); a.push(r); s.push('k' + r); o.push({ k: r %% 1000 }); }",
+		n);
+	js_dostring(J, setup);
+
+	for (i = 0; i < nelem(sortbench); i += 2) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		js_dostring(J, sortbench[i+1]);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("%-24s %8.1f ms\n", sortbench[i],
+			(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+	}
+
+	js_freestate(J);
+	return 0;
+}
+
+#endif
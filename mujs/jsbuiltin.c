@@ -192,6 +192,8 @@ static void jsB_encodeURIComponent(js_State *J)
 
 void jsB_init(js_State *J)
 {
+	int i;
+
 	/* Create the prototype objects here, before the constructors */
 	J->Object_prototype = jsV_newobject(J, JS_COBJECT, NULL);
 	J->Array_prototype = jsV_newobject(J, JS_CARRAY, J->Object_prototype);
@@ -200,9 +202,14 @@ void jsB_init(js_State *J)
 	J->Number_prototype = jsV_newobject(J, JS_CNUMBER, J->Object_prototype);
 	J->String_prototype = jsV_newobject(J, JS_CSTRING, J->Object_prototype);
 	J->Date_prototype = jsV_newobject(J, JS_CDATE, J->Object_prototype);
+	J->ArrayBuffer_prototype = jsV_newobject(J, JS_COBJECT, J->Object_prototype);
+	J->TypedArray_prototype = jsV_newobject(J, JS_COBJECT, J->Object_prototype);
+	for (i = 0; i < JS_ECOUNT; ++i)
+		J->element_prototype[i] = jsV_newobject(J, JS_COBJECT, J->TypedArray_prototype);
 
 	J->RegExp_prototype = jsV_newobject(J, JS_CREGEXP, J->Object_prototype);
-	J->RegExp_prototype->u.r.prog = js_regcompx(J->alloc, J->actx, "(?:)", 0, NULL);
+	J->RegExp_prototype->u.r.regprog = js_compileregexp(J, "(?:)", 0);
+	J->RegExp_prototype->u.r.prog = J->RegExp_prototype->u.r.regprog->prog;
 	J->RegExp_prototype->u.r.source = js_strdup(J, "(?:)");
 
 	/* All the native error types */
@@ -226,6 +233,7 @@ void jsB_init(js_State *J)
 	jsB_initerror(J);
 	jsB_initmath(J);
 	jsB_initjson(J);
+	jsB_inittypedarray(J);
 
 	/* Initialize the global object */
 	js_pushnumber(J, NAN);
@@ -0,0 +1,628 @@
+#include "jsi.h"
+
+#include <stdio.h>
+
+/*
+	Compiled scripts are kept on disk, keyed by a hash of their source, file
+	name and strictness, so that a script seen before skips lexing, parsing
+	and compiling. The hash only picks the file: the entry holds the file
+	name and source it was compiled from, and is used only if they match the
+	script being loaded byte for byte.
+
+	An entry is a header, the file name and source, a table of the strings
+	used by the functions, and the tree of functions itself. String operands in the code are written as
+	indices into the string table and interned again on load. The header
+	names the MuJS version, the bytecode format, and the byte order and sizes
+	of the native types; an entry made by any other build is compiled again
+	and overwritten.
+*/
+
+#define BC_MAGIC 0x43424a4d /* "MJBC" */
+#define BC_FORMAT 3
+#define BC_ORDER 0x01020304
+
+#define STRWORDS (int)(sizeof(const char *) / sizeof(js_Instruction))
+#define NUMWORDS (int)(sizeof(double) / sizeof(js_Instruction))
+
+struct bcheader
+{
+	unsigned int magic, format, version, order;
+	unsigned int nopcodes, instsize, ptrsize;
+	unsigned int hashlo, hashhi, srclen, namelen, strict;
+	unsigned int compiletime; /* microseconds it took to compile */
+	unsigned int checksum; /* of everything after the source */
+	unsigned int nstr;
+};
+
+static void bchash(const char *filename, const char *source, int strict, unsigned int *lo, unsigned int *hi, unsigned int *len, unsigned int *namelen)
+{
+	/* two independent FNV-1a hashes make a 64-bit key */
+	unsigned int a = 2166136261u, b = 0x811c9dc5u ^ 0x5bd1e995u;
+	const char *s;
+	for (s = source; *s; ++s) {
+		a = (a ^ (unsigned char)*s) * 16777619u;
+		b = (b ^ (unsigned char)*s) * 0x01000193u + 0x9e3779b9u;
+	}
+	*len = s - source;
+	for (s = filename; *s; ++s) {
+		a = (a ^ (unsigned char)*s) * 16777619u;
+		b = (b ^ (unsigned char)*s) * 0x01000193u + 0x9e3779b9u;
+	}
+	*namelen = s - filename;
+	*lo = a ^ strict;
+	*hi = b;
+}
+
+static unsigned int bcchecksum(const char *p, int n)
+{
+	unsigned int h = 2166136261u;
+	while (n-- > 0)
+		h = (h ^ (unsigned char)*p++) * 16777619u;
+	return h;
+}
+
+static char *bcpath(js_State *J, unsigned int lo, unsigned int hi)
+{
+	int n = strlen(J->codecache) + 32;
+	char *path = js_malloc(J, n);
+	snprintf(path, n, "%s/%08x%08x.mjbc", J->codecache, hi, lo);
+	return path;
+}
+
+/* Writing */
+
+typedef struct {
+	js_Buffer *sb; /* functions */
+	const char **str; /* string table, by index */
+	int nstr, strcap;
+	const char **slot; /* string to index, open addressing on the pointer */
+	int *slotidx;
+	int slotcap;
+} bcwriter;
+
+static void bcputint(js_State *J, js_Buffer **sb, unsigned int x)
+{
+	js_putm(J, sb, (const char *)&x, (const char *)&x + sizeof x);
+}
+
+static int bcstring(js_State *J, bcwriter *w, const char *s)
+{
+	unsigned int h;
+	int i, k;
+
+	if (w->nstr * 2 >= w->slotcap) {
+		const char **oldslot = w->slot;
+		int *oldidx = w->slotidx;
+		int oldcap = w->slotcap;
+		w->slotcap = w->slotcap ? w->slotcap * 2 : 256;
+		w->slot = js_malloc(J, w->slotcap * sizeof *w->slot);
+		w->slotidx = js_malloc(J, w->slotcap * sizeof *w->slotidx);
+		memset(w->slot, 0, w->slotcap * sizeof *w->slot);
+		for (i = 0; i < oldcap; ++i) {
+			if (oldslot[i]) {
+				h = (unsigned int)((size_t)oldslot[i] >> 3);
+				for (k = h & (w->slotcap - 1); w->slot[k]; k = (k + 1) & (w->slotcap - 1))
+					;
+				w->slot[k] = oldslot[i];
+				w->slotidx[k] = oldidx[i];
+			}
+		}
+		js_free(J, oldslot);
+		js_free(J, oldidx);
+	}
+
+	/* the strings in compiled code are interned, so the pointer is the key */
+	h = (unsigned int)((size_t)s >> 3);
+	for (k = h & (w->slotcap - 1); w->slot[k]; k = (k + 1) & (w->slotcap - 1))
+		if (w->slot[k] == s)
+			return w->slotidx[k];
+
+	if (w->nstr >= w->strcap) {
+		w->strcap = w->strcap ? w->strcap * 2 : 256;
+		w->str = js_realloc(J, w->str, w->strcap * sizeof *w->str);
+	}
+	w->str[w->nstr] = s;
+	w->slot[k] = s;
+	w->slotidx[k] = w->nstr;
+	return w->nstr++;
+}
+
+static void bcwritefunction(js_State *J, bcwriter *w, js_Function *F)
+{
+	js_Instruction *pc = F->code, *end = F->code + F->codelen;
+	const char *str;
+	int i, n, shape;
+
+	bcputint(J, &w->sb, bcstring(J, w, F->name));
+	bcputint(J, &w->sb, bcstring(J, w, F->filename));
+	bcputint(J, &w->sb, F->script);
+	bcputint(J, &w->sb, F->lightweight);
+	bcputint(J, &w->sb, F->strict);
+	bcputint(J, &w->sb, F->arguments);
+	bcputint(J, &w->sb, F->numparams);
+	bcputint(J, &w->sb, F->line);
+	bcputint(J, &w->sb, F->lastline);
+	bcputint(J, &w->sb, F->pcachelen);
+
+	bcputint(J, &w->sb, F->varlen);
+	for (i = 0; i < F->varlen; ++i)
+		bcputint(J, &w->sb, bcstring(J, w, F->vartab[i]));
+
+	bcputint(J, &w->sb, F->linelen);
+	for (i = 0; i < F->linelen; ++i) {
+		bcputint(J, &w->sb, F->linetab[i].pc);
+		bcputint(J, &w->sb, F->linetab[i].line);
+	}
+
+	bcputint(J, &w->sb, F->funlen);
+	for (i = 0; i < F->funlen; ++i)
+		bcwritefunction(J, w, F->funtab[i]);
+
+	/* code, with each string operand replaced by one word holding its index */
+	bcputint(J, &w->sb, F->codelen);
+	while (pc < end) {
+		shape = jsC_operands(*pc);
+		js_putm(J, &w->sb, (const char *)pc, (const char *)(pc + 1));
+		++pc;
+		switch (shape) {
+		case JS_OPINT:
+		case JS_OPINTINT:
+			n = shape == JS_OPINTINT ? 2 : 1;
+			js_putm(J, &w->sb, (const char *)pc, (const char *)(pc + n));
+			pc += n;
+			break;
+		case JS_OPNUMBER:
+			js_putm(J, &w->sb, (const char *)pc, (const char *)(pc + NUMWORDS));
+			pc += NUMWORDS;
+			break;
+		case JS_OPSTRING:
+		case JS_OPSTRINGINT:
+		case JS_OPSTRINGINTINT:
+			memcpy(&str, pc, sizeof str);
+			pc += STRWORDS;
+			bcputint(J, &w->sb, bcstring(J, w, str));
+			n = shape == JS_OPSTRINGINTINT ? 2 : shape == JS_OPSTRINGINT ? 1 : 0;
+			js_putm(J, &w->sb, (const char *)pc, (const char *)(pc + n));
+			pc += n;
+			break;
+		}
+	}
+}
+
+static void bcwrite(js_State *J, js_Function *F, const char *path, const char *filename, const char *source, struct bcheader *h)
+{
+	bcwriter w;
+	js_Buffer *sb = NULL;
+	char *tmp = NULL;
+	FILE *file = NULL;
+	int i, n, ok;
+
+	memset(&w, 0, sizeof w);
+
+	if (js_try(J)) {
+		js_free(J, w.sb);
+		js_free(J, w.str);
+		js_free(J, w.slot);
+		js_free(J, w.slotidx);
+		js_free(J, sb);
+		js_free(J, tmp);
+		js_throw(J);
+	}
+
+	bcwritefunction(J, &w, F);
+
+	for (i = 0; i < w.nstr; ++i) {
+		n = strlen(w.str[i]);
+		bcputint(J, &sb, n);
+		js_putm(J, &sb, w.str[i], w.str[i] + n + 1);
+	}
+	js_putm(J, &sb, w.sb->s, w.sb->s + w.sb->n);
+
+	h->nstr = w.nstr;
+	h->checksum = bcchecksum(sb->s, sb->n);
+
+	/* write to the side and rename, so a reader never sees half an entry */
+	n = strlen(path) + 5;
+	tmp = js_malloc(J, n);
+	snprintf(tmp, n, "%s.tmp", path);
+	ok = 0;
+	file = fopen(tmp, "wb");
+	if (file) {
+		ok = fwrite(h, sizeof *h, 1, file) == 1;
+		ok = ok && fwrite(filename, 1, h->namelen, file) == h->namelen;
+		ok = ok && fwrite(source, 1, h->srclen, file) == h->srclen;
+		ok = ok && fwrite(sb->s, 1, sb->n, file) == (size_t)sb->n;
+		ok = fclose(file) == 0 && ok;
+		if (ok)
+			ok = rename(tmp, path) == 0;
+		if (!ok)
+			remove(tmp);
+	}
+	if (ok)
+		J->codestats.stores++;
+	else
+		J->codestats.errors++;
+
+	js_endtry(J);
+	js_free(J, w.sb);
+	js_free(J, w.str);
+	js_free(J, w.slot);
+	js_free(J, w.slotidx);
+	js_free(J, sb);
+	js_free(J, tmp);
+}
+
+/* Reading */
+
+typedef struct {
+	const char *p, *end;
+	const char **str;
+	int nstr;
+	int error;
+} bcreader;
+
+static unsigned int bcgetint(bcreader *r)
+{
+	unsigned int x;
+	if (r->end - r->p < (int)sizeof x) {
+		r->error = 1;
+		return 0;
+	}
+	memcpy(&x, r->p, sizeof x);
+	r->p += sizeof x;
+	return x;
+}
+
+static int bcgetcount(bcreader *r, int limit)
+{
+	unsigned int n = bcgetint(r);
+	if (n > (unsigned int)limit) {
+		r->error = 1;
+		return 0;
+	}
+	return n;
+}
+
+static const char *bcgetstring(bcreader *r)
+{
+	unsigned int i = bcgetint(r);
+	if (i >= (unsigned int)r->nstr) {
+		r->error = 1;
+		return "";
+	}
+	return r->str[i];
+}
+
+static int bcgetcode(bcreader *r, js_Instruction *dst, int n)
+{
+	if (r->end - r->p < n * (int)sizeof *dst) {
+		r->error = 1;
+		return 0;
+	}
+	memcpy(dst, r->p, n * sizeof *dst);
+	r->p += n * sizeof *dst;
+	return 1;
+}
+
+static int bcoperandwords(int shape)
+{
+	switch (shape) {
+	case JS_OPINT: return 1;
+	case JS_OPINTINT: return 2;
+	case JS_OPNUMBER: return NUMWORDS;
+	case JS_OPSTRING: return STRWORDS;
+	case JS_OPSTRINGINT: return STRWORDS + 1;
+	case JS_OPSTRINGINTINT: return STRWORDS + 2;
+	}
+	return 0;
+}
+
+static int bclocalop(int opcode)
+{
+	switch (opcode) {
+	case OP_GETLOCAL: case OP_SETLOCAL: case OP_DELLOCAL:
+	case OP_PUTLOCAL: case OP_INCLOCAL: case OP_DECLOCAL: case OP_ADDLOCAL:
+	case OP_GETLOCALPROP:
+		return 1;
+	}
+	return 0;
+}
+
+/* A local variable operand names a variable; the fused ones also need the locals on the stack. */
+static int bclocal(js_Function *F, int opcode, int k)
+{
+	if (k < 1 || k > F->varlen)
+		return 0;
+	if (opcode != OP_GETLOCAL && opcode != OP_SETLOCAL && opcode != OP_DELLOCAL)
+		return F->lightweight;
+	return 1;
+}
+
+static js_Function *bcreadfunction(js_State *J, bcreader *r, int depth)
+{
+	js_Function *F;
+	js_Instruction *pc, *end;
+	const char *str;
+	int i, n, shape;
+
+	if (depth > JS_ASTLIMIT) {
+		r->error = 1;
+		return NULL;
+	}
+
+	F = js_malloc(J, sizeof *F);
+	memset(F, 0, sizeof *F);
+	F->gcmark = jsG_newmark(J);
+	F->gcnext = J->gcfun;
+	J->gcfun = F;
+	++J->gccounter;
+
+	F->name = bcgetstring(r);
+	F->filename = bcgetstring(r);
+	F->script = bcgetint(r);
+	F->lightweight = bcgetint(r);
+	F->strict = bcgetint(r);
+	F->arguments = bcgetint(r);
+	F->numparams = bcgetint(r);
+	F->line = bcgetint(r);
+	F->lastline = bcgetint(r);
+
+	/* counts are bounded by what is left to read, so corrupt ones cannot run away */
+	n = bcgetcount(r, r->end - r->p);
+	if (n > 0) {
+		F->pcache = js_malloc(J, n * sizeof *F->pcache);
+		memset(F->pcache, 0, n * sizeof *F->pcache);
+		F->pcachecap = F->pcachelen = n;
+	}
+
+	n = bcgetcount(r, (r->end - r->p) / 4);
+	if (n > 0) {
+		F->vartab = js_malloc(J, n * sizeof *F->vartab);
+		F->varcap = F->varlen = n;
+		for (i = 0; i < n; ++i)
+			F->vartab[i] = bcgetstring(r);
+	}
+
+	n = bcgetcount(r, (r->end - r->p) / 8);
+	if (n > 0) {
+		F->linetab = js_malloc(J, n * sizeof *F->linetab);
+		F->linecap = F->linelen = n;
+		for (i = 0; i < n; ++i) {
+			F->linetab[i].pc = bcgetint(r);
+			F->linetab[i].line = bcgetint(r);
+		}
+	}
+
+	n = bcgetcount(r, (r->end - r->p) / 4);
+	if (n > 0) {
+		F->funtab = js_malloc(J, n * sizeof *F->funtab);
+		F->funcap = n;
+		for (i = 0; i < n && !r->error; ++i)
+			F->funtab[F->funlen++] = bcreadfunction(J, r, depth + 1);
+	}
+
+	n = bcgetcount(r, r->end - r->p); /* each word of code takes at least a byte */
+	if (r->error)
+		return F;
+	F->code = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->code);
+	F->codecap = n;
+	pc = F->code;
+	end = F->code + n;
+	while (pc < end && !r->error) {
+		bcgetcode(r, pc, 1);
+		if (*pc > OP_RETURN) {
+			r->error = 1;
+			break;
+		}
+		shape = jsC_operands(*pc++);
+		if (shape == JS_OPNONE)
+			continue;
+		if (end - pc < bcoperandwords(shape)) {
+			r->error = 1;
+			break;
+		}
+		switch (shape) {
+		case JS_OPINT:
+		case JS_OPINTINT:
+			bcgetcode(r, pc, shape == JS_OPINTINT ? 2 : 1);
+			if ((pc[-1] == OP_CLOSURE && *pc >= F->funlen) || (jsC_isjump(pc[-1]) && *pc > n))
+				r->error = 1;
+			if (bclocalop(pc[-1]) && !bclocal(F, pc[-1], *pc))
+				r->error = 1;
+			pc += shape == JS_OPINTINT ? 2 : 1;
+			break;
+		case JS_OPNUMBER:
+			bcgetcode(r, pc, NUMWORDS);
+			pc += NUMWORDS;
+			break;
+		case JS_OPSTRING:
+		case JS_OPSTRINGINT:
+		case JS_OPSTRINGINTINT:
+			str = bcgetstring(r);
+			memcpy(pc, &str, sizeof str);
+			pc += STRWORDS;
+			if (shape == JS_OPSTRINGINT || shape == JS_OPSTRINGINTINT) {
+				bcgetcode(r, pc, 1);
+				if (pc[-1 - STRWORDS] != OP_NEWREGEXP && *pc >= F->pcachelen)
+					r->error = 1;
+				pc += 1;
+			}
+			if (shape == JS_OPSTRINGINTINT) {
+				bcgetcode(r, pc, 1);
+				if (!bclocal(F, pc[-2 - STRWORDS], *pc))
+					r->error = 1;
+				pc += 1;
+			}
+			break;
+		}
+	}
+	F->codelen = pc - F->code;
+
+	return F;
+}
+
+static js_Function *bcread(js_State *J, const char *path, const char *filename, const char *source, struct bcheader *key, double *compiletime)
+{
+	struct bcheader h;
+	bcreader r;
+	js_Function *F = NULL;
+	FILE *file;
+	char *data = NULL;
+	long n, k;
+	int i;
+
+	file = fopen(path, "rb");
+	if (!file)
+		return NULL;
+
+	if (fread(&h, sizeof h, 1, file) != 1 ||
+		h.magic != key->magic || h.format != key->format || h.version != key->version ||
+		h.order != key->order || h.nopcodes != key->nopcodes ||
+		h.instsize != key->instsize || h.ptrsize != key->ptrsize ||
+		h.hashlo != key->hashlo || h.hashhi != key->hashhi || h.srclen != key->srclen ||
+		h.namelen != key->namelen || h.strict != key->strict ||
+		fseek(file, 0, SEEK_END) < 0 || (n = ftell(file)) < (long)sizeof h + (long)h.namelen + (long)h.srclen ||
+		fseek(file, sizeof h, SEEK_SET) < 0)
+	{
+		fclose(file);
+		J->codestats.errors++;
+		return NULL;
+	}
+	n -= sizeof h;
+
+	r.str = NULL;
+	if (js_try(J)) {
+		/* an entry that cannot be loaded is compiled again */
+		js_pop(J, 1);
+		fclose(file);
+		js_free(J, data);
+		js_free(J, r.str);
+		J->codestats.errors++;
+		return NULL;
+	}
+
+	data = js_malloc(J, n > 0 ? n : 1);
+	if (fread(data, 1, n, file) != (size_t)n) {
+		J->codestats.errors++;
+		goto done;
+	}
+
+	/* a different script that hashed the same is a miss, not an error */
+	k = h.namelen + h.srclen;
+	if (memcmp(data, filename, h.namelen) != 0 || memcmp(data + h.namelen, source, h.srclen) != 0)
+		goto done;
+
+	if (bcchecksum(data + k, n - k) != h.checksum) {
+		J->codestats.errors++;
+		goto done;
+	}
+
+	r.p = data + k;
+	r.end = data + n;
+	r.error = 0;
+	r.nstr = 0;
+	if (h.nstr > (unsigned int)(n - k) / 5) /* a length and a terminator each */
+		r.error = 1;
+	else
+		r.str = js_malloc(J, (h.nstr > 0 ? h.nstr : 1) * sizeof *r.str);
+	for (i = 0; i < (int)h.nstr && !r.error; ++i) {
+		int len = bcgetint(&r);
+		if (r.error || len < 0 || len >= r.end - r.p || r.p[len] != 0) {
+			r.error = 1;
+		} else {
+			r.str[r.nstr++] = js_intern(J, r.p);
+			r.p += len + 1;
+		}
+	}
+	if (!r.error)
+		F = bcreadfunction(J, &r, 0);
+	if (r.error || r.p != r.end || !F->script) {
+		F = NULL; /* left for the garbage collector */
+		J->codestats.errors++;
+	}
+	*compiletime = h.compiletime;
+
+done:
+	js_endtry(J);
+	fclose(file);
+	js_free(J, data);
+	js_free(J, r.str);
+	return F;
+}
+
+/* Cache */
+
+static void bckey(js_State *J, const char *filename, const char *source, int strict, struct bcheader *h)
+{
+	(void)J;
+	memset(h, 0, sizeof *h);
+	h->magic = BC_MAGIC;
+	h->format = BC_FORMAT;
+	h->version = JS_VERSION;
+	h->order = BC_ORDER;
+	h->nopcodes = OP_RETURN + 1;
+	h->instsize = sizeof(js_Instruction);
+	h->ptrsize = sizeof(const char *);
+	h->strict = strict;
+	bchash(filename, source, strict, &h->hashlo, &h->hashhi, &h->srclen, &h->namelen);
+}
+
+js_Function *jsC_loadcache(js_State *J, const char *filename, const char *source, int strict)
+{
+	struct bcheader key;
+	js_Function *F;
+	char *path;
+	double start = jsG_now();
+	double compiletime = 0;
+
+	bckey(J, filename, source, strict, &key);
+	path = bcpath(J, key.hashlo, key.hashhi);
+	if (js_try(J)) {
+		js_free(J, path);
+		js_throw(J);
+	}
+	F = bcread(J, path, filename, source, &key, &compiletime);
+	js_endtry(J);
+	js_free(J, path);
+
+	if (F) {
+		double usec = jsG_now() - start;
+		J->codestats.hits++;
+		J->codestats.load_ms += usec / 1000;
+		if (compiletime > usec)
+			J->codestats.saved_ms += (compiletime - usec) / 1000;
+	} else {
+		J->codestats.misses++;
+	}
+	return F;
+}
+
+void jsC_storecache(js_State *J, js_Function *F, const char *filename, const char *source, int strict, double usec)
+{
+	struct bcheader h;
+	char *path;
+
+	J->codestats.compile_ms += usec / 1000;
+
+	bckey(J, filename, source, strict, &h);
+	h.compiletime = usec;
+	path = bcpath(J, h.hashlo, h.hashhi);
+	if (js_try(J)) {
+		js_free(J, path);
+		js_throw(J);
+	}
+	bcwrite(J, F, path, filename, source, &h);
+	js_endtry(J);
+	js_free(J, path);
+}
+
+void js_setcodecache(js_State *J, const char *dir)
+{
+	js_free(J, J->codecache);
+	J->codecache = dir ? js_strdup(J, dir) : NULL;
+}
+
+void js_getcodecachestats(js_State *J, js_CodeCacheStats *stats)
+{
+	*stats = J->codestats;
+}
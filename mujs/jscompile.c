@@ -10,6 +10,7 @@ static void cfunbody(JF, js_Ast *name, js_Ast *params, js_Ast *body, int is_fun_
 static void cexp(JF, js_Ast *exp);
 static void cstmlist(JF, js_Ast *list);
 static void cstm(JF, js_Ast *stm);
+static void peephole(JF);
 
 void jsC_error(js_State *J, js_Ast *node, const char *fmt, ...)
 {
@@ -51,7 +52,7 @@ static js_Function *newfun(js_State *J, int line, js_Ast *name, js_Ast *params,
 {
 	js_Function *F = js_malloc(J, sizeof *F);
 	memset(F, 0, sizeof *F);
-	F->gcmark = 0;
+	F->gcmark = jsG_newmark(J);
 	F->gcnext = J->gcfun;
 	J->gcfun = F;
 	++J->gccounter;
@@ -63,10 +64,77 @@ static js_Function *newfun(js_State *J, int line, js_Ast *name, js_Ast *params,
 	F->name = name ? name->string : "";
 
 	cfunbody(J, F, name, params, body, is_fun_exp);
+	if (!J->nopeephole)
+		peephole(J, F);
 
 	return F;
 }
 
+/* The operands that follow each opcode in the instruction stream. */
+int jsC_operands(int opcode)
+{
+	switch (opcode) {
+	case OP_INTEGER:
+	case OP_CLOSURE:
+	case OP_GETLOCAL:
+	case OP_SETLOCAL:
+	case OP_DELLOCAL:
+	case OP_PUTLOCAL:
+	case OP_INCLOCAL:
+	case OP_DECLOCAL:
+	case OP_CALL:
+	case OP_NEW:
+		return JS_OPINT;
+	case OP_ADDLOCAL:
+		return JS_OPINTINT;
+	case OP_NUMBER:
+		return JS_OPNUMBER;
+	case OP_STRING:
+	case OP_HASVAR:
+	case OP_GETVAR:
+	case OP_SETVAR:
+	case OP_DELVAR:
+	case OP_DELPROP_S:
+	case OP_CATCH:
+		return JS_OPSTRING;
+	case OP_NEWREGEXP:
+	case OP_GETPROP_S:
+	case OP_SETPROP_S:
+		return JS_OPSTRINGINT;
+	case OP_GETLOCALPROP:
+		return JS_OPSTRINGINTINT;
+	}
+	if (jsC_isjump(opcode))
+		return JS_OPINT;
+	return JS_OPNONE;
+}
+
+/* Whether the operand of an opcode is a code address. */
+int jsC_isjump(int opcode)
+{
+	switch (opcode) {
+	case OP_TRY:
+	case OP_JCASE:
+	case OP_JUMP:
+	case OP_JTRUE:
+	case OP_JFALSE:
+	case OP_JLT:
+	case OP_JGT:
+	case OP_JLE:
+	case OP_JGE:
+	case OP_JNLT:
+	case OP_JNGT:
+	case OP_JNLE:
+	case OP_JNGE:
+	case OP_JEQ:
+	case OP_JNE:
+	case OP_JSTRICTEQ:
+	case OP_JSTRICTNE:
+		return 1;
+	}
+	return 0;
+}
+
 /* Emit opcodes, constants and jumps */
 
 static void emitraw(JF, int value)
@@ -80,9 +148,29 @@ static void emitraw(JF, int value)
 	F->code[F->codelen++] = value;
 }
 
+static void emitlineinfo(JF)
+{
+	if (F->linelen > 0) {
+		js_LineInfo *last = &F->linetab[F->linelen - 1];
+		if (last->line == F->lastline)
+			return;
+		if (last->pc == F->codelen) {
+			last->line = F->lastline;
+			return;
+		}
+	}
+	if (F->linelen >= F->linecap) {
+		F->linecap = F->linecap ? F->linecap * 2 : 16;
+		F->linetab = js_realloc(J, F->linetab, F->linecap * sizeof *F->linetab);
+	}
+	F->linetab[F->linelen].pc = F->codelen;
+	F->linetab[F->linelen].line = F->lastline;
+	++F->linelen;
+}
+
 static void emit(JF, int value)
 {
-	emitraw(J, F, F->lastline);
+	emitlineinfo(J, F);
 	emitraw(J, F, value);
 }
 
@@ -121,7 +209,7 @@ static int addlocal(JF, js_Ast *ident, int reuse)
 	if (reuse || F->strict) {
 		int i;
 		for (i = 0; i < F->varlen; ++i) {
-			if (!strcmp(F->vartab[i], name)) {
+			if (F->vartab[i] == name) { /* both interned */
 				if (reuse)
 					return i+1;
 				if (F->strict)
@@ -141,7 +229,7 @@ static int findlocal(JF, const char *name)
 {
 	int i;
 	for (i = F->varlen; i > 0; --i)
-		if (!strcmp(F->vartab[i-1], name))
+		if (F->vartab[i-1] == name) /* both interned */
 			return i;
 	return -1;
 }
@@ -187,6 +275,22 @@ static void emitstring(JF, int opcode, const char *str)
 #undef N
 }
 
+static int addpropcache(JF)
+{
+	if (F->pcachelen >= F->pcachecap) {
+		F->pcachecap = F->pcachecap ? F->pcachecap * 2 : 16;
+		F->pcache = js_realloc(J, F->pcache, F->pcachecap * sizeof *F->pcache);
+	}
+	memset(&F->pcache[F->pcachelen], 0, sizeof *F->pcache);
+	return F->pcachelen++;
+}
+
+static void emitpropstring(JF, int opcode, const char *str)
+{
+	emitstring(J, F, opcode, str);
+	emitarg(J, F, addpropcache(J, F));
+}
+
 static void emitlocal(JF, int oploc, int opvar, js_Ast *ident)
 {
 	int is_arguments = !strcmp(ident->string, "arguments");
@@ -394,7 +498,7 @@ static void cassign(JF, js_Ast *exp)
 		cexp(J, F, lhs->a);
 		cexp(J, F, rhs);
 		emitline(J, F, exp);
-		emitstring(J, F, OP_SETPROP_S, lhs->b->string);
+		emitpropstring(J, F, OP_SETPROP_S, lhs->b->string);
 		break;
 	default:
 		jsC_error(J, lhs, "invalid l-value in assignment");
@@ -432,7 +536,7 @@ static void cassignforin(JF, js_Ast *stm)
 		cexp(J, F, lhs->a);
 		emitline(J, F, lhs);
 		emit(J, F, OP_ROT2);
-		emitstring(J, F, OP_SETPROP_S, lhs->b->string);
+		emitpropstring(J, F, OP_SETPROP_S, lhs->b->string);
 		emit(J, F, OP_POP);
 		break;
 	default:
@@ -458,7 +562,7 @@ static void cassignop1(JF, js_Ast *lhs)
 		cexp(J, F, lhs->a);
 		emitline(J, F, lhs);
 		emit(J, F, OP_DUP);
-		emitstring(J, F, OP_GETPROP_S, lhs->b->string);
+		emitpropstring(J, F, OP_GETPROP_S, lhs->b->string);
 		break;
 	default:
 		jsC_error(J, lhs, "invalid l-value in assignment");
@@ -481,7 +585,7 @@ static void cassignop2(JF, js_Ast *lhs, int postfix)
 	case EXP_MEMBER:
 		emitline(J, F, lhs);
 		if (postfix) emit(J, F, OP_ROT3);
-		emitstring(J, F, OP_SETPROP_S, lhs->b->string);
+		emitpropstring(J, F, OP_SETPROP_S, lhs->b->string);
 		break;
 	default:
 		jsC_error(J, lhs, "invalid l-value in assignment");
@@ -551,7 +655,7 @@ static void ccall(JF, js_Ast *fun, js_Ast *args)
 	case EXP_MEMBER:
 		cexp(J, F, fun->a);
 		emit(J, F, OP_DUP);
-		emitstring(J, F, OP_GETPROP_S, fun->b->string);
+		emitpropstring(J, F, OP_GETPROP_S, fun->b->string);
 		emit(J, F, OP_ROT2);
 		break;
 	case EXP_IDENTIFIER:
@@ -641,7 +745,7 @@ static void cexp(JF, js_Ast *exp)
 	case EXP_MEMBER:
 		cexp(J, F, exp->a);
 		emitline(J, F, exp);
-		emitstring(J, F, OP_GETPROP_S, exp->b->string);
+		emitpropstring(J, F, OP_GETPROP_S, exp->b->string);
 		break;
 
 	case EXP_CALL:
@@ -1417,6 +1521,373 @@ static void cfunbody(JF, js_Ast *name, js_Ast *params, js_Ast *body, int is_fun_
 	}
 }
 
+/* Peephole optimizer */
+
+/*
+	Once a function is compiled its code is rewritten in place, front to
+	back. Each instruction is copied down to the end of the new code and the
+	tail is then reduced for as long as a pattern matches: constants are
+	folded, values pushed only to be popped are dropped, branches on
+	constants are resolved, and common sequences are fused into the local
+	variable, property and compare-and-branch superinstructions. A pattern
+	may start at a jump target but never reaches back past one. Every
+	rewrite is shorter than what it replaces, so the new code never
+	overtakes the old. Jump addresses and the line table are mapped to the
+	new code at the end.
+
+	Locals live on the stack only in lightweight functions, so only those
+	get the local variable superinstructions.
+*/
+
+#define NUMWORDS (int)(sizeof(double) / sizeof(js_Instruction))
+#define STRWORDS (int)(sizeof(const char *) / sizeof(js_Instruction))
+
+typedef struct
+{
+	js_Instruction *code;
+	int *map; /* old code index to new code index; -1 marks a jump target not yet reached */
+	int *ins; /* start of each instruction in the new code */
+	int n, len; /* instructions and words of new code */
+	int fence; /* first instruction a pattern may include */
+	int last; /* last word of old code copied */
+} peepstate;
+
+static int peeplength(int opcode)
+{
+	switch (jsC_operands(opcode)) {
+	case JS_OPINT: return 2;
+	case JS_OPINTINT: return 3;
+	case JS_OPNUMBER: return 1 + NUMWORDS;
+	case JS_OPSTRING: return 1 + STRWORDS;
+	case JS_OPSTRINGINT: return 2 + STRWORDS;
+	case JS_OPSTRINGINTINT: return 3 + STRWORDS;
+	}
+	return 1;
+}
+
+/* The opcode of the k-th instruction from the end, if a pattern may use it. */
+static int peepop(peepstate *P, int k)
+{
+	if (P->n - k < P->fence)
+		return -1;
+	return P->code[P->ins[P->n - k]];
+}
+
+static int peeparg(peepstate *P, int k, int i)
+{
+	return P->code[P->ins[P->n - k] + 1 + i];
+}
+
+static void peeptrim(peepstate *P, int k)
+{
+	int i;
+	P->n -= k;
+	P->len = P->ins[P->n];
+	/* whatever was dropped now maps to what comes next */
+	for (i = P->last; i >= 0 && P->map[i] > P->len; --i)
+		P->map[i] = P->len;
+}
+
+static void peepemit(peepstate *P, int opcode)
+{
+	P->ins[P->n++] = P->len;
+	P->code[P->len++] = opcode;
+}
+
+static void peepword(peepstate *P, int value)
+{
+	P->code[P->len++] = value;
+}
+
+static int peepnumber(peepstate *P, int k, double *x)
+{
+	switch (peepop(P, k)) {
+	case OP_INTEGER:
+		*x = peeparg(P, k, 0) - 32768;
+		return 1;
+	case OP_NUMBER:
+		memcpy(x, &P->code[P->ins[P->n - k] + 1], sizeof *x);
+		return 1;
+	}
+	return 0;
+}
+
+static int peepisinteger(double x)
+{
+	return x >= SHRT_MIN && x <= SHRT_MAX && x == (int)x && !(x == 0 && signbit(x));
+}
+
+static void peepemitnumber(peepstate *P, double x)
+{
+	js_Instruction w[NUMWORDS];
+	int i;
+	if (peepisinteger(x)) {
+		peepemit(P, OP_INTEGER);
+		peepword(P, x + 32768);
+	} else {
+		peepemit(P, OP_NUMBER);
+		memcpy(w, &x, sizeof x);
+		for (i = 0; i < NUMWORDS; ++i)
+			peepword(P, w[i]);
+	}
+}
+
+/* Whether the k-th instruction from the end pushes a true (1) or false (0) constant. */
+static int peeptruth(peepstate *P, int k)
+{
+	double x;
+	switch (peepop(P, k)) {
+	case OP_TRUE:
+		return 1;
+	case OP_FALSE:
+	case OP_NULL:
+	case OP_UNDEF:
+		return 0;
+	}
+	if (peepnumber(P, k, &x))
+		return x != 0 && !isnan(x);
+	return -1;
+}
+
+static int peepfold(int opcode, double x, double y, double *z)
+{
+	switch (opcode) {
+	case OP_MUL: *z = x * y; return 1;
+	case OP_DIV: *z = x / y; return 1;
+	case OP_MOD: *z = fmod(x, y); return 1;
+	case OP_ADD: *z = x + y; return 1;
+	case OP_SUB: *z = x - y; return 1;
+	case OP_SHL: *z = jsV_numbertoint32(x) << (jsV_numbertouint32(y) & 0x1F); return 1;
+	case OP_SHR: *z = jsV_numbertoint32(x) >> (jsV_numbertouint32(y) & 0x1F); return 1;
+	case OP_USHR: *z = jsV_numbertouint32(x) >> (jsV_numbertouint32(y) & 0x1F); return 1;
+	case OP_BITAND: *z = jsV_numbertoint32(x) & jsV_numbertoint32(y); return 1;
+	case OP_BITXOR: *z = jsV_numbertoint32(x) ^ jsV_numbertoint32(y); return 1;
+	case OP_BITOR: *z = jsV_numbertoint32(x) | jsV_numbertoint32(y); return 1;
+	}
+	return 0;
+}
+
+/* The compare-and-branch instruction for a comparison followed by JTRUE or JFALSE. */
+static int peepbranch(int compare, int jtrue)
+{
+	switch (compare) {
+	case OP_LT: return jtrue ? OP_JLT : OP_JNLT;
+	case OP_GT: return jtrue ? OP_JGT : OP_JNGT;
+	case OP_LE: return jtrue ? OP_JLE : OP_JNLE;
+	case OP_GE: return jtrue ? OP_JGE : OP_JNGE;
+	case OP_EQ: return jtrue ? OP_JEQ : OP_JNE;
+	case OP_NE: return jtrue ? OP_JNE : OP_JEQ;
+	case OP_STRICTEQ: return jtrue ? OP_JSTRICTEQ : OP_JSTRICTNE;
+	case OP_STRICTNE: return jtrue ? OP_JSTRICTNE : OP_JSTRICTEQ;
+	}
+	return 0;
+}
+
+static int peepreduce(JF, peepstate *P)
+{
+	js_Instruction w[STRWORDS];
+	double x, y, z;
+	int a, b, c, k, n, i, t;
+
+	(void)J;
+
+	a = peepop(P, 1);
+	b = peepop(P, 2);
+
+	switch (a) {
+	case OP_POP:
+		if (b == OP_DUP || b == OP_INTEGER || b == OP_NUMBER || b == OP_STRING ||
+			b == OP_UNDEF || b == OP_NULL || b == OP_TRUE || b == OP_FALSE ||
+			(b == OP_GETLOCAL && F->lightweight))
+		{
+			peeptrim(P, 2);
+			return 1;
+		}
+		if (b == OP_SETLOCAL && F->lightweight) {
+			k = peeparg(P, 2, 0);
+			peeptrim(P, 2);
+			peepemit(P, OP_PUTLOCAL);
+			peepword(P, k);
+			return 1;
+		}
+		/* x++ and x-- as statements */
+		c = peepop(P, 4);
+		if (b == OP_PUTLOCAL && peepop(P, 3) == OP_ROT2 && (c == OP_POSTINC || c == OP_POSTDEC) &&
+			peepop(P, 5) == OP_GETLOCAL && peeparg(P, 5, 0) == peeparg(P, 2, 0))
+		{
+			k = peeparg(P, 2, 0);
+			peeptrim(P, 5);
+			peepemit(P, c == OP_POSTINC ? OP_INCLOCAL : OP_DECLOCAL);
+			peepword(P, k);
+			return 1;
+		}
+		break;
+
+	case OP_PUTLOCAL:
+		k = peeparg(P, 1, 0);
+		/* ++x and --x */
+		if ((b == OP_INC || b == OP_DEC) && peepop(P, 3) == OP_GETLOCAL && peeparg(P, 3, 0) == k) {
+			peeptrim(P, 3);
+			peepemit(P, b == OP_INC ? OP_INCLOCAL : OP_DECLOCAL);
+			peepword(P, k);
+			return 1;
+		}
+		/* x += n and x -= 1 */
+		if ((b == OP_ADD || b == OP_SUB) && peepop(P, 3) == OP_INTEGER &&
+			peepop(P, 4) == OP_GETLOCAL && peeparg(P, 4, 0) == k)
+		{
+			n = peeparg(P, 3, 0);
+			if (b == OP_ADD) {
+				peeptrim(P, 4);
+				peepemit(P, OP_ADDLOCAL);
+				peepword(P, k);
+				peepword(P, n);
+				return 1;
+			}
+			if (n == 32768 + 1) {
+				peeptrim(P, 4);
+				peepemit(P, OP_DECLOCAL);
+				peepword(P, k);
+				return 1;
+			}
+		}
+		break;
+
+	case OP_GETPROP_S:
+		if (b == OP_GETLOCAL && F->lightweight) {
+			k = peeparg(P, 2, 0);
+			memcpy(w, &P->code[P->ins[P->n - 1] + 1], sizeof w);
+			n = peeparg(P, 1, STRWORDS);
+			peeptrim(P, 2);
+			peepemit(P, OP_GETLOCALPROP);
+			for (i = 0; i < STRWORDS; ++i)
+				peepword(P, w[i]);
+			peepword(P, n);
+			peepword(P, k);
+			return 1;
+		}
+		break;
+
+	case OP_JTRUE:
+	case OP_JFALSE:
+		n = peeparg(P, 1, 0);
+		t = peeptruth(P, 2);
+		if (t >= 0) {
+			peeptrim(P, 2);
+			if (t == (a == OP_JTRUE)) {
+				peepemit(P, OP_JUMP);
+				peepword(P, n);
+			}
+			return 1;
+		}
+		if (b == OP_LOGNOT) {
+			peeptrim(P, 2);
+			peepemit(P, a == OP_JTRUE ? OP_JFALSE : OP_JTRUE);
+			peepword(P, n);
+			return 1;
+		}
+		t = peepbranch(b, a == OP_JTRUE);
+		if (t) {
+			peeptrim(P, 2);
+			peepemit(P, t);
+			peepword(P, n);
+			return 1;
+		}
+		break;
+
+	case OP_LOGNOT:
+		t = peeptruth(P, 2);
+		if (t >= 0) {
+			peeptrim(P, 2);
+			peepemit(P, t ? OP_FALSE : OP_TRUE);
+			return 1;
+		}
+		break;
+
+	case OP_POS:
+	case OP_NEG:
+	case OP_BITNOT:
+		if (peepnumber(P, 2, &x)) {
+			z = a == OP_POS ? x : a == OP_NEG ? -x : ~jsV_numbertoint32(x);
+			/* an integer folds only to an integer, so the code never grows */
+			if (b == OP_INTEGER && !peepisinteger(z))
+				break;
+			peeptrim(P, 2);
+			peepemitnumber(P, z);
+			return 1;
+		}
+		break;
+
+	default:
+		if (peepnumber(P, 3, &x) && peepnumber(P, 2, &y) && peepfold(a, x, y, &z)) {
+			peeptrim(P, 3);
+			peepemitnumber(P, z);
+			return 1;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static void peephole(JF)
+{
+	peepstate P;
+	js_LineInfo *line;
+	int pc, len, i, n;
+
+	if (F->codelen == 0)
+		return;
+
+	memset(&P, 0, sizeof P);
+	P.code = F->code;
+	P.map = js_malloc(J, (2 * F->codelen + 1) * sizeof *P.map);
+	P.ins = P.map + F->codelen + 1;
+	memset(P.map, 0, (F->codelen + 1) * sizeof *P.map);
+
+	for (pc = 0; pc < F->codelen; pc += peeplength(F->code[pc]))
+		if (jsC_isjump(F->code[pc]))
+			P.map[F->code[pc + 1]] = -1;
+
+	for (pc = 0; pc < F->codelen; pc += len) {
+		len = peeplength(F->code[pc]);
+		if (P.map[pc] < 0)
+			P.fence = P.n;
+		for (i = 0; i < len; ++i)
+			P.map[pc + i] = P.len;
+		P.last = pc + len - 1;
+		P.ins[P.n++] = P.len;
+		memmove(&P.code[P.len], &F->code[pc], len * sizeof *P.code);
+		P.len += len;
+		while (peepreduce(J, F, &P))
+			;
+	}
+	P.map[F->codelen] = P.len;
+
+	for (i = 0; i < P.n; ++i)
+		if (jsC_isjump(P.code[P.ins[i]]))
+			P.code[P.ins[i] + 1] = P.map[P.code[P.ins[i] + 1]];
+
+	/* where instructions were merged or dropped the last line applies */
+	for (i = n = 0; i < F->linelen; ++i) {
+		pc = P.map[F->linetab[i].pc];
+		if (n > 0 && F->linetab[n - 1].pc == pc)
+			--n;
+		if (n > 0 && F->linetab[n - 1].line == F->linetab[i].line)
+			continue;
+		line = &F->linetab[n++];
+		line->line = F->linetab[i].line;
+		line->pc = pc;
+	}
+	F->linelen = n;
+	F->codelen = P.len;
+
+	js_free(J, P.map);
+}
+
+#undef NUMWORDS
+#undef STRWORDS
+
 js_Function *jsC_compilefunction(js_State *J, js_Ast *prog)
 {
 	return newfun(J, prog->line, prog->a, prog->b, prog->c, 0, J->default_strict, 1);
@@ -1426,3 +1897,89 @@ js_Function *jsC_compilescript(js_State *J, js_Ast *prog, int default_strict)
 {
 	return newfun(J, prog ? prog->line : 0, NULL, NULL, prog, 1, default_strict, 0);
 }
+
+#ifdef PEEPBENCH
+
+#include <time.h>
+
+/* cc -O2 -DPEEPBENCH -o peepbench one.c -lm */
+
+static int countcode(js_Function *F)
+{
+	js_Instruction *pc = F->code, *end = F->code + F->codelen;
+	int i, n = 0;
+	while (pc < end) {
+		pc += peeplength(*pc);
+		++n;
+	}
+	for (i = 0; i < F->funlen; ++i)
+		n += countcode(F->funtab[i]);
+	return n;
+}
+
+static const char *programs[][2] = {
+	{ "loop", "function loop(n) { var s = 0; for (var i = 0; i < n; i++) { s += i; if (s > 1e9) s -= 1e9; } return s; } loop(3000000)" },
+	{ "fib", "function fib(n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); } fib(25)" },
+	{ "points", "function points(n) {"
+		"  var a = [], t = 0;"
+		"  for (var i = 0; i < 100; i++) a.push({ x: i, y: i * 2 });"
+		"  for (var k = 0; k < n; k++) for (var j = 0; j < a.length; j++) { var p = a[j]; t += p.x * p.y; }"
+		"  return t;"
+		"} points(5000)" },
+	{ "sieve", "function sieve(n) {"
+		"  var f = [], c = 0;"
+		"  for (var i = 0; i <= n; i++) f[i] = true;"
+		"  for (var i = 2; i <= n; i++) if (f[i]) { c++; for (var j = i + i; j <= n; j += i) f[j] = false; }"
+		"  return c;"
+		"} sieve(1000000)" },
+	{ "collatz", "function collatz(n) {"
+		"  var best = 0;"
+		"  for (var i = 1; i < n; i++) {"
+		"    var x = i, k = 0;"
+		"    while (x !== 1) { x = x % 2 === 0 ? x / 2 : 3 * x + 1; k++; }"
+		"    if (k > best) best = k;"
+		"  }"
+		"  return best;"
+		"} collatz(100000)" },
+	{ "strings", "function words(n) {"
+		"  var s = '';"
+		"  for (var i = 0; i < n; i++) { var w = 'w' + i; if (w.length > 3) s += w.charAt(1); }"
+		"  return s.length;"
+		"} words(300000)" },
+};
+
+static double bench(const char *source, int nopeephole, int *count)
+{
+	struct timespec t0, t1;
+	double ms, best = 0;
+	int i;
+	for (i = 0; i < 5; ++i) {
+		js_State *J = js_newstate(NULL, NULL, 0);
+		J->nopeephole = nopeephole;
+		js_loadstring(J, "bench", source);
+		*count = countcode(js_toobject(J, -1)->u.f.function);
+		js_pushundefined(J);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		js_call(J, 0);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+		if (i == 0 || ms < best)
+			best = ms;
+		js_freestate(J);
+	}
+	return best;
+}
+
+int main(void)
+{
+	double before, after;
+	int i, n0, n1;
+	for (i = 0; i < nelem(programs); ++i) {
+		before = bench(programs[i][1], 1, &n0);
+		after = bench(programs[i][1], 0, &n1);
+		printf("%-8s %4d -> %4d instructions, %7.1f -> %7.1f ms\n", programs[i][0], n0, n1, before, after);
+	}
+	return 0;
+}
+
+#endif
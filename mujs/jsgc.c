@@ -1,24 +1,76 @@
 #include "jsi.h"
 #include "regexp.h"
 
-static void jsG_freeenvironment(js_State *J, js_Environment *env)
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#elif defined(_WIN32)
+#include <sys/timeb.h>
+#endif
+
+/*
+	The collector is an incremental tri-color mark and sweep.
+
+	White objects have a stale gcmark, gray objects are marked and queued on
+	the gcroot scan list, and black objects are marked and scanned. A cycle
+	marks the roots, scans a slice of the gray list per step, then re-marks
+	the roots and drains the list in one final pause before sweeping the
+	allocation lists a slice at a time.
+
+	While marking, every pointer stored into an object goes through
+	jsG_barrier, which shades the stored value, so a black object never
+	points at a white one. Objects allocated while marking start out gray;
+	everything else allocated during a cycle starts out marked.
+
+	With a zero budget each trigger runs a whole cycle in one pause.
+*/
+
+double jsG_now(void)
 {
-	js_free(J, env);
+#if defined(__unix__) || defined(__APPLE__)
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+#elif defined(_WIN32)
+	struct _timeb tv;
+	_ftime(&tv);
+	return tv.time * 1e6 + tv.millitm * 1e3;
+#else
+	return clock() * (1e6 / CLOCKS_PER_SEC);
+#endif
 }
 
-static void jsG_freefunction(js_State *J, js_Function *fun)
+static unsigned long jsG_freeenvironment(js_State *J, js_Environment *env)
 {
+	jsP_free(J, env, sizeof *env);
+	return sizeof *env;
+}
+
+static unsigned long jsG_freefunction(js_State *J, js_Function *fun)
+{
+	unsigned long size = sizeof *fun;
+	size += fun->funcap * sizeof *fun->funtab;
+	size += fun->varcap * sizeof *fun->vartab;
+	size += fun->codecap * sizeof *fun->code;
+	size += fun->linecap * sizeof *fun->linetab;
+	size += fun->pcachecap * sizeof *fun->pcache;
 	js_free(J, fun->funtab);
 	js_free(J, fun->vartab);
 	js_free(J, fun->code);
+	js_free(J, fun->linetab);
+	js_free(J, fun->pcache);
 	js_free(J, fun);
+	return size;
 }
 
-static void jsG_freeproperty(js_State *J, js_Property *node)
+static unsigned long jsG_freeproperty(js_State *J, js_Property *node)
 {
-	if (node->left->level) jsG_freeproperty(J, node->left);
-	if (node->right->level) jsG_freeproperty(J, node->right);
-	js_free(J, node);
+	unsigned long size = offsetof(js_Property, name) + strlen(node->name) + 1;
+	if (node->left->level) size += jsG_freeproperty(J, node->left);
+	if (node->right->level) size += jsG_freeproperty(J, node->right);
+	jsP_free(J, node, offsetof(js_Property, name) + strlen(node->name) + 1);
+	return size;
 }
 
 static void jsG_freeiterator(js_State *J, js_Iterator *node)
@@ -30,27 +82,59 @@ static void jsG_freeiterator(js_State *J, js_Iterator *node)
 	}
 }
 
-static void jsG_freeobject(js_State *J, js_Object *obj)
+/* Free what the object owns besides its properties. */
+static unsigned long jsG_releaseobject(js_State *J, js_Object *obj)
 {
-	if (obj->properties->level)
-		jsG_freeproperty(J, obj->properties);
+	unsigned long size = obj->slotcap * sizeof *obj->slots;
+	if (obj->slots)
+		jsP_free(J, obj->slots, obj->slotcap * sizeof *obj->slots);
 	if (obj->type == JS_CREGEXP) {
 		js_free(J, obj->u.r.source);
-		js_regfreex(J->alloc, J->actx, obj->u.r.prog);
+		js_releaseregexp(J, obj->u.r.regprog);
 	}
-	if (obj->type == JS_CSTRING) {
-		if (obj->u.s.string != obj->u.s.shrstr)
-			js_free(J, obj->u.s.string);
-	}
-	if (obj->type == JS_CARRAY && obj->u.a.simple)
+	if (obj->type == JS_CARRAY && obj->u.a.simple) {
+		size += obj->u.a.flat_capacity * sizeof *obj->u.a.array;
 		js_free(J, obj->u.a.array);
+	}
+	if (obj->type == JS_CARRAYBUFFER) {
+		size += obj->u.ab.length;
+		js_free(J, obj->u.ab.data);
+	}
 	if (obj->type == JS_CITERATOR)
 		jsG_freeiterator(J, obj->u.iter.head);
 	if (obj->type == JS_CUSERDATA && obj->u.user.finalize)
 		obj->u.user.finalize(J, obj->u.user.data);
 	if (obj->type == JS_CCFUNCTION && obj->u.c.finalize)
 		obj->u.c.finalize(J, obj->u.c.data);
-	js_free(J, obj);
+	return size;
+}
+
+static unsigned long jsG_freeobject(js_State *J, js_Object *obj)
+{
+	unsigned long size = sizeof *obj;
+	if (obj->properties->level)
+		size += jsG_freeproperty(J, obj->properties);
+	size += jsG_releaseobject(J, obj);
+	jsP_free(J, obj, sizeof *obj);
+	return size;
+}
+
+static unsigned long jsG_freestring(js_State *J, js_String *str)
+{
+	unsigned long size;
+	js_free(J, str->utf.index);
+	if (str->isrope) {
+		size = sizeof *str;
+		if (str->p) {
+			size += str->length + 1;
+			js_free(J, str->p);
+		}
+		jsP_free(J, str, sizeof *str);
+	} else {
+		size = offsetof(js_String, u.data) + str->length + 1;
+		jsP_free(J, str, size);
+	}
+	return size;
 }
 
 /* Mark and add object to scan queue */
@@ -80,38 +164,63 @@ static void jsG_markenvironment(js_State *J, int mark, js_Environment *env)
 	} while (env && env->gcmark != mark);
 }
 
+static void jsG_markstring(js_State *J, int mark, js_String *str)
+{
+	while (str->gcmark != mark) {
+		str->gcmark = mark;
+		if (str->p)
+			break;
+		jsG_markstring(J, mark, str->u.rope.right);
+		str = str->u.rope.left;
+	}
+}
+
+static void jsG_markvalue(js_State *J, int mark, js_Value *v)
+{
+	if (v->t.type == JS_TMEMSTR && v->u.memstr->gcmark != mark)
+		jsG_markstring(J, mark, v->u.memstr);
+	if (v->t.type == JS_TOBJECT && v->u.object->gcmark != mark)
+		jsG_markobject(J, mark, v->u.object);
+}
+
 static void jsG_markproperty(js_State *J, int mark, js_Property *node)
 {
 	if (node->left->level) jsG_markproperty(J, mark, node->left);
 	if (node->right->level) jsG_markproperty(J, mark, node->right);
 
-	if (node->value.t.type == JS_TMEMSTR && node->value.u.memstr->gcmark != mark)
-		node->value.u.memstr->gcmark = mark;
-	if (node->value.t.type == JS_TOBJECT && node->value.u.object->gcmark != mark)
-		jsG_markobject(J, mark, node->value.u.object);
+	jsG_markvalue(J, mark, &node->value);
 	if (node->getter && node->getter->gcmark != mark)
 		jsG_markobject(J, mark, node->getter);
 	if (node->setter && node->setter->gcmark != mark)
 		jsG_markobject(J, mark, node->setter);
 }
 
+static void jsG_markshapes(js_State *J, int mark, js_Shape *shape)
+{
+	(void)J;
+	while (shape && shape->gcmark != mark) {
+		shape->gcmark = mark;
+		shape = shape->parent;
+	}
+}
+
 /* Mark everything the object can reach. */
 static void jsG_scanobject(js_State *J, int mark, js_Object *obj)
 {
 	if (obj->properties->level)
 		jsG_markproperty(J, mark, obj->properties);
+	jsG_markshapes(J, mark, obj->shape);
 	if (obj->prototype && obj->prototype->gcmark != mark)
 		jsG_markobject(J, mark, obj->prototype);
 	if (obj->type == JS_CARRAY && obj->u.a.simple) {
 		int i;
-		for (i = 0; i < obj->u.a.flat_length; ++i) {
-			js_Value *v = &obj->u.a.array[i];
-			if (v->t.type == JS_TMEMSTR && v->u.memstr->gcmark != mark)
-				v->u.memstr->gcmark = mark;
-			if (v->t.type == JS_TOBJECT && v->u.object->gcmark != mark)
-				jsG_markobject(J, mark, v->u.object);
-		}
+		for (i = 0; i < obj->u.a.flat_length; ++i)
+			jsG_markvalue(J, mark, &obj->u.a.array[i]);
 	}
+	if (obj->type == JS_CSTRING)
+		jsG_markvalue(J, mark, &obj->u.s.value);
+	if (obj->type == JS_CTYPEDARRAY && obj->u.ta.buffer->gcmark != mark)
+		jsG_markobject(J, mark, obj->u.ta.buffer);
 	if (obj->type == JS_CITERATOR && obj->u.iter.target->gcmark != mark) {
 		jsG_markobject(J, mark, obj->u.iter.target);
 	}
@@ -127,30 +236,14 @@ static void jsG_markstack(js_State *J, int mark)
 {
 	js_Value *v = J->stack;
 	int n = J->top;
-	while (n--) {
-		if (v->t.type == JS_TMEMSTR && v->u.memstr->gcmark != mark)
-			v->u.memstr->gcmark = mark;
-		if (v->t.type == JS_TOBJECT && v->u.object->gcmark != mark)
-			jsG_markobject(J, mark, v->u.object);
-		++v;
-	}
+	while (n--)
+		jsG_markvalue(J, mark, v++);
 }
 
-void js_gc(js_State *J, int report)
+static void jsG_markroots(js_State *J, int mark)
 {
-	js_Function *fun, *nextfun, **prevnextfun;
-	js_Object *obj, *nextobj, **prevnextobj;
-	js_String *str, *nextstr, **prevnextstr;
-	js_Environment *env, *nextenv, **prevnextenv;
-	unsigned int nenv = 0, nfun = 0, nobj = 0, nstr = 0, nprop = 0;
-	unsigned int genv = 0, gfun = 0, gobj = 0, gstr = 0, gprop = 0;
-	int mark;
 	int i;
 
-	mark = J->gcmark = J->gcmark == 1 ? 2 : 1;
-
-	/* Add initial roots. */
-
 	jsG_markobject(J, mark, J->Object_prototype);
 	jsG_markobject(J, mark, J->Array_prototype);
 	jsG_markobject(J, mark, J->Function_prototype);
@@ -159,6 +252,10 @@ void js_gc(js_State *J, int report)
 	jsG_markobject(J, mark, J->String_prototype);
 	jsG_markobject(J, mark, J->RegExp_prototype);
 	jsG_markobject(J, mark, J->Date_prototype);
+	jsG_markobject(J, mark, J->ArrayBuffer_prototype);
+	jsG_markobject(J, mark, J->TypedArray_prototype);
+	for (i = 0; i < JS_ECOUNT; ++i)
+		jsG_markobject(J, mark, J->element_prototype[i]);
 
 	jsG_markobject(J, mark, J->Error_prototype);
 	jsG_markobject(J, mark, J->EvalError_prototype);
@@ -171,114 +268,303 @@ void js_gc(js_State *J, int report)
 	jsG_markobject(J, mark, J->R);
 	jsG_markobject(J, mark, J->G);
 
+	for (i = 0; i < JS_CUSERDATA; ++i)
+		jsG_markshapes(J, mark, J->rootshape[i]);
+
 	jsG_markstack(J, mark);
 
 	jsG_markenvironment(J, mark, J->E);
 	jsG_markenvironment(J, mark, J->GE);
 	for (i = 0; i < J->envtop; ++i)
 		jsG_markenvironment(J, mark, J->envstack[i]);
+}
 
-	/* Scan objects until none remain. */
-
+/* Scan gray objects until none remain or the deadline passes. */
+static int jsG_propagate(js_State *J, double deadline)
+{
+	js_Object *obj;
+	int n = 0;
 	while ((obj = J->gcroot) != NULL) {
 		J->gcroot = obj->gcroot;
 		obj->gcroot = NULL;
-		jsG_scanobject(J, mark, obj);
+		jsG_scanobject(J, J->gcmark, obj);
+		if (deadline > 0 && (++n & 63) == 0 && jsG_now() > deadline)
+			return 0;
 	}
+	return 1;
+}
 
-	/* Free everything not marked. */
-
-	prevnextenv = &J->gcenv;
-	for (env = J->gcenv; env; env = nextenv) {
-		nextenv = env->gcnext;
-		if (env->gcmark != mark) {
-			*prevnextenv = nextenv;
-			jsG_freeenvironment(J, env);
-			++genv;
-		} else {
-			prevnextenv = &env->gcnext;
+/* Shapes are swept in the final marking pause, so none die while sweeping. */
+static void jsG_sweepshapes(js_State *J)
+{
+	js_Shape *shape, *nextshape, **prevnextshape, **kid;
+	js_Function *fun;
+	int mark = J->gcmark;
+	unsigned int freed = 0;
+
+	/* Unlink dead transitions from live shapes before freeing any of them. */
+	for (shape = J->gcshape; shape; shape = shape->gcnext) {
+		if (shape->gcmark != mark && shape->parent && shape->parent->gcmark == mark) {
+			for (kid = &shape->parent->kids; *kid != shape; kid = &(*kid)->sibling)
+				;
+			*kid = shape->sibling;
 		}
-		++nenv;
 	}
 
-	prevnextfun = &J->gcfun;
-	for (fun = J->gcfun; fun; fun = nextfun) {
-		nextfun = fun->gcnext;
-		if (fun->gcmark != mark) {
-			*prevnextfun = nextfun;
-			jsG_freefunction(J, fun);
-			++gfun;
+	prevnextshape = &J->gcshape;
+	for (shape = J->gcshape; shape; shape = nextshape) {
+		nextshape = shape->gcnext;
+		if (shape->gcmark != mark) {
+			*prevnextshape = nextshape;
+			int size = offsetof(js_Shape, name) + strlen(shape->name) + 1;
+			J->gcfreed += size;
+			jsP_free(J, shape, size);
+			if (J->gccounter > 0)
+				--J->gccounter;
+			++freed;
 		} else {
-			prevnextfun = &fun->gcnext;
+			prevnextshape = &shape->gcnext;
+			++J->gclive;
 		}
-		++nfun;
 	}
 
-	prevnextobj = &J->gcobj;
-	for (obj = J->gcobj; obj; obj = nextobj) {
-		nprop += obj->count;
-		nextobj = obj->gcnext;
-		if (obj->gcmark != mark) {
-			gprop += obj->count;
-			*prevnextobj = nextobj;
-			jsG_freeobject(J, obj);
-			++gobj;
-		} else {
-			prevnextobj = &obj->gcnext;
-		}
-		++nobj;
-	}
+	/* Property caches may name a freed shape whose address gets reused. */
+	if (freed > 0)
+		for (fun = J->gcfun; fun; fun = fun->gcnext)
+			if (fun->pcachelen > 0)
+				memset(fun->pcache, 0, fun->pcachelen * sizeof *fun->pcache);
+}
 
-	prevnextstr = &J->gcstr;
-	for (str = J->gcstr; str; str = nextstr) {
-		nextstr = str->gcnext;
-		if (str->gcmark != mark) {
-			*prevnextstr = nextstr;
-			js_free(J, str);
-			++gstr;
-		} else {
-			prevnextstr = &str->gcnext;
-		}
-		++nstr;
+static void jsG_finishmark(js_State *J)
+{
+	/* the stack and scope chains were not tracked by the barrier */
+	jsG_markroots(J, J->gcmark);
+	jsG_propagate(J, 0);
+
+	J->gclive = 0;
+	J->gcfreed = 0;
+	jsG_sweepshapes(J);
+
+	J->gcsweepenv = &J->gcenv;
+	J->gcsweepfun = &J->gcfun;
+	J->gcsweepobj = &J->gcobj;
+	J->gcsweepstr = &J->gcstr;
+	J->gcstate = JS_GCSWEEP;
+}
+
+/*
+	Sweep the allocation lists until done or the deadline passes. The cursors
+	point at the link to the next unswept node, and are re-read each time, so
+	nodes allocated at the list heads between steps are never cut loose.
+*/
+#define SWEEP(TYPE, CURSOR, FREE, COUNT) \
+	while ((node = *CURSOR) != NULL) { \
+		TYPE *x = node; \
+		unsigned int count = COUNT; \
+		if (x->gcmark != mark) { \
+			*CURSOR = x->gcnext; \
+			J->gcfreed += FREE(J, x); \
+			J->gccounter -= count < J->gccounter ? count : J->gccounter; \
+		} else { \
+			CURSOR = &x->gcnext; \
+			J->gclive += count; \
+		} \
+		if (deadline > 0 && (++n & 255) == 0 && jsG_now() > deadline) \
+			return 0; \
 	}
 
-	unsigned int ntot = nenv + nfun + nobj + nstr + nprop;
-	unsigned int gtot = genv + gfun + gobj + gstr + gprop;
-	unsigned int remaining = ntot - gtot;
+static int jsG_sweep(js_State *J, double deadline)
+{
+	int mark = J->gcmark;
+	void *node;
+	int n = 0;
+	SWEEP(js_Environment, J->gcsweepenv, jsG_freeenvironment, 1)
+	SWEEP(js_Function, J->gcsweepfun, jsG_freefunction, 1)
+	SWEEP(js_Object, J->gcsweepobj, jsG_freeobject, 1 + x->count)
+	SWEEP(js_String, J->gcsweepstr, jsG_freestring, 1)
+	return 1;
+}
 
-	J->gccounter = remaining;
-	J->gcthresh = remaining * JS_GCFACTOR;
+#undef SWEEP
+
+static void jsG_finishsweep(js_State *J)
+{
+	js_GCStats *st = &J->gcstats;
+
+	/* gccounter now holds the survivors plus whatever the cycle allocated */
+	J->gcthresh = J->gccounter * JS_GCFACTOR;
+	J->gcstate = JS_GCIDLE;
+
+	st->cycles++;
+	st->last_freed = J->gcfreed;
+	st->total_freed += J->gcfreed;
+	st->live = J->gclive;
+}
+
+static void jsG_startcycle(js_State *J)
+{
+	J->gcmark = J->gcmark == 1 ? 2 : 1;
+	J->gcstate = JS_GCMARK;
+	/* don't let the heap run away from a collector that can't keep up */
+	J->gclimit = J->gccounter * 2;
+	jsG_markroots(J, J->gcmark);
+}
+
+static void jsG_run(js_State *J, double deadline)
+{
+	if (J->gcstate == JS_GCIDLE)
+		jsG_startcycle(J);
+	if (J->gcstate == JS_GCMARK)
+		if (jsG_propagate(J, deadline))
+			jsG_finishmark(J);
+	if (J->gcstate == JS_GCSWEEP)
+		if (jsG_sweep(J, deadline))
+			jsG_finishsweep(J);
+}
+
+static void jsG_recordpause(js_State *J, double start)
+{
+	static const double limit[] = { 0.1, 0.25, 0.5, 1, 2, 5, 10 };
+	js_GCStats *st = &J->gcstats;
+	double ms = (jsG_now() - start) / 1000;
+	int i;
+
+	if (ms < 0)
+		ms = 0;
+	for (i = 0; i < nelem(limit) && ms >= limit[i]; ++i)
+		;
+	st->pauses[i]++;
+	st->steps++;
+	st->last_pause = ms;
+	st->total_pause += ms;
+	if (ms > st->max_pause)
+		st->max_pause = ms;
+}
+
+/* Called from the interpreter when gccounter passes gcthresh. */
+void jsG_step(js_State *J)
+{
+	double start = jsG_now();
+	double deadline = 0;
+
+	if (J->gcbudget > 0 && !(J->gcstate != JS_GCIDLE && J->gccounter > J->gclimit))
+		deadline = start + J->gcbudget;
+
+	jsG_run(J, deadline);
+
+	if (J->gcstate != JS_GCIDLE)
+		J->gcthresh = J->gccounter + JS_GCSTEPSIZE;
+
+	jsG_recordpause(J, start);
+}
+
+void js_gc(js_State *J, int report)
+{
+	double start = jsG_now();
+	unsigned int before;
+
+	/* finish a cycle in progress, then run a complete one */
+	if (J->gcstate != JS_GCIDLE)
+		jsG_run(J, 0);
+	before = J->gccounter;
+	jsG_run(J, 0);
+
+	jsG_recordpause(J, start);
 
 	if (report) {
 		char buf[256];
-		snprintf(buf, sizeof buf, "garbage collected (%d%%): %d/%d envs, %d/%d funs, %d/%d objs, %d/%d props, %d/%d strs",
-			100*gtot/ntot, genv, nenv, gfun, nfun, gobj, nobj, gprop, nprop, gstr, nstr);
+		snprintf(buf, sizeof buf, "garbage collected: %u/%u allocations, %lu bytes freed in %.2f ms",
+			before - J->gccounter, before, J->gcfreed, J->gcstats.last_pause);
 		js_report(J, buf);
 	}
 }
 
+void js_setgcbudget(js_State *J, int usec)
+{
+	J->gcbudget = usec > 0 ? usec : 0;
+}
+
+void js_getgcstats(js_State *J, js_GCStats *stats)
+{
+	*stats = J->gcstats;
+}
+
+/* Colors for allocations made while a cycle is in progress. */
+
+int jsG_newmark(js_State *J)
+{
+	return J->gcstate == JS_GCIDLE ? 0 : J->gcmark;
+}
+
+/* Ropes made while marking stay white, so whatever reaches them traces their halves. */
+int jsG_newropemark(js_State *J)
+{
+	return J->gcstate == JS_GCSWEEP ? J->gcmark : 0;
+}
+
+void jsG_newobject(js_State *J, js_Object *obj)
+{
+	if (J->gcstate == JS_GCMARK)
+		jsG_markobject(J, J->gcmark, obj);
+	else if (J->gcstate == JS_GCSWEEP)
+		obj->gcmark = J->gcmark;
+}
+
+void jsG_newenvironment(js_State *J, js_Environment *env)
+{
+	if (J->gcstate == JS_GCMARK)
+		jsG_markenvironment(J, J->gcmark, env);
+	else if (J->gcstate == JS_GCSWEEP)
+		env->gcmark = J->gcmark;
+}
+
+/* Write barriers: shade what a possibly black object is made to point at. */
+
+void jsG_barrier(js_State *J, js_Value *v)
+{
+	if (J->gcstate == JS_GCMARK)
+		jsG_markvalue(J, J->gcmark, v);
+}
+
+void jsG_barrierobject(js_State *J, js_Object *obj)
+{
+	if (J->gcstate == JS_GCMARK && obj && obj->gcmark != J->gcmark)
+		jsG_markobject(J, J->gcmark, obj);
+}
+
+void jsG_barriershape(js_State *J, js_Shape *shape)
+{
+	if (J->gcstate == JS_GCMARK)
+		jsG_markshapes(J, J->gcmark, shape);
+}
+
 void js_freestate(js_State *J)
 {
 	js_Function *fun, *nextfun;
 	js_Object *obj, *nextobj;
-	js_Environment *env, *nextenv;
 	js_String *str, *nextstr;
+	js_Shape *shape, *nextshape;
 
 	if (!J)
 		return;
 
-	for (env = J->gcenv; env; env = nextenv)
-		nextenv = env->gcnext, jsG_freeenvironment(J, env);
+	/* Environments always come from the pools, which are released whole.
+	 * The other lists are walked for what lives outside of the pools. */
 	for (fun = J->gcfun; fun; fun = nextfun)
 		nextfun = fun->gcnext, jsG_freefunction(J, fun);
 	for (obj = J->gcobj; obj; obj = nextobj)
 		nextobj = obj->gcnext, jsG_freeobject(J, obj);
 	for (str = J->gcstr; str; str = nextstr)
-		nextstr = str->gcnext, js_free(J, str);
+		nextstr = str->gcnext, jsG_freestring(J, str);
+	for (shape = J->gcshape; shape; shape = nextshape)
+		nextshape = shape->gcnext, jsP_free(J, shape, offsetof(js_Shape, name) + strlen(shape->name) + 1);
 
+	js_freeregexpcache(J);
+	jsP_freeslabs(J);
 	jsS_freestrings(J);
 
 	js_free(J, J->lexbuf.text);
+	js_free(J, J->codecache);
 	J->alloc(J->actx, J->stack, 0);
 	J->alloc(J->actx, J, 0);
 }
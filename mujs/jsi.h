@@ -64,16 +64,30 @@ void *js_malloc(js_State *J, int size);
 void *js_realloc(js_State *J, void *ptr, int size);
 void js_free(js_State *J, void *ptr);
 
+/* Pooled allocation of small structures; the size must be given again on free. */
+void *jsP_alloc(js_State *J, int size);
+void jsP_free(js_State *J, void *ptr, int size);
+void jsP_freeslabs(js_State *J);
+void jsP_eachslab(js_State *J, void (*fn)(void *ctx, char *slab), void *ctx);
+void jsP_addslab(js_State *J, char *slab);
+
 typedef union js_Value js_Value;
 typedef struct js_Regexp js_Regexp;
+typedef struct js_Regprog js_Regprog;
 typedef struct js_Object js_Object;
 typedef struct js_String js_String;
 typedef struct js_Ast js_Ast;
 typedef struct js_Function js_Function;
 typedef struct js_Environment js_Environment;
 typedef struct js_StringNode js_StringNode;
+typedef struct js_UtfInfo js_UtfInfo;
 typedef struct js_Jumpbuf js_Jumpbuf;
 typedef struct js_StackTrace js_StackTrace;
+typedef struct js_LineInfo js_LineInfo;
+typedef struct js_Shape js_Shape;
+typedef struct js_PropertyCache js_PropertyCache;
+typedef struct js_Slab js_Slab;
+typedef struct js_PoolChunk { struct js_PoolChunk *next; } js_PoolChunk;
 
 /* Limits */
 
@@ -91,6 +105,10 @@ typedef struct js_StackTrace js_StackTrace;
 #define JS_ARRAYLIMIT (1<<26)	/* limit arrays to 64M entries (1G of flat array data) */
 #endif
 
+#ifndef JS_BUFFERLIMIT
+#define JS_BUFFERLIMIT (1<<30)	/* max ArrayBuffer size in bytes */
+#endif
+
 #ifndef JS_GCFACTOR
 /*
  * GC will try to trigger when memory usage is this value times the minimum
@@ -103,10 +121,44 @@ typedef struct js_StackTrace js_StackTrace;
 #define JS_GCFACTOR 5.0		/* memory overhead factor >= 1.0 */
 #endif
 
+#ifndef JS_GCSTEPSIZE
+#define JS_GCSTEPSIZE 1024	/* allocations between incremental GC steps */
+#endif
+
+#ifndef JS_POOLSLAB
+#define JS_POOLSLAB 16384	/* bytes per memory pool slab */
+#endif
+#ifndef JS_REGEXPCACHE
+#define JS_REGEXPCACHE 64	/* compiled regular expressions kept for reuse */
+#endif
+#ifndef JS_POOLMAX
+#define JS_POOLMAX 256		/* largest allocation served from a pool */
+#endif
+#define JS_POOLGRAIN 16		/* pool size class granularity */
+
+#ifndef JS_SHAPELIMIT
+#define JS_SHAPELIMIT 64	/* objects with more properties than this have no shape */
+#endif
+#ifndef JS_PCACHEWAYS
+#define JS_PCACHEWAYS 4		/* shapes remembered per property access site */
+#endif
+#define JS_PCACHEDEPTH 3	/* receiver and up to two prototypes */
+
 #ifndef JS_ASTLIMIT
 #define JS_ASTLIMIT 400		/* max nested expressions */
 #endif
 
+#ifndef JS_ROPEMIN
+#define JS_ROPEMIN 256		/* shorter concatenations are copied flat */
+#endif
+#ifndef JS_ROPEDEPTH
+#define JS_ROPEDEPTH 4096	/* ropes deeper than this are flattened */
+#endif
+
+#ifndef JS_UTFSTEP
+#define JS_UTFSTEP 64		/* UTF-16 units between sparse string index entries */
+#endif
+
 #ifndef JS_STRLIMIT
 #define JS_STRLIMIT (1<<28)	/* max string length */
 #endif
@@ -125,6 +177,10 @@ char *js_strdup(js_State *J, const char *s);
 const char *js_intern(js_State *J, const char *s);
 void jsS_dumpstrings(js_State *J);
 void jsS_freestrings(js_State *J);
+void jsS_eachstring(js_State *J, void (*fn)(void *ctx, const char *s), void *ctx);
+unsigned int jsS_hash(const char *interned);
+int jsS_length(const char *interned);
+js_UtfInfo *jsS_utfinfo(js_State *J, const char *s);
 
 /* Portable strtod and printf float formatting */
 
@@ -147,6 +203,12 @@ int js_runeat(js_State *J, const char *s, int i);
 int js_utflen(const char *s);
 int js_utfptrtoidx(const char *s, const char *p);
 
+/* UTF-16 indexing of string values, fast for memory and interned strings */
+int jsV_strlength(js_State *J, js_Value *v);
+int jsV_strrune(js_State *J, js_Value *v, int i);
+const char *jsV_strseek(js_State *J, js_Value *v, int i, int *start);
+int jsV_strptrtoidx(js_State *J, js_Value *v, const char *p);
+
 void js_dup(js_State *J);
 void js_dup2(js_State *J);
 void js_rot2(js_State *J);
@@ -159,6 +221,11 @@ void js_dup1rot4(js_State *J);
 
 void js_RegExp_prototype_exec(js_State *J, js_Regexp *re, const char *text);
 
+/* Compiled programs are shared by RegExp objects with the same source and flags. */
+js_Regprog *js_compileregexp(js_State *J, const char *pattern, int opts);
+void js_releaseregexp(js_State *J, js_Regprog *rp);
+void js_freeregexpcache(js_State *J);
+
 void js_trap(js_State *J, int pc); /* dump stack and environment to stdout */
 
 struct js_StackTrace
@@ -166,8 +233,12 @@ struct js_StackTrace
 	const char *name;
 	const char *file;
 	int line;
+	js_Function *function;	/* NULL for native frames */
+	js_Instruction *pc;	/* saved before calls and throwing instructions */
 };
 
+int jsR_traceline(js_State *J, int n);
+
 /* Exception handling */
 
 struct js_Jumpbuf
@@ -196,6 +267,43 @@ void js_putm(js_State *J, js_Buffer **sb, const char *s, const char *e);
 
 /* State struct */
 
+enum { JS_GCIDLE, JS_GCMARK, JS_GCSWEEP };
+
+enum js_Class {
+	JS_COBJECT,
+	JS_CARRAY,
+	JS_CFUNCTION,
+	JS_CSCRIPT, /* function created from global/eval code */
+	JS_CCFUNCTION, /* built-in function */
+	JS_CERROR,
+	JS_CBOOLEAN,
+	JS_CNUMBER,
+	JS_CSTRING,
+	JS_CREGEXP,
+	JS_CDATE,
+	JS_CMATH,
+	JS_CJSON,
+	JS_CARGUMENTS,
+	JS_CITERATOR,
+	JS_CARRAYBUFFER,
+	JS_CTYPEDARRAY,
+	JS_CUSERDATA,
+};
+
+/* Element types of typed arrays */
+enum js_ElementType {
+	JS_EINT8,
+	JS_EUINT8,
+	JS_EUINT8CLAMPED,
+	JS_EINT16,
+	JS_EUINT16,
+	JS_EINT32,
+	JS_EUINT32,
+	JS_EFLOAT32,
+	JS_EFLOAT64,
+	JS_ECOUNT
+};
+
 struct js_State
 {
 	void *actx;
@@ -204,10 +312,13 @@ struct js_State
 	js_Report report;
 	js_Panic panic;
 
-	js_StringNode *strings;
+	js_StringNode **strings; /* intern table */
+	js_StringNode **strptrs; /* the same strings, by the address of their text */
+	int strcap, strcount;
 
 	int default_strict;
 	int strict;
+	int nopeephole; /* compile without the bytecode optimizer, for measuring it */
 
 	/* parser input source */
 	const char *filename;
@@ -237,6 +348,9 @@ struct js_State
 	js_Object *String_prototype;
 	js_Object *RegExp_prototype;
 	js_Object *Date_prototype;
+	js_Object *ArrayBuffer_prototype;
+	js_Object *TypedArray_prototype; /* shared by all element types */
+	js_Object *element_prototype[JS_ECOUNT]; /* Int8Array.prototype etc. */
 
 	js_Object *Error_prototype;
 	js_Object *EvalError_prototype;
@@ -262,17 +376,48 @@ struct js_State
 
 	/* garbage collector list */
 	int gcmark;
-	unsigned int gccounter, gcthresh;
+	int gcstate; /* JS_GCIDLE, JS_GCMARK or JS_GCSWEEP */
+	int gcbudget; /* microseconds per incremental step, 0 for stop-the-world */
+	unsigned int gccounter, gcthresh, gclimit;
+	unsigned int gclive; /* allocations seen alive by the sweep so far */
+	unsigned long gcfreed; /* bytes freed by the sweep so far */
+	js_Environment **gcsweepenv;
+	js_Function **gcsweepfun;
+	js_Object **gcsweepobj;
+	js_String **gcsweepstr;
+	js_GCStats gcstats;
 	js_Environment *gcenv;
 	js_Function *gcfun;
 	js_Object *gcobj;
 	js_String *gcstr;
+	js_Shape *gcshape;
+
+	js_Shape *rootshape[JS_CUSERDATA]; /* empty shape per object class */
+
+	/* memory pools for small structures */
+	js_PoolChunk *poolfree[JS_POOLMAX / JS_POOLGRAIN];
+	js_Slab *slabs;
+	char *slabnext, *slabend;
+	js_PoolStats poolstats;
+
+	/* compiled regular expressions, most recently used first */
+	js_Regprog *regcache;
+	int regcount;
+
+	/* directory of compiled scripts, or NULL */
+	char *codecache;
+	js_CodeCacheStats codestats;
 
 	js_Object *gcroot; /* gc scan list */
 
 	int runlimit;
 	int memlimit;
 
+	/* called every interruptinterval run limit checks, or NULL */
+	js_Interrupt interrupt;
+	void *interruptdata;
+	int interruptinterval, interruptcount;
+
 	/* environments on the call stack but currently not in scope */
 	int envtop;
 	js_Environment *envstack[JS_ENVLIMIT];
@@ -309,25 +454,6 @@ enum js_Type {
 	JS_TOBJECT,
 };
 
-enum js_Class {
-	JS_COBJECT,
-	JS_CARRAY,
-	JS_CFUNCTION,
-	JS_CSCRIPT, /* function created from global/eval code */
-	JS_CCFUNCTION, /* built-in function */
-	JS_CERROR,
-	JS_CBOOLEAN,
-	JS_CNUMBER,
-	JS_CSTRING,
-	JS_CREGEXP,
-	JS_CDATE,
-	JS_CMATH,
-	JS_CJSON,
-	JS_CARGUMENTS,
-	JS_CITERATOR,
-	JS_CUSERDATA,
-};
-
 /*
 	Short strings abuse the js_Value struct. By putting the type tag in the
 	last byte, and using 0 as the tag for short strings, we can use the
@@ -351,16 +477,54 @@ union js_Value
 	} u;
 };
 
+/*
+	What UTF-16 indexing has learned about the text of a memory or interned
+	string. All-ASCII text is indexed by byte; see jsstring.c for the rest.
+*/
+struct js_UtfInfo
+{
+	int length; /* in UTF-16 code units, or -1 until counted */
+	int ascii; /* all characters are ASCII, valid once length is counted */
+	int *index; /* sparse UTF-16 index for long non-ASCII strings */
+};
+
+/*
+	Long concatenations build ropes: a rope holds its two halves and has no
+	text until something needs it, when it is flattened in place into a
+	separately allocated buffer and lets go of its halves.
+*/
 struct js_String
 {
 	js_String *gcnext;
 	char gcmark;
-	char p[1];
+	char isrope; /* allocated as a rope node */
+	unsigned short depth; /* 0 for flat strings */
+	int length;
+	char *p; /* text, or NULL for a rope that has not been flattened */
+	js_UtfInfo utf;
+	union {
+		struct { js_String *left, *right; } rope;
+		char data[1]; /* text of strings created flat */
+	} u;
+};
+
+#define JSV_STRTEXT(J, s) ((s)->p ? (s)->p : jsV_flatten(J, s))
+
+struct js_Regprog
+{
+	js_Regprog *prev, *next; /* in the cache, most recently used first */
+	void *prog;
+	unsigned int hash;
+	int opts;
+	int refs; /* RegExp objects using the program */
+	int cached;
+	char pattern[1];
 };
 
 struct js_Regexp
 {
 	void *prog;
+	js_Regprog *regprog;
 	char *source;
 	unsigned short flags;
 	unsigned short last;
@@ -372,14 +536,17 @@ struct js_Object
 	int extensible;
 	js_Property *properties;
 	int count; /* number of properties, for array sparseness check */
+	js_Shape *shape; /* NULL if the layout can't be cached */
+	js_Property **slots; /* properties in shape order */
+	int slotcap;
 	js_Object *prototype;
 	union {
 		int boolean;
 		double number;
 		struct {
 			int length;
-			char *string;
-			char shrstr[16];
+			const char *string; /* the text of the value */
+			js_Value value; /* the primitive string, whose UTF-16 index we share */
 		} s;
 		struct {
 			int length; /* actual length */
@@ -388,6 +555,17 @@ struct js_Object
 			int flat_capacity; /* allocated length of simple array part */
 			js_Value *array;
 		} a;
+		struct {
+			int length; /* in bytes */
+			unsigned char *data;
+		} ab;
+		struct {
+			js_Object *buffer;
+			unsigned char *data; /* in the buffer, at the byte offset */
+			int offset; /* in bytes */
+			int length; /* in elements */
+			int type; /* enum js_ElementType */
+		} ta;
 		struct {
 			js_Function *function;
 			js_Environment *scope;
@@ -431,6 +609,32 @@ struct js_Property
 	char name[1];
 };
 
+/*
+	Objects that gain properties in the same order share a shape. The shape
+	maps each property name to a slot in the object's slot array, so a
+	property access site that has seen a shape before can skip the tree walk.
+	Deleting a property or growing past JS_SHAPELIMIT leaves the object
+	without a shape, and it is looked up the slow way from then on.
+*/
+struct js_Shape
+{
+	js_Shape *parent;
+	js_Shape *kids, *sibling; /* transitions to shapes with one more property */
+	int count; /* number of slots */
+	int gcmark;
+	js_Shape *gcnext;
+	char name[1]; /* property added by the transition from parent */
+};
+
+struct js_PropertyCache
+{
+	struct {
+		js_Shape *shape[JS_PCACHEDEPTH]; /* receiver, then prototypes up to the holder */
+		int depth, slot;
+	} entry[JS_PCACHEWAYS];
+	int next;
+};
+
 struct js_Iterator
 {
 	js_Iterator *next;
@@ -449,6 +653,9 @@ struct js_Environment
 /* jsrun.c */
 js_Environment *jsR_newenvironment(js_State *J, js_Object *variables, js_Environment *outer);
 js_String *jsV_newmemstring(js_State *J, const char *s, int n);
+js_String *jsV_adoptstring(js_State *J, char *p, int n);
+js_String *jsV_newrope(js_State *J, js_String *left, js_String *right);
+const char *jsV_flatten(js_State *J, js_String *rope);
 js_Value *js_tovalue(js_State *J, int idx);
 void js_toprimitive(js_State *J, int idx, int hint);
 js_Object *js_toobject(js_State *J, int idx);
@@ -481,6 +688,8 @@ js_Property *jsV_getpropertyx(js_State *J, js_Object *obj, const char *name, int
 js_Property *jsV_getproperty(js_State *J, js_Object *obj, const char *name);
 js_Property *jsV_setproperty(js_State *J, js_Object *obj, const char *name);
 js_Property *jsV_nextproperty(js_State *J, js_Object *obj, const char *name);
+js_Property *jsV_probecache(js_Object *obj, js_PropertyCache *cache, int *own);
+js_Property *jsV_fillcache(js_State *J, js_Object *obj, const char *name, js_PropertyCache *cache, int *own);
 void jsV_delproperty(js_State *J, js_Object *obj, const char *name);
 
 js_Object *jsV_newiterator(js_State *J, js_Object *obj, int own);
@@ -491,6 +700,23 @@ void jsV_resizearray(js_State *J, js_Object *obj, int newlen);
 void jsV_unflattenarray(js_State *J, js_Object *obj);
 void jsV_growarray(js_State *J, js_Object *obj);
 
+/* jsgc.c */
+double jsG_now(void);
+void jsG_step(js_State *J);
+int jsG_newmark(js_State *J);
+int jsG_newropemark(js_State *J);
+void jsG_newobject(js_State *J, js_Object *obj);
+void jsG_newenvironment(js_State *J, js_Environment *env);
+void jsG_barrier(js_State *J, js_Value *v);
+void jsG_barrierobject(js_State *J, js_Object *obj);
+void jsG_barriershape(js_State *J, js_Shape *shape);
+
+/* jstypedarray.c */
+int jsV_elementsize(int type);
+const char *jsV_elementname(int type);
+double jsV_getelement(js_Object *obj, int k);
+void jsV_setelement(js_Object *obj, int k, double x);
+
 /* Lexer */
 
 enum
@@ -568,7 +794,6 @@ int jsY_findword(const char *s, const char **list, int num);
 
 void jsY_initlex(js_State *J, const char *filename, const char *source);
 int jsY_lex(js_State *J);
-int jsY_lexjson(js_State *J);
 
 /* Parser */
 
@@ -741,6 +966,10 @@ enum js_OpCode
 	OP_GETLOCAL,	/* -K- <value> */
 	OP_SETLOCAL,	/* <value> -K- <value> */
 	OP_DELLOCAL,	/* -K- false */
+	OP_PUTLOCAL,	/* <value> -K- */
+	OP_INCLOCAL,	/* -K- (local = ToNumber(local)+1) */
+	OP_DECLOCAL,	/* -K- (local = ToNumber(local)-1) */
+	OP_ADDLOCAL,	/* -K,N- (local = local + (N-32768)) */
 
 	OP_HASVAR,	/* -S- ( <value> | undefined ) */
 	OP_GETVAR,	/* -S- <value> */
@@ -756,9 +985,10 @@ enum js_OpCode
 	OP_INITSETTER,	/* <obj> <key> <closure> -- <obj> */
 
 	OP_GETPROP,	/* <obj> <name> -- <value> */
-	OP_GETPROP_S,	/* <obj> -S- <value> */
+	OP_GETPROP_S,	/* <obj> -S,C- <value> */
+	OP_GETLOCALPROP,	/* -S,C,K- <value> */
 	OP_SETPROP,	/* <obj> <name> <value> -- <value> */
-	OP_SETPROP_S,	/* <obj> <value> -S- <value> */
+	OP_SETPROP_S,	/* <obj> <value> -S,C- <value> */
 	OP_DELPROP,	/* <obj> <name> -- <success> */
 	OP_DELPROP_S,	/* <obj> -S- <success> */
 
@@ -817,9 +1047,29 @@ enum js_OpCode
 	OP_JUMP,
 	OP_JTRUE,
 	OP_JFALSE,
+
+	/* compare and branch: <a> <b> -ADDR- */
+	OP_JLT,
+	OP_JGT,
+	OP_JLE,
+	OP_JGE,
+	OP_JNLT,
+	OP_JNGT,
+	OP_JNLE,
+	OP_JNGE,
+	OP_JEQ,
+	OP_JNE,
+	OP_JSTRICTEQ,
+	OP_JSTRICTNE,
+
 	OP_RETURN,
 };
 
+struct js_LineInfo
+{
+	int pc, line;
+};
+
 struct js_Function
 {
 	const char *name;
@@ -838,6 +1088,12 @@ struct js_Function
 	const char **vartab;
 	int varcap, varlen;
 
+	js_LineInfo *linetab;	/* sorted by pc; one entry per line change */
+	int linecap, linelen;
+
+	js_PropertyCache *pcache;	/* one per named property access site */
+	int pcachecap, pcachelen;
+
 	const char *filename;
 	int line, lastline;
 
@@ -848,6 +1104,13 @@ struct js_Function
 js_Function *jsC_compilefunction(js_State *J, js_Ast *prog);
 js_Function *jsC_compilescript(js_State *J, js_Ast *prog, int default_strict);
 
+enum { JS_OPNONE, JS_OPINT, JS_OPINTINT, JS_OPNUMBER, JS_OPSTRING, JS_OPSTRINGINT, JS_OPSTRINGINTINT };
+int jsC_operands(int opcode);
+int jsC_isjump(int opcode);
+
+js_Function *jsC_loadcache(js_State *J, const char *filename, const char *source, int strict);
+void jsC_storecache(js_State *J, js_Function *F, const char *filename, const char *source, int strict, double usec);
+
 /* Builtins */
 
 void jsB_init(js_State *J);
@@ -862,6 +1125,7 @@ void jsB_initerror(js_State *J);
 void jsB_initmath(js_State *J);
 void jsB_initjson(js_State *J);
 void jsB_initdate(js_State *J);
+void jsB_inittypedarray(js_State *J);
 
 void jsB_propf(js_State *J, const char *name, js_CFunction cfun, int n);
 void jsB_propn(js_State *J, const char *name, double number);
@@ -29,109 +29,173 @@ void js_putm(js_State *J, js_Buffer **sb, const char *s, const char *e)
 		js_putc(J, sb, *s++);
 }
 
-/* Use an AA-tree to quickly look up interned strings. */
+/*
+	Interned strings live in an open-addressing hash table with linear
+	probing. Each string carries its hash and length in front of it, so the
+	table can grow without rehashing any text, and two interned strings are
+	equal exactly when their pointers are.
+
+	Literal string values are interned or static C strings. A second table
+	finds the node of an interned one by the address of its text, so that
+	indexing can use the UTF-16 length and index kept in the node.
+*/
 
 struct js_StringNode
 {
-	js_StringNode *left, *right;
-	int level;
+	unsigned int hash;
+	int length;
+	js_UtfInfo utf;
 	char string[1];
 };
 
-static js_StringNode jsS_sentinel = { &jsS_sentinel, &jsS_sentinel, 0, ""};
+#define JS_STRINGNODE(s) ((js_StringNode*)((s) - offsetof(js_StringNode, string)))
 
-static js_StringNode *jsS_newstringnode(js_State *J, const char *string, const char **result)
+static unsigned int jsS_hashstring(const char *s, int *lenp)
 {
-	size_t n = strlen(string);
-	if (n > JS_STRLIMIT)
-		js_rangeerror(J, "invalid string length");
-	js_StringNode *node = js_malloc(J, soffsetof(js_StringNode, string) + n + 1);
-	node->left = node->right = &jsS_sentinel;
-	node->level = 1;
-	memcpy(node->string, string, n + 1);
-	return *result = node->string, node;
+	/* FNV-1a */
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned int h = 2166136261u;
+	while (*p) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	*lenp = (int)(p - (const unsigned char *)s);
+	return h;
 }
 
-static js_StringNode *jsS_skew(js_StringNode *node)
+unsigned int jsS_hash(const char *interned)
 {
-	if (node->left->level == node->level) {
-		js_StringNode *temp = node;
-		node = node->left;
-		temp->left = node->right;
-		node->right = temp;
-	}
-	return node;
+	return JS_STRINGNODE(interned)->hash;
+}
+
+int jsS_length(const char *interned)
+{
+	return JS_STRINGNODE(interned)->length;
+}
+
+static unsigned int jsS_hashptr(const char *s)
+{
+	return (unsigned int)((size_t)s >> 3) * 2654435761u;
 }
 
-static js_StringNode *jsS_split(js_StringNode *node)
+/* The UTF-16 cache of an interned string, or NULL if s is not interned. */
+js_UtfInfo *jsS_utfinfo(js_State *J, const char *s)
 {
-	if (node->right->right->level == node->level) {
-		js_StringNode *temp = node;
-		node = node->right;
-		temp->right = node->left;
-		node->left = temp;
-		++node->level;
+	int k;
+	js_StringNode *node;
+	if (!J->strcap)
+		return NULL;
+	k = jsS_hashptr(s) & (J->strcap - 1);
+	while ((node = J->strptrs[k]) != NULL) {
+		if (node->string == s)
+			return &node->utf;
+		k = (k + 1) & (J->strcap - 1);
 	}
-	return node;
+	return NULL;
+}
+
+static void jsS_addptr(js_StringNode **tab, int cap, js_StringNode *node)
+{
+	int k = jsS_hashptr(node->string) & (cap - 1);
+	while (tab[k])
+		k = (k + 1) & (cap - 1);
+	tab[k] = node;
 }
 
-static js_StringNode *jsS_insert(js_State *J, js_StringNode *node, const char *string, const char **result)
+static void jsS_growstrings(js_State *J)
 {
-	if (node != &jsS_sentinel) {
-		int c = strcmp(string, node->string);
-		if (c < 0)
-			node->left = jsS_insert(J, node->left, string, result);
-		else if (c > 0)
-			node->right = jsS_insert(J, node->right, string, result);
-		else
-			return *result = node->string, node;
-		node = jsS_skew(node);
-		node = jsS_split(node);
-		return node;
+	int i, k, cap = J->strcap ? J->strcap * 2 : 1024;
+	js_StringNode **tab = js_malloc(J, cap * sizeof *tab);
+	js_StringNode **ptrs;
+	memset(tab, 0, cap * sizeof *tab);
+	if (js_try(J)) {
+		js_free(J, tab);
+		js_throw(J);
 	}
-	return jsS_newstringnode(J, string, result);
+	ptrs = js_malloc(J, cap * sizeof *ptrs);
+	js_endtry(J);
+	memset(ptrs, 0, cap * sizeof *ptrs);
+	for (i = 0; i < J->strcap; ++i) {
+		js_StringNode *node = J->strings[i];
+		if (node) {
+			k = node->hash & (cap - 1);
+			while (tab[k])
+				k = (k + 1) & (cap - 1);
+			tab[k] = node;
+			jsS_addptr(ptrs, cap, node);
+		}
+	}
+	js_free(J, J->strings);
+	js_free(J, J->strptrs);
+	J->strings = tab;
+	J->strptrs = ptrs;
+	J->strcap = cap;
 }
 
-static void dumpstringnode(js_StringNode *node, int level)
+void jsS_eachstring(js_State *J, void (*fn)(void *ctx, const char *s), void *ctx)
 {
 	int i;
-	if (node->left != &jsS_sentinel)
-		dumpstringnode(node->left, level + 1);
-	printf("%d: ", node->level);
-	for (i = 0; i < level; ++i)
-		putchar('\t');
-	printf("'%s'\n", node->string);
-	if (node->right != &jsS_sentinel)
-		dumpstringnode(node->right, level + 1);
+	for (i = 0; i < J->strcap; ++i)
+		if (J->strings[i])
+			fn(ctx, J->strings[i]->string);
 }
 
 void jsS_dumpstrings(js_State *J)
 {
-	js_StringNode *root = J->strings;
+	int i;
 	printf("interned strings {\n");
-	if (root && root != &jsS_sentinel)
-		dumpstringnode(root, 1);
+	for (i = 0; i < J->strcap; ++i)
+		if (J->strings[i])
+			printf("\t%08x '%s'\n", J->strings[i]->hash, J->strings[i]->string);
 	printf("}\n");
 }
 
-static void jsS_freestringnode(js_State *J, js_StringNode *node)
-{
-	if (node->left != &jsS_sentinel) jsS_freestringnode(J, node->left);
-	if (node->right != &jsS_sentinel) jsS_freestringnode(J, node->right);
-	js_free(J, node);
-}
-
 void jsS_freestrings(js_State *J)
 {
-	if (J->strings && J->strings != &jsS_sentinel)
-		jsS_freestringnode(J, J->strings);
+	int i;
+	for (i = 0; i < J->strcap; ++i) {
+		if (J->strings[i]) {
+			js_free(J, J->strings[i]->utf.index);
+			js_free(J, J->strings[i]);
+		}
+	}
+	js_free(J, J->strings);
+	js_free(J, J->strptrs);
+	J->strings = NULL;
+	J->strptrs = NULL;
+	J->strcap = J->strcount = 0;
 }
 
 const char *js_intern(js_State *J, const char *s)
 {
-	const char *result;
-	if (!J->strings)
-		J->strings = &jsS_sentinel;
-	J->strings = jsS_insert(J, J->strings, s, &result);
-	return result;
+	js_StringNode *node;
+	unsigned int h;
+	int n, k;
+
+	h = jsS_hashstring(s, &n);
+
+	/* keep the load factor at or below one half */
+	if (2 * (J->strcount + 1) > J->strcap)
+		jsS_growstrings(J);
+
+	k = h & (J->strcap - 1);
+	while ((node = J->strings[k]) != NULL) {
+		if (node->hash == h && node->length == n && !memcmp(node->string, s, n))
+			return node->string;
+		k = (k + 1) & (J->strcap - 1);
+	}
+
+	if (n > JS_STRLIMIT)
+		js_rangeerror(J, "invalid string length");
+	node = js_malloc(J, soffsetof(js_StringNode, string) + n + 1);
+	node->hash = h;
+	node->length = n;
+	node->utf.length = -1;
+	node->utf.ascii = 0;
+	node->utf.index = NULL;
+	memcpy(node->string, s, n + 1);
+	J->strings[k] = node;
+	jsS_addptr(J->strptrs, J->strcap, node);
+	J->strcount++;
+	return node->string;
 }
@@ -211,7 +211,7 @@ static void textpush(js_State *J, Rune c)
 		n = runelen(c);
 	if (J->lexbuf.len + n > J->lexbuf.cap) {
 		newcap = J->lexbuf.cap * 2;
-		J->lexbuf.text = js_realloc(J, J->lexbuf.text, J->lexbuf.cap);
+		J->lexbuf.text = js_realloc(J, J->lexbuf.text, newcap);
 		J->lexbuf.cap = newcap;
 	}
 	if (c == EOF)
@@ -741,139 +741,3 @@ int jsY_lex(js_State *J)
 {
 	return J->lasttoken = jsY_lexx(J);
 }
-
-static int lexjsonnumber(js_State *J)
-{
-	const char *s = J->source - 1;
-
-	if (J->lexchar == '-')
-		jsY_next(J);
-
-	if (J->lexchar == '0')
-		jsY_next(J);
-	else if (J->lexchar >= '1' && J->lexchar <= '9')
-		while (isdigit(J->lexchar))
-			jsY_next(J);
-	else
-		jsY_error(J, "unexpected non-digit");
-
-	if (jsY_accept(J, '.')) {
-		if (isdigit(J->lexchar))
-			while (isdigit(J->lexchar))
-				jsY_next(J);
-		else
-			jsY_error(J, "missing digits after decimal point");
-	}
-
-	if (jsY_accept(J, 'e') || jsY_accept(J, 'E')) {
-		if (J->lexchar == '-' || J->lexchar == '+')
-			jsY_next(J);
-		if (isdigit(J->lexchar))
-			while (isdigit(J->lexchar))
-				jsY_next(J);
-		else
-			jsY_error(J, "missing digits after exponent indicator");
-	}
-
-	J->number = js_strtod(s, NULL);
-	return TK_NUMBER;
-}
-
-static int lexjsonescape(js_State *J)
-{
-	int x = 0;
-
-	/* already consumed '\' */
-
-	switch (J->lexchar) {
-	default: jsY_error(J, "invalid escape sequence");
-	case 'u':
-		jsY_next(J);
-		if (!jsY_ishex(J->lexchar)) return 1; else { x |= jsY_tohex(J->lexchar) << 12; jsY_next(J); }
-		if (!jsY_ishex(J->lexchar)) return 1; else { x |= jsY_tohex(J->lexchar) << 8; jsY_next(J); }
-		if (!jsY_ishex(J->lexchar)) return 1; else { x |= jsY_tohex(J->lexchar) << 4; jsY_next(J); }
-		if (!jsY_ishex(J->lexchar)) return 1; else { x |= jsY_tohex(J->lexchar); jsY_next(J); }
-		textpush(J, x);
-		break;
-	case '"': textpush(J, '"'); jsY_next(J); break;
-	case '\\': textpush(J, '\\'); jsY_next(J); break;
-	case '/': textpush(J, '/'); jsY_next(J); break;
-	case 'b': textpush(J, '\b'); jsY_next(J); break;
-	case 'f': textpush(J, '\f'); jsY_next(J); break;
-	case 'n': textpush(J, '\n'); jsY_next(J); break;
-	case 'r': textpush(J, '\r'); jsY_next(J); break;
-	case 't': textpush(J, '\t'); jsY_next(J); break;
-	}
-	return 0;
-}
-
-static int lexjsonstring(js_State *J)
-{
-	const char *s;
-
-	textinit(J);
-
-	while (J->lexchar != '"') {
-		if (J->lexchar == EOF)
-			jsY_error(J, "unterminated string");
-		else if (J->lexchar < 32)
-			jsY_error(J, "invalid control character in string");
-		else if (jsY_accept(J, '\\'))
-			lexjsonescape(J);
-		else {
-			textpush(J, J->lexchar);
-			jsY_next(J);
-		}
-	}
-	jsY_expect(J, '"');
-
-	s = textend(J);
-
-	J->text = s;
-	return TK_STRING;
-}
-
-int jsY_lexjson(js_State *J)
-{
-	while (1) {
-		J->lexline = J->line; /* save location of beginning of token */
-
-		while (jsY_iswhite(J->lexchar) || J->lexchar == '\n')
-			jsY_next(J);
-
-		if ((J->lexchar >= '0' && J->lexchar <= '9') || J->lexchar == '-')
-			return lexjsonnumber(J);
-
-		switch (J->lexchar) {
-		case ',': jsY_next(J); return ',';
-		case ':': jsY_next(J); return ':';
-		case '[': jsY_next(J); return '[';
-		case ']': jsY_next(J); return ']';
-		case '{': jsY_next(J); return '{';
-		case '}': jsY_next(J); return '}';
-
-		case '"':
-			jsY_next(J);
-			return lexjsonstring(J);
-
-		case 'f':
-			jsY_next(J); jsY_expect(J, 'a'); jsY_expect(J, 'l'); jsY_expect(J, 's'); jsY_expect(J, 'e');
-			return TK_FALSE;
-
-		case 'n':
-			jsY_next(J); jsY_expect(J, 'u'); jsY_expect(J, 'l'); jsY_expect(J, 'l');
-			return TK_NULL;
-
-		case 't':
-			jsY_next(J); jsY_expect(J, 'r'); jsY_expect(J, 'u'); jsY_expect(J, 'e');
-			return TK_TRUE;
-
-		case EOF:
-			return 0; /* EOF */
-		}
-
-		if (J->lexchar >= 0x20 && J->lexchar <= 0x7E)
-			jsY_error(J, "unexpected character: '%c'", J->lexchar);
-		jsY_error(J, "unexpected character: \\u%04X", J->lexchar);
-	}
-}
@@ -40,6 +40,14 @@ static void Op_toString(js_State *J)
 		case JS_CJSON: js_pushliteral(J, "[object JSON]"); break;
 		case JS_CARGUMENTS: js_pushliteral(J, "[object Arguments]"); break;
 		case JS_CITERATOR: js_pushliteral(J, "[object Iterator]"); break;
+		case JS_CARRAYBUFFER: js_pushliteral(J, "[object ArrayBuffer]"); break;
+		case JS_CTYPEDARRAY:
+			js_pushliteral(J, "[object ");
+			js_pushliteral(J, jsV_elementname(self->u.ta.type));
+			js_concat(J);
+			js_pushliteral(J, "]");
+			js_concat(J);
+			break;
 		case JS_CUSERDATA:
 			js_pushliteral(J, "[object ");
 			js_pushliteral(J, self->u.user.tag);
@@ -77,6 +85,13 @@ static void Op_hasOwnProperty(js_State *J)
 		}
 	}
 
+	if (self->type == JS_CTYPEDARRAY) {
+		if (js_isarrayindex(J, name, &k) && k >= 0 && k < self->u.ta.length) {
+			js_pushboolean(J, 1);
+			return;
+		}
+	}
+
 	ref = jsV_getownproperty(J, self, name);
 	js_pushboolean(J, ref != NULL);
 }
@@ -205,6 +220,14 @@ static void O_getOwnPropertyNames(js_State *J)
 		}
 	}
 
+	if (obj->type == JS_CTYPEDARRAY) {
+		for (k = 0; k < obj->u.ta.length; ++k) {
+			js_itoa(name, k);
+			js_pushstring(J, name);
+			js_setindex(J, -2, i++);
+		}
+	}
+
 	if (obj->type == JS_CREGEXP) {
 		js_pushliteral(J, "source");
 		js_setindex(J, -2, i++);
@@ -390,6 +413,14 @@ static void O_keys(js_State *J)
 			js_setindex(J, -2, i++);
 		}
 	}
+
+	if (obj->type == JS_CTYPEDARRAY) {
+		for (k = 0; k < obj->u.ta.length; ++k) {
+			js_itoa(name, k);
+			js_pushstring(J, name);
+			js_setindex(J, -2, i++);
+		}
+	}
 }
 
 static void O_preventExtensions(js_State *J)
@@ -21,90 +21,322 @@ int js_isdateobject(js_State *J, int idx)
 	return js_isobject(J, idx) && js_toobject(J, idx)->type == JS_CDATE;
 }
 
-static void jsonnext(js_State *J)
+/*
+	JSON.parse scans the source text itself rather than going through the
+	JavaScript lexer. Strings without escapes are found eight bytes at a
+	time and pushed straight from the source, numbers that fit a double
+	exactly are converted without strtod, and members are added to the
+	new objects directly, since JSON.parse defines them without looking
+	for setters on the prototype chain.
+*/
+
+typedef struct js_JSONParser js_JSONParser;
+
+struct js_JSONParser {
+	const char *source;
+	const char *p, *end;
+};
+
+static void jsonerror(js_State *J, js_JSONParser *P, const char *fmt, ...)
 {
-	J->lookahead = jsY_lexjson(J);
+	va_list ap;
+	char msg[256];
+	const char *s;
+	int line = 1;
+
+	for (s = P->source; s < P->p; ++s)
+		if (*s == '\n')
+			++line;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof msg, fmt, ap);
+	va_end(ap);
+
+	js_syntaxerror(J, "JSON:%d: %s", line, msg);
+}
+
+static void jsonunexpected(js_State *J, js_JSONParser *P, const char *expected)
+{
+	int c = *(const unsigned char *)P->p;
+	if (P->p >= P->end)
+		jsonerror(J, P, "unexpected end of input (expected %s)", expected);
+	if (c >= 0x20 && c <= 0x7E)
+		jsonerror(J, P, "unexpected character: '%c' (expected %s)", c, expected);
+	jsonerror(J, P, "unexpected character: \\x%02X (expected %s)", c, expected);
+}
+
+static void jsonwhite(js_JSONParser *P)
+{
+	while (*P->p == ' ' || *P->p == '\n' || *P->p == '\r' || *P->p == '\t')
+		++P->p;
 }
 
-static int jsonaccept(js_State *J, int t)
+static int jsonaccept(js_JSONParser *P, int c)
 {
-	if (J->lookahead == t) {
-		jsonnext(J);
+	jsonwhite(P);
+	if (*P->p == c) {
+		++P->p;
 		return 1;
 	}
 	return 0;
 }
 
-static void jsonexpect(js_State *J, int t)
+static void jsonexpect(js_State *J, js_JSONParser *P, int c)
 {
-	if (!jsonaccept(J, t))
-		js_syntaxerror(J, "JSON: unexpected token: %s (expected %s)",
-				jsY_tokenstring(J->lookahead), jsY_tokenstring(t));
+	char what[4] = { '\'', c, '\'', 0 };
+	if (!jsonaccept(P, c))
+		jsonunexpected(J, P, what);
 }
 
-static void jsonvalue(js_State *J)
+/* Skip to the first '"', '\\' or control character, eight bytes at a time. */
+static const char *jsonscan(const char *s, const char *end)
 {
-	int i;
+	const unsigned long long ones = 0x0101010101010101ULL;
+	const unsigned long long high = 0x8080808080808080ULL;
+	while (end - s >= 8) {
+		unsigned long long w, q, b;
+		memcpy(&w, s, 8);
+		q = w ^ (ones * '"');
+		b = w ^ (ones * '\\');
+		if ((((q - ones) & ~q) | ((b - ones) & ~b) | ((w - ones * 0x20) & ~w)) & high)
+			break;
+		s += 8;
+	}
+	while (s < end && *s != '"' && *s != '\\' && *(const unsigned char *)s >= 0x20)
+		++s;
+	return s;
+}
 
-	switch (J->lookahead) {
-	case TK_STRING:
-		js_pushstring(J, J->text);
-		jsonnext(J);
-		break;
+static char *jsonreserve(js_State *J, int n)
+{
+	if (J->lexbuf.len + n > J->lexbuf.cap) {
+		int newcap = J->lexbuf.cap ? J->lexbuf.cap : 4096;
+		while (newcap < J->lexbuf.len + n)
+			newcap *= 2;
+		J->lexbuf.text = js_realloc(J, J->lexbuf.text, newcap);
+		J->lexbuf.cap = newcap;
+	}
+	return J->lexbuf.text + J->lexbuf.len;
+}
 
-	case TK_NUMBER:
-		js_pushnumber(J, J->number);
-		jsonnext(J);
+static int jsonhex(js_State *J, js_JSONParser *P)
+{
+	int i, x = 0;
+	for (i = 0; i < 4; ++i) {
+		int c = *P->p;
+		if (c >= '0' && c <= '9') x = (x << 4) | (c - '0');
+		else if (c >= 'a' && c <= 'f') x = (x << 4) | (c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F') x = (x << 4) | (c - 'A' + 10);
+		else jsonerror(J, P, "invalid escape sequence");
+		++P->p;
+	}
+	return x;
+}
+
+/*
+	Scan the string after the opening quote into the lexer's text buffer.
+	Returns NULL instead if the string has no escapes; it is then the *len
+	bytes before the closing quote in the source.
+*/
+static const char *jsonstring(js_State *J, js_JSONParser *P, int *len)
+{
+	const char *start = P->p;
+	const char *s = jsonscan(start, P->end);
+	Rune c;
+
+	if (*s == '"') {
+		*len = s - start;
+		P->p = s + 1;
+		return NULL;
+	}
+
+	J->lexbuf.len = 0;
+	for (;;) {
+		memcpy(jsonreserve(J, s - start), start, s - start);
+		J->lexbuf.len += s - start;
+		P->p = s;
+		if (s >= P->end)
+			jsonerror(J, P, "unterminated string");
+		if (*s == '"')
+			break;
+		if (*s != '\\')
+			jsonerror(J, P, "invalid control character in string");
+		++P->p;
+		switch (*P->p++) {
+		case '"': c = '"'; break;
+		case '\\': c = '\\'; break;
+		case '/': c = '/'; break;
+		case 'b': c = '\b'; break;
+		case 'f': c = '\f'; break;
+		case 'n': c = '\n'; break;
+		case 'r': c = '\r'; break;
+		case 't': c = '\t'; break;
+		case 'u': c = jsonhex(J, P); break;
+		default: --P->p; jsonerror(J, P, "invalid escape sequence");
+		}
+		J->lexbuf.len += runetochar(jsonreserve(J, UTFmax), &c);
+		start = P->p;
+		s = jsonscan(start, P->end);
+	}
+	P->p = s + 1;
+	*len = J->lexbuf.len;
+	*jsonreserve(J, 1) = 0;
+	return J->lexbuf.text;
+}
+
+static double jsonnumber(js_State *J, js_JSONParser *P)
+{
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char *s = P->p;
+	unsigned long long m = 0;
+	int digits = 0, exact = 1, scale = 0, exp = 0, expneg = 0;
+	double v;
+
+	if (*s == '-')
+		++s;
+
+	if (*s == '0') {
+		++s;
+	} else if (*s >= '1' && *s <= '9') {
+		for (; *s >= '0' && *s <= '9'; ++s) {
+			if (digits < 19)
+				m = m * 10 + (*s - '0'), ++digits;
+			else
+				exact = 0;
+		}
+	} else {
+		P->p = s;
+		jsonerror(J, P, "unexpected non-digit");
+	}
+
+	if (*s == '.') {
+		if (!(*++s >= '0' && *s <= '9')) {
+			P->p = s;
+			jsonerror(J, P, "missing digits after decimal point");
+		}
+		for (; *s >= '0' && *s <= '9'; ++s) {
+			if (digits < 19)
+				m = m * 10 + (*s - '0'), ++digits, --scale;
+			else if (*s != '0')
+				exact = 0;
+		}
+	}
+
+	if (*s == 'e' || *s == 'E') {
+		++s;
+		if (*s == '-' || *s == '+')
+			expneg = *s++ == '-';
+		if (!(*s >= '0' && *s <= '9')) {
+			P->p = s;
+			jsonerror(J, P, "missing digits after exponent indicator");
+		}
+		for (; *s >= '0' && *s <= '9'; ++s)
+			if (exp < 100000)
+				exp = exp * 10 + (*s - '0');
+		scale += expneg ? -exp : exp;
+	}
+
+	/* Both m and the power of ten are exact, so one rounding gives the
+	   correctly rounded result. */
+	if (exact && m < (1ULL << 53) && scale >= -22 && scale <= 22) {
+		v = scale < 0 ? (double)m / pow10[-scale] : (double)m * pow10[scale];
+		if (*P->p == '-')
+			v = -v;
+	} else {
+		v = js_strtod(P->p, NULL);
+	}
+
+	P->p = s;
+	return v;
+}
+
+static void jsonliteral(js_State *J, js_JSONParser *P, const char *word)
+{
+	int n = strlen(word);
+	if (strncmp(P->p, word, n))
+		jsonerror(J, P, "unexpected character (expected '%s')", word);
+	P->p += n;
+}
+
+static void jsonvalue(js_State *J, js_JSONParser *P)
+{
+	const char *text;
+	int i, n;
+
+	jsonwhite(P);
+	switch (*P->p) {
+	case '"':
+		++P->p;
+		text = jsonstring(J, P, &n);
+		js_pushlstring(J, text ? text : P->p - n - 1, n);
 		break;
 
 	case '{':
+		++P->p;
 		js_newobject(J);
-		jsonnext(J);
-		if (jsonaccept(J, '}'))
-			return;
+		if (jsonaccept(P, '}'))
+			break;
 		do {
-			if (J->lookahead != TK_STRING)
-				js_syntaxerror(J, "JSON: unexpected token: %s (expected string)", jsY_tokenstring(J->lookahead));
-			js_pushstring(J, J->text);
-			jsonnext(J);
-			jsonexpect(J, ':');
-			jsonvalue(J);
-			js_setproperty(J, -3, js_tostring(J, -2));
+			js_Object *obj = js_toobject(J, -1);
+			js_Property *ref;
+			jsonwhite(P);
+			if (*P->p != '"')
+				jsonunexpected(J, P, "string");
+			++P->p;
+			text = jsonstring(J, P, &n);
+			if (!text) {
+				/* property names are terminated */
+				J->lexbuf.len = 0;
+				memcpy(jsonreserve(J, n + 1), P->p - n - 1, n);
+				J->lexbuf.text[n] = 0;
+				text = J->lexbuf.text;
+			}
+			ref = jsV_setproperty(J, obj, text);
+			jsonexpect(J, P, ':');
+			jsonvalue(J, P);
+			ref->value = *js_tovalue(J, -1);
+			jsG_barrier(J, &ref->value);
 			js_pop(J, 1);
-		} while (jsonaccept(J, ','));
-		jsonexpect(J, '}');
+		} while (jsonaccept(P, ','));
+		jsonexpect(J, P, '}');
 		break;
 
 	case '[':
+		++P->p;
 		js_newarray(J);
-		jsonnext(J);
+		if (jsonaccept(P, ']'))
+			break;
 		i = 0;
-		if (jsonaccept(J, ']'))
-			return;
 		do {
-			jsonvalue(J);
+			jsonvalue(J, P);
 			js_setindex(J, -2, i++);
-		} while (jsonaccept(J, ','));
-		jsonexpect(J, ']');
+		} while (jsonaccept(P, ','));
+		jsonexpect(J, P, ']');
 		break;
 
-	case TK_TRUE:
+	case 't':
+		jsonliteral(J, P, "true");
 		js_pushboolean(J, 1);
-		jsonnext(J);
 		break;
 
-	case TK_FALSE:
+	case 'f':
+		jsonliteral(J, P, "false");
 		js_pushboolean(J, 0);
-		jsonnext(J);
 		break;
 
-	case TK_NULL:
+	case 'n':
+		jsonliteral(J, P, "null");
 		js_pushnull(J);
-		jsonnext(J);
 		break;
 
 	default:
-		js_syntaxerror(J, "JSON: unexpected token: %s", jsY_tokenstring(J->lookahead));
+		if (*P->p == '-' || (*P->p >= '0' && *P->p <= '9'))
+			js_pushnumber(J, jsonnumber(J, P));
+		else
+			jsonunexpected(J, P, "value");
 	}
 }
 
@@ -158,76 +390,166 @@ static void jsonrevive(js_State *J, const char *name)
 
 static void JSON_parse(js_State *J)
 {
-	const char *source = js_tostring(J, 1);
-	jsY_initlex(J, "JSON", source);
-	jsonnext(J);
+	js_JSONParser P;
 
-	if (js_iscallable(J, 2)) {
+	P.source = P.p = js_tostring(J, 1);
+	P.end = P.source + strlen(P.source);
+
+	if (js_iscallable(J, 2))
 		js_newobject(J);
-		jsonvalue(J);
+
+	jsonvalue(J, &P);
+	jsonwhite(&P);
+	if (P.p < P.end)
+		jsonunexpected(J, &P, "end of input");
+
+	if (js_iscallable(J, 2)) {
 		js_defproperty(J, -2, "", 0);
 		jsonrevive(J, "");
-	} else {
-		jsonvalue(J);
 	}
 }
 
-static void fmtnum(js_State *J, js_Buffer **sb, double n)
+/*
+	JSON.stringify writes into its own buffer, which doubles as it fills
+	and becomes the result string as it is, without a final copy.
+
+	Without a replacer, plain objects and flat arrays are walked directly
+	instead of through an iterator and a property lookup per member. The
+	walk collects the members' properties and names up front, like the
+	iterator would, and reads the values straight from the properties for
+	as long as no script code has run. Once a getter or toJSON method has
+	run, anything may have changed, and the rest of the members are looked
+	up by name. For the same reason the shapes and prototypes of objects
+	known to have no toJSON method are only remembered until script code
+	runs.
+*/
+
+#define JS_JSONTOJSONCACHE 8
+
+typedef struct js_JSONWriter js_JSONWriter;
+
+struct js_JSONWriter {
+	char *s;
+	int n, cap;
+	int fast; /* no replacer */
+	unsigned int usercode; /* bumped whenever script code may have run */
+	unsigned int cacheusercode;
+	int ncache;
+	struct { js_Shape *shape; js_Object *prototype; } cache[JS_JSONTOJSONCACHE];
+	js_Property **refs; /* members of the objects being walked */
+	int nrefs, refscap;
+	char *names; /* ... and their names */
+	int nnames, namescap;
+};
+
+static void jsongrow(js_State *J, js_JSONWriter *W, int n)
+{
+	int cap = W->cap ? W->cap : 256;
+	if (W->n + n > JS_STRLIMIT)
+		js_rangeerror(J, "invalid string length");
+	while (cap < W->n + n + 1)
+		cap = cap < JS_STRLIMIT / 2 ? cap * 2 : JS_STRLIMIT + 1;
+	W->s = js_realloc(J, W->s, cap);
+	W->cap = cap;
+}
+
+static void jsonputc(js_State *J, js_JSONWriter *W, int c)
+{
+	if (W->n + 1 >= W->cap)
+		jsongrow(J, W, 1);
+	W->s[W->n++] = c;
+}
+
+static void jsonputm(js_State *J, js_JSONWriter *W, const char *s, int n)
+{
+	if (W->n + n >= W->cap)
+		jsongrow(J, W, n);
+	memcpy(W->s + W->n, s, n);
+	W->n += n;
+}
+
+static void jsonputs(js_State *J, js_JSONWriter *W, const char *s)
+{
+	jsonputm(J, W, s, strlen(s));
+}
+
+static void fmtnum(js_State *J, js_JSONWriter *W, double n)
 {
-	if (isnan(n)) js_puts(J, sb, "null");
-	else if (isinf(n)) js_puts(J, sb, "null");
-	else if (n == 0) js_puts(J, sb, "0");
+	if (isnan(n)) jsonputm(J, W, "null", 4);
+	else if (isinf(n)) jsonputm(J, W, "null", 4);
+	else if (n == 0) jsonputc(J, W, '0');
 	else {
 		char buf[40];
-		js_puts(J, sb, jsV_numbertostring(J, buf, n));
+		jsonputs(J, W, jsV_numbertostring(J, buf, n));
 	}
 }
 
-static void fmtstr(js_State *J, js_Buffer **sb, const char *s)
+/* Bytes that start something fmtstr can't copy as it is: control
+   characters, '"', '\\', the overlong null (C0 80) and surrogates (ED A0-BF). */
+static const unsigned char jsonspecial[256] = {
+	1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
+	0,0,1,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,1,0,0,0,
+	0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+	1,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0, 0,0,0,0,0,1,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+};
+
+static void fmtstr(js_State *J, js_JSONWriter *W, const char *s)
 {
 	static const char *HEX = "0123456789abcdef";
-	int i, n;
+	const char *run;
+	char esc[6];
+	int n;
 	Rune c;
-	js_putc(J, sb, '"');
-	while (*s) {
+	jsonputc(J, W, '"');
+	for (;;) {
+		run = s;
+		while (!jsonspecial[(unsigned char)*s])
+			++s;
+		if (s > run)
+			jsonputm(J, W, run, s - run);
+		if (!*s)
+			break;
 		n = chartorune(&c, s);
 		switch (c) {
-		case '"': js_puts(J, sb, "\\\""); break;
-		case '\\': js_puts(J, sb, "\\\\"); break;
-		case '\b': js_puts(J, sb, "\\b"); break;
-		case '\f': js_puts(J, sb, "\\f"); break;
-		case '\n': js_puts(J, sb, "\\n"); break;
-		case '\r': js_puts(J, sb, "\\r"); break;
-		case '\t': js_puts(J, sb, "\\t"); break;
+		case '"': jsonputm(J, W, "\\\"", 2); break;
+		case '\\': jsonputm(J, W, "\\\\", 2); break;
+		case '\b': jsonputm(J, W, "\\b", 2); break;
+		case '\f': jsonputm(J, W, "\\f", 2); break;
+		case '\n': jsonputm(J, W, "\\n", 2); break;
+		case '\r': jsonputm(J, W, "\\r", 2); break;
+		case '\t': jsonputm(J, W, "\\t", 2); break;
 		default:
 			if (c < ' ' || (c >= 0xd800 && c <= 0xdfff)) {
-				js_putc(J, sb, '\\');
-				js_putc(J, sb, 'u');
-				js_putc(J, sb, HEX[(c>>12)&15]);
-				js_putc(J, sb, HEX[(c>>8)&15]);
-				js_putc(J, sb, HEX[(c>>4)&15]);
-				js_putc(J, sb, HEX[c&15]);
-			} else if (c < 128) {
-				js_putc(J, sb, c);
+				esc[0] = '\\';
+				esc[1] = 'u';
+				esc[2] = HEX[(c>>12)&15];
+				esc[3] = HEX[(c>>8)&15];
+				esc[4] = HEX[(c>>4)&15];
+				esc[5] = HEX[c&15];
+				jsonputm(J, W, esc, 6);
 			} else {
-				for (i = 0; i < n; ++i)
-					js_putc(J, sb, s[i]);
+				jsonputm(J, W, s, n);
 			}
 			break;
 		}
 		s += n;
 	}
-	js_putc(J, sb, '"');
+	jsonputc(J, W, '"');
 }
 
-static void fmtindent(js_State *J, js_Buffer **sb, const char *gap, int level)
+static void fmtindent(js_State *J, js_JSONWriter *W, const char *gap, int level)
 {
-	js_putc(J, sb, '\n');
+	jsonputc(J, W, '\n');
 	while (level--)
-		js_puts(J, sb, gap);
+		jsonputs(J, W, gap);
 }
 
-static int fmtvalue(js_State *J, js_Buffer **sb, const char *key, const char *gap, int level);
+static int fmtvalue(js_State *J, js_JSONWriter *W, const char *key, const char *gap, int level);
+static int fmtpushed(js_State *J, js_JSONWriter *W, const char *key, int index, const char *gap, int level);
 
 static int filterprop(js_State *J, const char *key)
 {
@@ -248,113 +570,223 @@ static int filterprop(js_State *J, const char *key)
 	return 1;
 }
 
-static void fmtobject(js_State *J, js_Buffer **sb, js_Object *obj, const char *gap, int level)
+static void checkcycle(js_State *J)
 {
-	const char *key;
-	int save;
-	int i, n;
-
-	n = js_gettop(J) - 1;
+	int i, n = js_gettop(J) - 1;
 	for (i = 4; i < n; ++i)
 		if (js_isobject(J, i))
 			if (js_toobject(J, i) == js_toobject(J, -1))
 				js_typeerror(J, "cyclic object value");
+}
+
+/* Collect the enumerable own properties in iterator order. */
+static void collectmembers(js_State *J, js_JSONWriter *W, js_Property *prop)
+{
+	int n;
+	if (prop->left->level)
+		collectmembers(J, W, prop->left);
+	if (!(prop->atts & JS_DONTENUM)) {
+		if (W->nrefs == W->refscap) {
+			W->refscap = W->refscap ? W->refscap * 2 : 64;
+			W->refs = js_realloc(J, W->refs, W->refscap * sizeof *W->refs);
+		}
+		W->refs[W->nrefs++] = prop;
+		n = strlen(prop->name) + 1;
+		if (W->nnames + n > W->namescap) {
+			while (W->nnames + n > W->namescap)
+				W->namescap = W->namescap ? W->namescap * 2 : 1024;
+			W->names = js_realloc(J, W->names, W->namescap);
+		}
+		memcpy(W->names + W->nnames, prop->name, n);
+		W->nnames += n;
+	}
+	if (prop->right->level)
+		collectmembers(J, W, prop->right);
+}
+
+static void fmtmembers(js_State *J, js_JSONWriter *W, js_Object *obj, const char *gap, int level)
+{
+	int base = W->nrefs, namebase = W->nnames;
+	unsigned int usercode = W->usercode;
+	int save, i, k, ok, n = 0;
+
+	if (obj->properties->level)
+		collectmembers(J, W, obj->properties);
+
+	for (i = base, k = namebase; i < W->nrefs; ++i, k += strlen(W->names + k) + 1) {
+		js_Property *ref = W->refs[i];
+		save = W->n;
+		if (n) jsonputc(J, W, ',');
+		if (gap) fmtindent(J, W, gap, level + 1);
+		fmtstr(J, W, W->names + k);
+		jsonputc(J, W, ':');
+		if (gap)
+			jsonputc(J, W, ' ');
+		/* the names may move once nested members are collected, which
+		   happens after fmtpushed is done with the key */
+		if (W->usercode == usercode && !ref->getter) {
+			js_pushvalue(J, ref->value);
+			ok = fmtpushed(J, W, W->names + k, 0, gap, level + 1);
+		} else {
+			W->usercode++;
+			ok = fmtvalue(J, W, W->names + k, gap, level + 1);
+		}
+		if (ok)
+			++n;
+		else
+			W->n = save;
+	}
+	W->nrefs = base;
+	W->nnames = namebase;
+	if (gap && n) fmtindent(J, W, gap, level);
+}
+
+static void fmtobject(js_State *J, js_JSONWriter *W, js_Object *obj, const char *gap, int level)
+{
+	const char *key;
+	int save;
+	int n;
+
+	checkcycle(J);
+
+	jsonputc(J, W, '{');
+	if (W->fast && obj->type == JS_COBJECT) {
+		fmtmembers(J, W, obj, gap, level);
+		jsonputc(J, W, '}');
+		return;
+	}
 
 	n = 0;
-	js_putc(J, sb, '{');
 	js_pushiterator(J, -1, 1);
 	while ((key = js_nextiterator(J, -1))) {
 		if (filterprop(J, key)) {
-			save = (*sb)->n;
-			if (n) js_putc(J, sb, ',');
-			if (gap) fmtindent(J, sb, gap, level + 1);
-			fmtstr(J, sb, key);
-			js_putc(J, sb, ':');
+			save = W->n;
+			if (n) jsonputc(J, W, ',');
+			if (gap) fmtindent(J, W, gap, level + 1);
+			fmtstr(J, W, key);
+			jsonputc(J, W, ':');
 			if (gap)
-				js_putc(J, sb, ' ');
+				jsonputc(J, W, ' ');
 			js_rot2(J);
-			if (!fmtvalue(J, sb, key, gap, level + 1))
-				(*sb)->n = save;
+			if (!fmtvalue(J, W, key, gap, level + 1))
+				W->n = save;
 			else
 				++n;
 			js_rot2(J);
 		}
 	}
 	js_pop(J, 1);
-	if (gap && n) fmtindent(J, sb, gap, level);
-	js_putc(J, sb, '}');
+	if (gap && n) fmtindent(J, W, gap, level);
+	jsonputc(J, W, '}');
 }
 
-static void fmtarray(js_State *J, js_Buffer **sb, const char *gap, int level)
+static void fmtarray(js_State *J, js_JSONWriter *W, js_Object *obj, const char *gap, int level)
 {
-	int n, i;
+	int n, i, ok;
 	char buf[32];
 
-	n = js_gettop(J) - 1;
-	for (i = 4; i < n; ++i)
-		if (js_isobject(J, i))
-			if (js_toobject(J, i) == js_toobject(J, -1))
-				js_typeerror(J, "cyclic object value");
+	checkcycle(J);
 
-	js_putc(J, sb, '[');
+	jsonputc(J, W, '[');
 	n = js_getlength(J, -1);
 	for (i = 0; i < n; ++i) {
-		if (i) js_putc(J, sb, ',');
-		if (gap) fmtindent(J, sb, gap, level + 1);
-		if (!fmtvalue(J, sb, js_itoa(buf, i), gap, level + 1))
-			js_puts(J, sb, "null");
+		if (i) jsonputc(J, W, ',');
+		if (gap) fmtindent(J, W, gap, level + 1);
+		if (W->fast && obj->u.a.simple) {
+			if (i < obj->u.a.flat_length)
+				js_pushvalue(J, obj->u.a.array[i]);
+			else
+				js_pushundefined(J);
+			ok = fmtpushed(J, W, NULL, i, gap, level + 1);
+		} else {
+			ok = fmtvalue(J, W, js_itoa(buf, i), gap, level + 1);
+		}
+		if (!ok)
+			jsonputm(J, W, "null", 4);
 	}
-	if (gap && n) fmtindent(J, sb, gap, level);
-	js_putc(J, sb, ']');
+	if (gap && n) fmtindent(J, W, gap, level);
+	jsonputc(J, W, ']');
 }
 
-static int fmtvalue(js_State *J, js_Buffer **sb, const char *key, const char *gap, int level)
+/* Does the object at -1 have no toJSON method, by the shapes seen so far? */
+static int notojson(js_JSONWriter *W, js_Object *obj)
 {
-	/* replacer/property-list is in 2 */
-	/* holder is in -1 */
+	int i;
+	if (W->cacheusercode != W->usercode) {
+		W->cacheusercode = W->usercode;
+		W->ncache = 0;
+	}
+	if (!obj->shape)
+		return 0;
+	for (i = 0; i < W->ncache; ++i)
+		if (W->cache[i].shape == obj->shape && W->cache[i].prototype == obj->prototype)
+			return 1;
+	return 0;
+}
 
-	js_getproperty(J, -1, key);
+static void rememberno(js_JSONWriter *W, js_Object *obj)
+{
+	int i;
+	if (!obj->shape)
+		return;
+	i = W->ncache < JS_JSONTOJSONCACHE ? W->ncache++ : (int)((W->usercode + W->n) % JS_JSONTOJSONCACHE);
+	W->cache[i].shape = obj->shape;
+	W->cache[i].prototype = obj->prototype;
+}
 
-	if (js_isobject(J, -1)) {
+/* Format the value at -1, which belongs to the holder below it, and pop it.
+   Array elements pass a NULL key and their index. */
+static int fmtpushed(js_State *J, js_JSONWriter *W, const char *key, int index, const char *gap, int level)
+{
+	char buf[32];
+
+	/* replacer/property-list is in 2 */
+	/* holder is in -2 */
+
+	if (js_isobject(J, -1) && !notojson(W, js_toobject(J, -1))) {
 		if (js_hasproperty(J, -1, "toJSON")) {
+			++W->usercode;
 			if (js_iscallable(J, -1)) {
 				js_copy(J, -2);
-				js_pushstring(J, key);
+				js_pushstring(J, key ? key : js_itoa(buf, index));
 				js_call(J, 1);
 				js_rot2pop1(J);
 			} else {
 				js_pop(J, 1);
 			}
+		} else {
+			rememberno(W, js_toobject(J, -1));
 		}
 	}
 
 	if (js_iscallable(J, 2)) {
 		js_copy(J, 2); /* replacer function */
 		js_copy(J, -3); /* holder as this */
-		js_pushstring(J, key); /* name */
+		js_pushstring(J, key ? key : js_itoa(buf, index)); /* name */
 		js_copy(J, -4); /* old value */
 		js_call(J, 2);
 		js_rot2pop1(J); /* pop old value, leave new value on stack */
+		++W->usercode;
 	}
 
 	if (js_isobject(J, -1) && !js_iscallable(J, -1)) {
 		js_Object *obj = js_toobject(J, -1);
 		switch (obj->type) {
-		case JS_CNUMBER: fmtnum(J, sb, obj->u.number); break;
-		case JS_CSTRING: fmtstr(J, sb, obj->u.s.string); break;
-		case JS_CBOOLEAN: js_puts(J, sb, obj->u.boolean ? "true" : "false"); break;
-		case JS_CARRAY: fmtarray(J, sb, gap, level); break;
-		default: fmtobject(J, sb, obj, gap, level); break;
+		case JS_CNUMBER: fmtnum(J, W, obj->u.number); break;
+		case JS_CSTRING: fmtstr(J, W, obj->u.s.string); break;
+		case JS_CBOOLEAN: jsonputs(J, W, obj->u.boolean ? "true" : "false"); break;
+		case JS_CARRAY: fmtarray(J, W, obj, gap, level); break;
+		default: fmtobject(J, W, obj, gap, level); break;
 		}
 	}
 	else if (js_isboolean(J, -1))
-		js_puts(J, sb, js_toboolean(J, -1) ? "true" : "false");
+		jsonputs(J, W, js_toboolean(J, -1) ? "true" : "false");
 	else if (js_isnumber(J, -1))
-		fmtnum(J, sb, js_tonumber(J, -1));
+		fmtnum(J, W, js_tonumber(J, -1));
 	else if (js_isstring(J, -1))
-		fmtstr(J, sb, js_tostring(J, -1));
+		fmtstr(J, W, js_tostring(J, -1));
 	else if (js_isnull(J, -1))
-		js_puts(J, sb, "null");
+		jsonputm(J, W, "null", 4);
 	else {
 		js_pop(J, 1);
 		return 0;
@@ -364,9 +796,18 @@ static int fmtvalue(js_State *J, js_Buffer **sb, const char *key, const char *ga
 	return 1;
 }
 
+static int fmtvalue(js_State *J, js_JSONWriter *W, const char *key, const char *gap, int level)
+{
+	/* holder is in -1 */
+	js_getproperty(J, -1, key);
+	return fmtpushed(J, W, key, 0, gap, level);
+}
+
 static void JSON_stringify(js_State *J)
 {
-	js_Buffer *sb = NULL;
+	js_JSONWriter W;
+	js_String *str;
+	js_Value v;
 	char buf[12];
 	/* NOTE: volatile to silence GCC warning about longjmp clobbering a variable */
 	const char * volatile gap;
@@ -391,24 +832,40 @@ static void JSON_stringify(js_State *J)
 		if (n > 0) gap = buf;
 	}
 
+	memset(&W, 0, sizeof W);
+	W.fast = !js_isarray(J, 2) && !js_iscallable(J, 2);
+
 	if (js_try(J)) {
-		js_free(J, sb);
+		js_free(J, W.s);
+		js_free(J, W.refs);
+		js_free(J, W.names);
 		js_throw(J);
 	}
 
 	js_newobject(J); /* wrapper */
 	js_copy(J, 1);
 	js_defproperty(J, -2, "", 0);
-	if (!fmtvalue(J, &sb, "", gap, 0)) {
+	if (!fmtvalue(J, &W, "", gap, 0)) {
 		js_pushundefined(J);
+	} else if (W.n < 16) {
+		js_pushlstring(J, W.s, W.n);
+		js_rot2pop1(J);
 	} else {
-		js_putc(J, &sb, 0);
-		js_pushstring(J, sb ? sb->s : "");
+		/* the buffer becomes the string */
+		W.s = js_realloc(J, W.s, W.n + 1);
+		W.s[W.n] = 0;
+		str = jsV_adoptstring(J, W.s, W.n);
+		W.s = NULL;
+		v.t.type = JS_TMEMSTR;
+		v.u.memstr = str;
+		js_pushvalue(J, v);
 		js_rot2pop1(J);
 	}
 
 	js_endtry(J);
-	js_free(J, sb);
+	js_free(J, W.s);
+	js_free(J, W.refs);
+	js_free(J, W.names);
 }
 
 void jsB_initjson(js_State *J)
@@ -420,3 +877,57 @@ void jsB_initjson(js_State *J)
 	}
 	js_defglobal(J, "JSON", JS_DONTENUM);
 }
+
+#ifdef JSONBENCH
+
+#include <time.h>
+
+/* cc -O2 -DJSONBENCH -o jsonbench one.c -lm */
+
+static double bench(js_State *J, const char *source)
+{
+	struct timespec t0, t1;
+	double ms, best = 0;
+	int i;
+	for (i = 0; i < 5; ++i) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		js_dostring(J, source);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+		if (i == 0 || ms < best)
+			best = ms;
+	}
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	int n = argc > 1 ? atoi(argv[1]) : 40000;
+	js_State *J = js_newstate(NULL, NULL, 0);
+	char setup[1024];
+	double best;
+
+	snprintf(setup, sizeof setup,
+		"var rows = [];"
+		"for (var i = 0; i < %d; ++i)"
+		"  rows.push({ id: i, name: 'item ' + i, price: i * 0.25 + 0.1, tags: ['a', 'bb', 'ccc'],"
+		"    text: 'line one\\nline \"two\" \\u00e9', owner: { id: i %% 97, active: i %% 2 == 0 } });"
+		"var text = JSON.stringify(rows);",
+		n);
+	js_dostring(J, setup);
+	js_getglobal(J, "text");
+	printf("JSON text %.1f MB\n", strlen(js_tostring(J, -1)) / 1048576.0);
+	js_pop(J, 1);
+
+	best = bench(J, "JSON.parse(text);");
+	printf("JSON.parse %.1f ms\n", best);
+	best = bench(J, "JSON.stringify(rows);");
+	printf("JSON.stringify %.1f ms\n", best);
+	best = bench(J, "JSON.stringify(rows, null, 2);");
+	printf("JSON.stringify indented %.1f ms\n", best);
+
+	js_freestate(J);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,204 @@
+#include "jsi.h"
+
+/*
+	Small fixed-size structures (objects, properties, environments, strings
+	and shapes) are carved out of large slabs instead of going through the
+	allocator one at a time. Requests are rounded up to a multiple of
+	JS_POOLGRAIN and freed chunks go on a free list per size class, where the
+	next request of that class picks them up. Chunks are never returned to
+	the slabs; the slabs themselves are released all at once in
+	js_freestate.
+
+	Anything larger than JS_POOLMAX goes straight to js_malloc.
+*/
+
+struct js_Slab
+{
+	js_Slab *next;
+	union { double d; void *p; } align[1];
+};
+
+#define SLABHEAD offsetof(js_Slab, align)
+
+static int sizeclass(int size)
+{
+	return (size + JS_POOLGRAIN - 1) / JS_POOLGRAIN - 1;
+}
+
+static void newslab(js_State *J)
+{
+	js_Slab *slab = js_malloc(J, JS_POOLSLAB);
+	slab->next = J->slabs;
+	J->slabs = slab;
+	J->slabnext = (char*)slab + SLABHEAD;
+	J->slabend = (char*)slab + JS_POOLSLAB;
+	J->poolstats.slabs++;
+	J->poolstats.slab_bytes += JS_POOLSLAB;
+}
+
+void *jsP_alloc(js_State *J, int size)
+{
+	js_PoolChunk *chunk;
+	int c;
+
+	if (size > JS_POOLMAX) {
+		J->poolstats.large++;
+		return js_malloc(J, size);
+	}
+
+	c = sizeclass(size);
+	size = (c + 1) * JS_POOLGRAIN;
+	J->poolstats.allocs++;
+	J->poolstats.used_bytes += size;
+
+	chunk = J->poolfree[c];
+	if (chunk) {
+		J->poolfree[c] = chunk->next;
+		J->poolstats.reused++;
+		return chunk;
+	}
+
+	if (J->slabend - J->slabnext < size)
+		newslab(J);
+	chunk = (js_PoolChunk*)J->slabnext;
+	J->slabnext += size;
+	return chunk;
+}
+
+void jsP_free(js_State *J, void *ptr, int size)
+{
+	js_PoolChunk *chunk = ptr;
+	int c;
+
+	if (size > JS_POOLMAX) {
+		js_free(J, ptr);
+		return;
+	}
+
+	c = sizeclass(size);
+	J->poolstats.frees++;
+	J->poolstats.used_bytes -= (c + 1) * JS_POOLGRAIN;
+	chunk->next = J->poolfree[c];
+	J->poolfree[c] = chunk;
+}
+
+void jsP_freeslabs(js_State *J)
+{
+	js_Slab *slab, *next;
+	for (slab = J->slabs; slab; slab = next) {
+		next = slab->next;
+		js_free(J, slab);
+	}
+	J->slabs = NULL;
+	J->slabnext = J->slabend = NULL;
+	memset(J->poolfree, 0, sizeof J->poolfree);
+}
+
+/* Visit every slab, most recently added first. */
+void jsP_eachslab(js_State *J, void (*fn)(void *ctx, char *slab), void *ctx)
+{
+	js_Slab *slab;
+	for (slab = J->slabs; slab; slab = slab->next)
+		fn(ctx, (char*)slab);
+}
+
+/* Take over a slab copied from another state; it becomes the newest. */
+void jsP_addslab(js_State *J, char *mem)
+{
+	js_Slab *slab = (js_Slab*)mem;
+	slab->next = J->slabs;
+	J->slabs = slab;
+}
+
+void js_getpoolstats(js_State *J, js_PoolStats *stats)
+{
+	*stats = J->poolstats;
+}
+
+#ifdef POOLBENCH
+
+#include <time.h>
+
+/*
+	Allocation speed and fragmentation of the pools under a few kinds of
+	churn. Allocations are counted on the way to malloc, so the output shows
+	how many calls the pools save and how much slab memory sits idle on the
+	free lists after a full collection. Try other slab sizes with
+	-DJS_POOLSLAB=n.
+
+	cc -O2 -DPOOLBENCH -o poolbench one.c -lm
+*/
+
+static unsigned long sysallocs, sysbytes, syspeak;
+
+static void *countalloc(void *actx, void *ptr, int size)
+{
+	/* a header holds the size, kept at double alignment */
+	union { size_t n; double d; } *h = ptr ? (void*)((char*)ptr - sizeof *h) : NULL;
+	if (h)
+		sysbytes -= h->n;
+	if (size == 0) {
+		free(h);
+		return NULL;
+	}
+	if (!h)
+		sysallocs++;
+	h = realloc(h, sizeof *h + size);
+	if (!h)
+		return NULL;
+	h->n = size;
+	sysbytes += size;
+	if (sysbytes > syspeak)
+		syspeak = sysbytes;
+	return h + 1;
+}
+
+static const char *workloads[][2] = {
+	{ "objects", "for (var i = 0; i < 300000; i++) { var o = { a: i, b: [i], c: 'k' + i }; }" },
+	{ "closures", "function mk(n) { return function () { return n; }; } for (var i = 0; i < 200000; i++) mk(i)();" },
+	{ "mixed", "var keep = []; for (var i = 0; i < 200000; i++) {"
+		" var o = {}; for (var k = 0; k < i % 12; k++) o['p' + k] = k;"
+		" if (i % 50 === 0) keep.push(o); }" },
+	{ "strings", "var keep = []; for (var i = 0; i < 200000; i++) {"
+		" var s = 'x' + i + new Array(i % 40).join('yz');"
+		" if (i % 100 === 0) keep.push(s); }" },
+	{ "waves", "var live = []; for (var w = 0; w < 20; w++) {"
+		" for (var i = 0; i < 20000; i++) live.push({ w: w, i: i, s: 'v' + i });"
+		" live = live.filter(function (o, k) { return k % 3 === 0; }); }" },
+};
+
+int main(void)
+{
+	struct timespec t0, t1;
+	js_PoolStats s;
+	double ms, best;
+	int i, run;
+
+	printf("%-9s %8s %9s %8s %6s %8s %8s %6s\n",
+		"", "ms", "pooled", "mallocs", "reuse", "slab KB", "used KB", "idle");
+	for (i = 0; i < nelem(workloads); ++i) {
+		best = 0;
+		for (run = 0; run < 5; ++run) {
+			js_State *J;
+			sysallocs = sysbytes = syspeak = 0;
+			J = js_newstate(countalloc, NULL, 0);
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			js_dostring(J, workloads[i][1]);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+			if (run == 0 || ms < best)
+				best = ms;
+			js_gc(J, 0);
+			js_getpoolstats(J, &s);
+			js_freestate(J);
+		}
+		printf("%-9s %8.1f %9lu %8lu %5.1f%% %8lu %8lu %5.1f%%\n",
+			workloads[i][0], best, s.allocs, sysallocs,
+			s.allocs ? 100.0 * s.reused / s.allocs : 0.0,
+			s.slab_bytes / 1024, s.used_bytes / 1024,
+			s.slab_bytes ? 100.0 * (s.slab_bytes - s.used_bytes) / s.slab_bytes : 0.0);
+	}
+	return 0;
+}
+
+#endif
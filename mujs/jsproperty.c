@@ -26,10 +26,87 @@ static js_Property sentinel = {
 	NULL, NULL, ""
 };
 
+/* Shapes */
+
+static js_Shape *newshape(js_State *J, js_Shape *parent, const char *name)
+{
+	int n = strlen(name) + 1;
+	js_Shape *shape = jsP_alloc(J, offsetof(js_Shape, name) + n);
+	shape->parent = parent;
+	shape->kids = NULL;
+	shape->sibling = NULL;
+	shape->count = parent ? parent->count + 1 : 0;
+	shape->gcmark = jsG_newmark(J);
+	shape->gcnext = J->gcshape;
+	J->gcshape = shape;
+	++J->gccounter;
+	memcpy(shape->name, name, n);
+	if (parent) {
+		shape->sibling = parent->kids;
+		parent->kids = shape;
+	}
+	return shape;
+}
+
+static js_Shape *rootshape(js_State *J, enum js_Class type)
+{
+	if (type == JS_CUSERDATA)
+		return NULL; /* has/put callbacks can intercept any name */
+	if (!J->rootshape[type])
+		J->rootshape[type] = newshape(J, NULL, "");
+	return J->rootshape[type];
+}
+
+static js_Shape *transition(js_State *J, js_Shape *shape, const char *name)
+{
+	js_Shape *kid;
+	for (kid = shape->kids; kid; kid = kid->sibling)
+		if (!strcmp(kid->name, name))
+			return kid;
+	return newshape(J, shape, name);
+}
+
+static void dropshape(js_State *J, js_Object *obj)
+{
+	obj->shape = NULL;
+	if (obj->slots)
+		jsP_free(J, obj->slots, obj->slotcap * sizeof *obj->slots);
+	obj->slots = NULL;
+	obj->slotcap = 0;
+}
+
 static js_Property *newproperty(js_State *J, js_Object *obj, const char *name)
 {
 	int n = strlen(name) + 1;
-	js_Property *node = js_malloc(J, offsetof(js_Property, name) + n);
+	js_Shape *next = NULL;
+	js_Property *node;
+
+	/* do everything that can throw before the object is touched */
+	if (obj->shape) {
+		if (obj->shape->count < JS_SHAPELIMIT) {
+			if (obj->shape->count >= obj->slotcap) {
+				int newcap = obj->slotcap ? obj->slotcap * 2 : 4;
+				js_Property **slots = jsP_alloc(J, newcap * sizeof *slots);
+				if (obj->slots) {
+					memcpy(slots, obj->slots, obj->slotcap * sizeof *slots);
+					jsP_free(J, obj->slots, obj->slotcap * sizeof *obj->slots);
+				}
+				obj->slots = slots;
+				obj->slotcap = newcap;
+			}
+			next = transition(J, obj->shape, name);
+		} else {
+			dropshape(J, obj);
+		}
+	}
+
+	node = jsP_alloc(J, offsetof(js_Property, name) + n);
+	if (next) {
+		obj->slots[obj->shape->count] = node;
+		obj->shape = next;
+		jsG_barriershape(J, next);
+	}
+
 	node->left = node->right = &sentinel;
 	node->level = 1;
 	node->atts = 0;
@@ -99,7 +176,9 @@ static js_Property *insert(js_State *J, js_Object *obj, js_Property *node, const
 
 static void freeproperty(js_State *J, js_Object *obj, js_Property *node)
 {
-	js_free(J, node);
+	if (obj->shape)
+		dropshape(J, obj);
+	jsP_free(J, node, offsetof(js_Property, name) + strlen(node->name) + 1);
 	--obj->count;
 }
 
@@ -164,7 +243,7 @@ static js_Property *deleteproperty(js_State *J, js_Object *obj, js_Property *tre
 
 js_Object *jsV_newobject(js_State *J, enum js_Class type, js_Object *prototype)
 {
-	js_Object *obj = js_malloc(J, sizeof *obj);
+	js_Object *obj = jsP_alloc(J, sizeof *obj);
 	memset(obj, 0, sizeof *obj);
 	obj->gcmark = 0;
 	obj->gcnext = J->gcobj;
@@ -173,8 +252,10 @@ js_Object *jsV_newobject(js_State *J, enum js_Class type, js_Object *prototype)
 
 	obj->type = type;
 	obj->properties = &sentinel;
+	obj->shape = rootshape(J, type);
 	obj->prototype = prototype;
 	obj->extensible = 1;
+	jsG_newobject(J, obj);
 	return obj;
 }
 
@@ -207,6 +288,58 @@ js_Property *jsV_getproperty(js_State *J, js_Object *obj, const char *name)
 	return NULL;
 }
 
+/* Property caches for named property access sites */
+
+js_Property *jsV_probecache(js_Object *obj, js_PropertyCache *cache, int *own)
+{
+	int i, k;
+	if (!obj->shape)
+		return NULL;
+	for (i = 0; i < JS_PCACHEWAYS && cache->entry[i].shape[0]; ++i) {
+		js_Object *o = obj;
+		for (k = 0; o && o->shape == cache->entry[i].shape[k]; ++k) {
+			if (k == cache->entry[i].depth) {
+				*own = k == 0;
+				return o->slots[cache->entry[i].slot];
+			}
+			o = o->prototype;
+		}
+	}
+	return NULL;
+}
+
+js_Property *jsV_fillcache(js_State *J, js_Object *obj, const char *name, js_PropertyCache *cache, int *own)
+{
+	js_Shape *shape[JS_PCACHEDEPTH];
+	js_Object *o = obj;
+	js_Property *ref;
+	int depth = 0;
+	int cacheable = !js_isarrayindex(J, name, &depth);
+
+	for (depth = 0; o; o = o->prototype, ++depth) {
+		if (!o->shape || depth >= JS_PCACHEDEPTH)
+			cacheable = 0;
+		else
+			shape[depth] = o->shape;
+		ref = lookup(o->properties, name);
+		if (ref) {
+			*own = depth == 0;
+			if (cacheable) {
+				int i = cache->next;
+				int slot = 0;
+				while (o->slots[slot] != ref)
+					++slot;
+				memcpy(cache->entry[i].shape, shape, (depth + 1) * sizeof *shape);
+				cache->entry[i].depth = depth;
+				cache->entry[i].slot = slot;
+				cache->next = (i + 1) % JS_PCACHEWAYS;
+			}
+			return ref;
+		}
+	}
+	return NULL;
+}
+
 static js_Property *jsV_getenumproperty(js_State *J, js_Object *obj, const char *name)
 {
 	do {
@@ -294,6 +427,9 @@ js_Object *jsV_newiterator(js_State *J, js_Object *obj, int own)
 	if (obj->type == JS_CARRAY && obj->u.a.simple)
 		io->u.iter.n = obj->u.a.flat_length;
 
+	if (obj->type == JS_CTYPEDARRAY)
+		io->u.iter.n = obj->u.ta.length;
+
 	return io;
 }
 
@@ -20,11 +20,111 @@ static char *escaperegexp(js_State *J, const char *pattern) {
 	return copy;
 }
 
-static void js_newregexpx(js_State *J, const char *pattern, int flags, int is_clone)
+static unsigned int hashregexp(const char *s, int opts)
 {
+	unsigned int h = 2166136261u ^ opts;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static void unlinkregexp(js_State *J, js_Regprog *rp)
+{
+	if (rp->prev)
+		rp->prev->next = rp->next;
+	else
+		J->regcache = rp->next;
+	if (rp->next)
+		rp->next->prev = rp->prev;
+}
+
+static void freeregexp(js_State *J, js_Regprog *rp)
+{
+	js_regfreex(J->alloc, J->actx, rp->prog);
+	js_free(J, rp);
+}
+
+/*
+	Look up the program for a pattern and flags in the cache, or compile it
+	and add it, dropping the least recently used program if the cache is
+	full. The caller gets a reference to the program, which it gives back
+	with js_releaseregexp. Programs still in use when they leave the cache
+	are freed by their last release.
+*/
+js_Regprog *js_compileregexp(js_State *J, const char *pattern, int opts)
+{
+	unsigned int hash = hashregexp(pattern, opts);
 	const char *error;
+	js_Regprog *rp, *last;
+	int n;
+
+	for (rp = J->regcache; rp; rp = rp->next) {
+		if (rp->hash == hash && rp->opts == opts && !strcmp(rp->pattern, pattern)) {
+			if (rp != J->regcache) {
+				unlinkregexp(J, rp);
+				rp->prev = NULL;
+				rp->next = J->regcache;
+				J->regcache->prev = rp;
+				J->regcache = rp;
+			}
+			rp->refs++;
+			return rp;
+		}
+	}
+
+	n = strlen(pattern);
+	rp = js_malloc(J, soffsetof(js_Regprog, pattern) + n + 1);
+	rp->prog = js_regcompx(J->alloc, J->actx, pattern, opts, &error);
+	if (!rp->prog) {
+		js_free(J, rp);
+		js_syntaxerror(J, "regular expression: %s", error);
+	}
+	memcpy(rp->pattern, pattern, n + 1);
+	rp->hash = hash;
+	rp->opts = opts;
+	rp->refs = 1;
+	rp->cached = 1;
+
+	rp->prev = NULL;
+	rp->next = J->regcache;
+	if (J->regcache)
+		J->regcache->prev = rp;
+	J->regcache = rp;
+
+	if (++J->regcount > JS_REGEXPCACHE) {
+		for (last = rp; last->next; last = last->next)
+			;
+		unlinkregexp(J, last);
+		last->cached = 0;
+		--J->regcount;
+		if (last->refs == 0)
+			freeregexp(J, last);
+	}
+
+	return rp;
+}
+
+void js_releaseregexp(js_State *J, js_Regprog *rp)
+{
+	if (rp && --rp->refs == 0 && !rp->cached)
+		freeregexp(J, rp);
+}
+
+void js_freeregexpcache(js_State *J)
+{
+	js_Regprog *rp, *next;
+	for (rp = J->regcache; rp; rp = next) {
+		next = rp->next;
+		freeregexp(J, rp);
+	}
+	J->regcache = NULL;
+	J->regcount = 0;
+}
+
+static void js_newregexpx(js_State *J, const char *pattern, int flags, int is_clone)
+{
 	js_Object *obj;
-	Reprog *prog;
+	js_Regprog *rp;
 	int opts;
 
 	obj = jsV_newobject(J, JS_CREGEXP, J->RegExp_prototype);
@@ -33,11 +133,9 @@ static void js_newregexpx(js_State *J, const char *pattern, int flags, int is_cl
 	if (flags & JS_REGEXP_I) opts |= REG_ICASE;
 	if (flags & JS_REGEXP_M) opts |= REG_NEWLINE;
 
-	prog = js_regcompx(J->alloc, J->actx, pattern, opts, &error);
-	if (!prog)
-		js_syntaxerror(J, "regular expression: %s", error);
-
-	obj->u.r.prog = prog;
+	rp = js_compileregexp(J, pattern, opts);
+	obj->u.r.prog = rp->prog;
+	obj->u.r.regprog = rp;
 	obj->u.r.source = is_clone ? js_strdup(J, pattern) : escaperegexp(J, pattern);
 	obj->u.r.flags = flags;
 	obj->u.r.last = 0;
@@ -119,7 +217,8 @@ static void Rp_test(js_State *J)
 		}
 	}
 
-	result = js_regexec(re->prog, text, &m, opts);
+	/* without lastIndex to update only the outcome is needed */
+	result = js_regexec(re->prog, text, (re->flags & JS_REGEXP_G) ? &m : NULL, opts);
 	if (result < 0)
 		js_error(J, "regexec failed");
 	if (result == 0) {
@@ -0,0 +1,711 @@
+#include "jsi.h"
+
+/*
+	A snapshot is a frozen copy of a state that is not running, from which
+	new states are stamped out without building the builtins again property
+	by property.
+
+	Taking the snapshot copies every block the state owns into an image: the
+	state itself, its stack, its pool slabs, the blocks its functions, objects
+	and strings own outside the pools, and its interned strings. It then walks
+	every structure once and records, for each pointer into another block,
+	where the pointer lives and what it points at, as block and offset pairs.
+
+	Cloning allocates fresh blocks, copies the images into them, and replays
+	the recorded pointers against the new addresses. Pointers that lead
+	outside the state (literal strings, C functions, userdata) are left as
+	they are. Regular expressions are compiled again for each clone.
+
+	A state with finalizers cannot be snapshot, since every clone would
+	finalize the same data.
+*/
+
+enum { SNAP_STATE, SNAP_STACK, SNAP_SLAB, SNAP_BLOCK, SNAP_INTERN };
+
+typedef struct {
+	const char *addr; /* in the source, while the snapshot is being taken */
+	int size;
+	int kind;
+	char *image;
+} js_SnapRegion;
+
+typedef struct {
+	int region, offset; /* where the pointer lives */
+	int target, toffset; /* what it points at */
+} js_SnapMove;
+
+typedef struct {
+	int region, offset; /* the RegExp object */
+	int opts;
+	char *pattern;
+} js_SnapRegexp;
+
+struct js_Snapshot
+{
+	js_Alloc alloc;
+	void *actx;
+
+	js_SnapRegion *region;
+	int nregion, regioncap;
+
+	int *slab; /* slab regions, newest first */
+	int nslab, slabcap;
+
+	js_SnapMove *move;
+	int nmove, movecap;
+
+	js_SnapRegexp *regexp;
+	int nregexp, regexpcap;
+
+	int *sorted; /* regions by source address, while the snapshot is being taken */
+};
+
+#define GROW(J, a, n, cap) \
+	if (n >= cap) { \
+		cap = cap ? cap * 2 : 64; \
+		a = js_realloc(J, a, cap * sizeof *a); \
+	}
+
+/* Taking the snapshot */
+
+static int addregion(js_State *J, js_Snapshot *snap, const void *addr, int size, int kind)
+{
+	GROW(J, snap->region, snap->nregion, snap->regioncap);
+	snap->region[snap->nregion].addr = addr;
+	snap->region[snap->nregion].size = size;
+	snap->region[snap->nregion].kind = kind;
+	snap->region[snap->nregion].image = NULL;
+	return snap->nregion++;
+}
+
+static void addblock(js_State *J, js_Snapshot *snap, const void *addr, int size)
+{
+	if (addr && size > 0)
+		addregion(J, snap, addr, size, SNAP_BLOCK);
+}
+
+/* Chunks too big for the pools were allocated on their own. */
+static void addchunk(js_State *J, js_Snapshot *snap, const void *addr, int size)
+{
+	if (size > JS_POOLMAX)
+		addblock(J, snap, addr, size);
+}
+
+typedef struct { js_State *J; js_Snapshot *snap; } js_SnapCtx;
+
+static void addslab(void *ctx, char *slab)
+{
+	js_SnapCtx *c = ctx;
+	int r = addregion(c->J, c->snap, slab, JS_POOLSLAB, SNAP_SLAB);
+	GROW(c->J, c->snap->slab, c->snap->nslab, c->snap->slabcap);
+	c->snap->slab[c->snap->nslab++] = r;
+}
+
+static void addintern(void *ctx, const char *s)
+{
+	js_SnapCtx *c = ctx;
+	addregion(c->J, c->snap, s, strlen(s) + 1, SNAP_INTERN);
+}
+
+static void addproperties(js_State *J, js_Snapshot *snap, js_Property *node)
+{
+	if (!node->level)
+		return;
+	addchunk(J, snap, node, offsetof(js_Property, name) + strlen(node->name) + 1);
+	addproperties(J, snap, node->left);
+	addproperties(J, snap, node->right);
+}
+
+static void addregions(js_State *J, js_Snapshot *snap)
+{
+	js_SnapCtx c;
+	js_Shape *shape;
+	js_Environment *env;
+	js_Function *fun;
+	js_String *str;
+	js_Object *obj;
+	js_Iterator *node;
+
+	c.J = J;
+	c.snap = snap;
+
+	addregion(J, snap, J, sizeof *J, SNAP_STATE);
+	addregion(J, snap, J->stack, J->top * sizeof *J->stack, SNAP_STACK);
+	jsP_eachslab(J, addslab, &c);
+	jsS_eachstring(J, addintern, &c);
+
+	for (shape = J->gcshape; shape; shape = shape->gcnext)
+		addchunk(J, snap, shape, offsetof(js_Shape, name) + strlen(shape->name) + 1);
+
+	for (env = J->gcenv; env; env = env->gcnext)
+		addchunk(J, snap, env, sizeof *env);
+
+	for (fun = J->gcfun; fun; fun = fun->gcnext) {
+		addblock(J, snap, fun, sizeof *fun);
+		addblock(J, snap, fun->funtab, fun->funcap * sizeof *fun->funtab);
+		addblock(J, snap, fun->vartab, fun->varcap * sizeof *fun->vartab);
+		addblock(J, snap, fun->code, fun->codecap * sizeof *fun->code);
+		addblock(J, snap, fun->linetab, fun->linecap * sizeof *fun->linetab);
+		addblock(J, snap, fun->pcache, fun->pcachecap * sizeof *fun->pcache);
+	}
+
+	for (str = J->gcstr; str; str = str->gcnext) {
+		if (str->isrope) {
+			addchunk(J, snap, str, sizeof *str);
+			addblock(J, snap, str->p, str->p ? str->length + 1 : 0);
+		} else
+			addchunk(J, snap, str, offsetof(js_String, u.data) + str->length + 1);
+	}
+
+	for (obj = J->gcobj; obj; obj = obj->gcnext) {
+		addchunk(J, snap, obj, sizeof *obj);
+		addproperties(J, snap, obj->properties);
+		if (obj->slots)
+			addchunk(J, snap, obj->slots, obj->slotcap * sizeof *obj->slots);
+		switch (obj->type) {
+		case JS_CARRAY:
+			if (obj->u.a.simple)
+				addblock(J, snap, obj->u.a.array, obj->u.a.flat_capacity * sizeof *obj->u.a.array);
+			break;
+		case JS_CREGEXP:
+			addblock(J, snap, obj->u.r.source, strlen(obj->u.r.source) + 1);
+			break;
+		case JS_CARRAYBUFFER:
+			addblock(J, snap, obj->u.ab.data, obj->u.ab.length);
+			break;
+		case JS_CITERATOR:
+			for (node = obj->u.iter.head; node; node = node->next)
+				addblock(J, snap, node, offsetof(js_Iterator, name) + strlen(node->name) + 1);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static js_Snapshot *sortsnap; /* for the qsort comparison */
+
+static int cmpregion(const void *a, const void *b)
+{
+	const char *x = sortsnap->region[*(const int *)a].addr;
+	const char *y = sortsnap->region[*(const int *)b].addr;
+	return x < y ? -1 : x > y;
+}
+
+/* The region holding a source address, or -1 for memory the state does not own. */
+static int findregion(js_Snapshot *snap, const void *ptr)
+{
+	const char *p = ptr;
+	int lo = 0, hi = snap->nregion - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) >> 1;
+		js_SnapRegion *r = &snap->region[snap->sorted[mid]];
+		if (p < r->addr)
+			hi = mid - 1;
+		else if (p >= r->addr + r->size)
+			lo = mid + 1;
+		else
+			return snap->sorted[mid];
+	}
+	return -1;
+}
+
+/* The copy of a source address in its image, for patching. */
+static void *image(js_Snapshot *snap, const void *ptr)
+{
+	js_SnapRegion *r = &snap->region[findregion(snap, ptr)];
+	return r->image + ((const char *)ptr - r->addr);
+}
+
+static void addmove(js_State *J, js_Snapshot *snap, int region, int offset, int target, int toffset)
+{
+	GROW(J, snap->move, snap->nmove, snap->movecap);
+	snap->move[snap->nmove].region = region;
+	snap->move[snap->nmove].offset = offset;
+	snap->move[snap->nmove].target = target;
+	snap->move[snap->nmove].toffset = toffset;
+	snap->nmove++;
+}
+
+/* Record the pointer stored at loc, unless it leads outside the state. */
+static void record(js_State *J, js_Snapshot *snap, const void *loc, const void *target)
+{
+	int lr, tr;
+	if (!target)
+		return;
+	tr = findregion(snap, target);
+	if (tr < 0)
+		return;
+	lr = findregion(snap, loc);
+	addmove(J, snap, lr, (const char *)loc - snap->region[lr].addr,
+		tr, (const char *)target - snap->region[tr].addr);
+}
+
+static void recordvalue(js_State *J, js_Snapshot *snap, js_Value *v)
+{
+	switch (v->t.type) {
+	case JS_TLITSTR: record(J, snap, &v->u.litstr, v->u.litstr); break;
+	case JS_TMEMSTR: record(J, snap, &v->u.memstr, v->u.memstr); break;
+	case JS_TOBJECT: record(J, snap, &v->u.object, v->u.object); break;
+	}
+}
+
+static void recordproperties(js_State *J, js_Snapshot *snap, js_Property *node)
+{
+	if (!node->level)
+		return; /* the sentinel is static */
+	record(J, snap, &node->left, node->left);
+	record(J, snap, &node->right, node->right);
+	record(J, snap, &node->getter, node->getter);
+	record(J, snap, &node->setter, node->setter);
+	recordvalue(J, snap, &node->value);
+	recordproperties(J, snap, node->left);
+	recordproperties(J, snap, node->right);
+}
+
+static void recordfunction(js_State *J, js_Snapshot *snap, js_Function *fun)
+{
+	js_Instruction *pc, *end;
+	const char *str;
+	int i, shape;
+
+	record(J, snap, &fun->gcnext, fun->gcnext);
+	record(J, snap, &fun->name, fun->name);
+	record(J, snap, &fun->filename, fun->filename);
+	record(J, snap, &fun->funtab, fun->funtab);
+	record(J, snap, &fun->vartab, fun->vartab);
+	record(J, snap, &fun->code, fun->code);
+	record(J, snap, &fun->linetab, fun->linetab);
+	record(J, snap, &fun->pcache, fun->pcache);
+
+	for (i = 0; i < fun->funlen; ++i)
+		record(J, snap, &fun->funtab[i], fun->funtab[i]);
+	for (i = 0; i < fun->varlen; ++i)
+		record(J, snap, &fun->vartab[i], fun->vartab[i]);
+
+	/* the caches hold shapes of the source; clones start them cold */
+	if (fun->pcachecap > 0)
+		memset(image(snap, fun->pcache), 0, fun->pcachecap * sizeof *fun->pcache);
+
+	pc = fun->code;
+	end = fun->code + fun->codelen;
+	while (pc < end) {
+		shape = jsC_operands(*pc++);
+		switch (shape) {
+		case JS_OPINT:
+			pc += 1;
+			break;
+		case JS_OPINTINT:
+			pc += 2;
+			break;
+		case JS_OPNUMBER:
+			pc += sizeof(double) / sizeof(js_Instruction);
+			break;
+		case JS_OPSTRING:
+		case JS_OPSTRINGINT:
+		case JS_OPSTRINGINTINT:
+			memcpy(&str, pc, sizeof str);
+			record(J, snap, pc, str);
+			pc += sizeof str / sizeof(js_Instruction) + (shape == JS_OPSTRINGINT) + 2 * (shape == JS_OPSTRINGINTINT);
+			break;
+		}
+	}
+}
+
+static void recordobject(js_State *J, js_Snapshot *snap, js_Object *obj)
+{
+	js_Object *copy = image(snap, obj);
+	js_Iterator *node;
+	int i;
+
+	record(J, snap, &obj->gcnext, obj->gcnext);
+	record(J, snap, &obj->properties, obj->properties);
+	record(J, snap, &obj->shape, obj->shape);
+	record(J, snap, &obj->prototype, obj->prototype);
+	record(J, snap, &obj->slots, obj->slots);
+	copy->gcroot = NULL;
+
+	if (obj->slots)
+		for (i = 0; i < obj->shape->count; ++i)
+			record(J, snap, &obj->slots[i], obj->slots[i]);
+
+	switch (obj->type) {
+	case JS_CARRAY:
+		if (obj->u.a.simple) {
+			record(J, snap, &obj->u.a.array, obj->u.a.array);
+			for (i = 0; i < obj->u.a.flat_length; ++i)
+				recordvalue(J, snap, &obj->u.a.array[i]);
+		}
+		break;
+
+	case JS_CFUNCTION:
+	case JS_CSCRIPT:
+		record(J, snap, &obj->u.f.function, obj->u.f.function);
+		record(J, snap, &obj->u.f.scope, obj->u.f.scope);
+		break;
+
+	case JS_CCFUNCTION:
+		record(J, snap, &obj->u.c.name, obj->u.c.name);
+		break;
+
+	case JS_CSTRING:
+		record(J, snap, &obj->u.s.string, obj->u.s.string);
+		recordvalue(J, snap, &obj->u.s.value);
+		break;
+
+	case JS_CREGEXP:
+		record(J, snap, &obj->u.r.source, obj->u.r.source);
+		copy->u.r.prog = NULL;
+		copy->u.r.regprog = NULL;
+		if (obj->u.r.regprog) {
+			int r = findregion(snap, obj);
+			GROW(J, snap->regexp, snap->nregexp, snap->regexpcap);
+			snap->regexp[snap->nregexp].region = r;
+			snap->regexp[snap->nregexp].offset = (const char *)obj - snap->region[r].addr;
+			snap->regexp[snap->nregexp].opts = obj->u.r.regprog->opts;
+			snap->regexp[snap->nregexp].pattern = js_strdup(J, obj->u.r.regprog->pattern);
+			snap->nregexp++;
+		}
+		break;
+
+	case JS_CARRAYBUFFER:
+		record(J, snap, &obj->u.ab.data, obj->u.ab.data);
+		break;
+
+	case JS_CTYPEDARRAY:
+		record(J, snap, &obj->u.ta.buffer, obj->u.ta.buffer);
+		/* the data may start at the very end of the buffer */
+		if (obj->u.ta.data) {
+			int r = findregion(snap, &obj->u.ta.data);
+			addmove(J, snap, r, (const char *)&obj->u.ta.data - snap->region[r].addr,
+				findregion(snap, obj->u.ta.buffer->u.ab.data), obj->u.ta.offset);
+		}
+		break;
+
+	case JS_CITERATOR:
+		record(J, snap, &obj->u.iter.target, obj->u.iter.target);
+		record(J, snap, &obj->u.iter.head, obj->u.iter.head);
+		record(J, snap, &obj->u.iter.current, obj->u.iter.current);
+		for (node = obj->u.iter.head; node; node = node->next)
+			record(J, snap, &node->next, node->next);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void recordall(js_State *J, js_Snapshot *snap)
+{
+	js_State *copy = (js_State*)snap->region[SNAP_STATE].image;
+	js_Shape *shape;
+	js_Environment *env;
+	js_Function *fun;
+	js_String *str;
+	js_Object *obj;
+	js_PoolChunk *chunk;
+	int i, head;
+
+	for (shape = J->gcshape; shape; shape = shape->gcnext) {
+		record(J, snap, &shape->gcnext, shape->gcnext);
+		record(J, snap, &shape->parent, shape->parent);
+		record(J, snap, &shape->kids, shape->kids);
+		record(J, snap, &shape->sibling, shape->sibling);
+	}
+
+	for (env = J->gcenv; env; env = env->gcnext) {
+		record(J, snap, &env->gcnext, env->gcnext);
+		record(J, snap, &env->outer, env->outer);
+		record(J, snap, &env->variables, env->variables);
+	}
+
+	for (str = J->gcstr; str; str = str->gcnext) {
+		js_String *twin = image(snap, str);
+		record(J, snap, &str->gcnext, str->gcnext);
+		record(J, snap, &str->p, str->p);
+		if (str->isrope && !str->p) {
+			record(J, snap, &str->u.rope.left, str->u.rope.left);
+			record(J, snap, &str->u.rope.right, str->u.rope.right);
+		}
+		twin->utf.length = -1;
+		twin->utf.index = NULL;
+	}
+
+	for (fun = J->gcfun; fun; fun = fun->gcnext)
+		recordfunction(J, snap, fun);
+
+	for (obj = J->gcobj; obj; obj = obj->gcnext) {
+		recordproperties(J, snap, obj->properties);
+		recordobject(J, snap, obj);
+	}
+
+	for (i = 0; i < JS_POOLMAX / JS_POOLGRAIN; ++i)
+		for (chunk = J->poolfree[i]; chunk; chunk = chunk->next)
+			record(J, snap, &chunk->next, chunk->next);
+
+	for (i = 0; i < J->top; ++i)
+		recordvalue(J, snap, &J->stack[i]);
+
+	/* The state. The lists the collector walks are only set once the
+	 * pointers are replayed, so a clone that fails early frees just its
+	 * blocks. */
+	record(J, snap, &J->Object_prototype, J->Object_prototype);
+	record(J, snap, &J->Array_prototype, J->Array_prototype);
+	record(J, snap, &J->Function_prototype, J->Function_prototype);
+	record(J, snap, &J->Boolean_prototype, J->Boolean_prototype);
+	record(J, snap, &J->Number_prototype, J->Number_prototype);
+	record(J, snap, &J->String_prototype, J->String_prototype);
+	record(J, snap, &J->RegExp_prototype, J->RegExp_prototype);
+	record(J, snap, &J->Date_prototype, J->Date_prototype);
+	record(J, snap, &J->ArrayBuffer_prototype, J->ArrayBuffer_prototype);
+	record(J, snap, &J->TypedArray_prototype, J->TypedArray_prototype);
+	for (i = 0; i < JS_ECOUNT; ++i)
+		record(J, snap, &J->element_prototype[i], J->element_prototype[i]);
+	record(J, snap, &J->Error_prototype, J->Error_prototype);
+	record(J, snap, &J->EvalError_prototype, J->EvalError_prototype);
+	record(J, snap, &J->RangeError_prototype, J->RangeError_prototype);
+	record(J, snap, &J->ReferenceError_prototype, J->ReferenceError_prototype);
+	record(J, snap, &J->SyntaxError_prototype, J->SyntaxError_prototype);
+	record(J, snap, &J->TypeError_prototype, J->TypeError_prototype);
+	record(J, snap, &J->URIError_prototype, J->URIError_prototype);
+	record(J, snap, &J->R, J->R);
+	record(J, snap, &J->G, J->G);
+	record(J, snap, &J->E, J->E);
+	record(J, snap, &J->GE, J->GE);
+	for (i = 0; i < JS_CUSERDATA; ++i)
+		record(J, snap, &J->rootshape[i], J->rootshape[i]);
+	for (i = 0; i < JS_POOLMAX / JS_POOLGRAIN; ++i) {
+		record(J, snap, &J->poolfree[i], J->poolfree[i]);
+		copy->poolfree[i] = NULL;
+	}
+	record(J, snap, &J->gcshape, J->gcshape);
+	record(J, snap, &J->gcenv, J->gcenv);
+	record(J, snap, &J->gcfun, J->gcfun);
+	record(J, snap, &J->gcstr, J->gcstr);
+	record(J, snap, &J->gcobj, J->gcobj);
+
+	/* the bump pointer may sit at the very end of the newest slab */
+	if (snap->nslab > 0) {
+		head = snap->slab[0];
+		addmove(J, snap, SNAP_STATE, offsetof(js_State, slabnext), head, J->slabnext - snap->region[head].addr);
+		addmove(J, snap, SNAP_STATE, offsetof(js_State, slabend), head, JS_POOLSLAB);
+	}
+
+	copy->gcshape = NULL;
+	copy->gcenv = NULL;
+	copy->gcfun = NULL;
+	copy->gcstr = NULL;
+	copy->gcobj = NULL;
+	copy->slabs = NULL;
+	copy->slabnext = copy->slabend = NULL;
+	copy->strings = NULL;
+	copy->strptrs = NULL;
+	copy->strcap = copy->strcount = 0;
+	copy->stack = NULL;
+	copy->regcache = NULL;
+	copy->regcount = 0;
+	copy->codecache = NULL;
+	memset(&copy->codestats, 0, sizeof copy->codestats);
+	memset(&copy->lexbuf, 0, sizeof copy->lexbuf);
+	copy->gcast = NULL;
+	copy->gcroot = NULL;
+	copy->interrupt = NULL;
+	copy->interruptdata = NULL;
+	copy->filename = copy->source = copy->text = NULL;
+}
+
+void js_freesnapshot(js_Snapshot *snap)
+{
+	int i;
+	if (!snap)
+		return;
+	for (i = 0; i < snap->nregion; ++i)
+		snap->alloc(snap->actx, snap->region[i].image, 0);
+	for (i = 0; i < snap->nregexp; ++i)
+		snap->alloc(snap->actx, snap->regexp[i].pattern, 0);
+	snap->alloc(snap->actx, snap->region, 0);
+	snap->alloc(snap->actx, snap->slab, 0);
+	snap->alloc(snap->actx, snap->move, 0);
+	snap->alloc(snap->actx, snap->regexp, 0);
+	snap->alloc(snap->actx, snap->sorted, 0);
+	snap->alloc(snap->actx, snap, 0);
+}
+
+js_Snapshot *js_newsnapshot(js_State *J)
+{
+	js_Snapshot *snap;
+	js_Object *obj;
+	int i;
+
+	/* only a state at rest can be copied */
+	if (J->envtop > 0 || J->trytop > 0)
+		return NULL;
+	for (obj = J->gcobj; obj; obj = obj->gcnext) {
+		if (obj->type == JS_CUSERDATA && obj->u.user.finalize)
+			return NULL;
+		if (obj->type == JS_CCFUNCTION && obj->u.c.finalize)
+			return NULL;
+	}
+
+	if (J->gcstate != JS_GCIDLE)
+		js_gc(J, 0);
+
+	snap = J->alloc(J->actx, NULL, sizeof *snap);
+	if (!snap)
+		return NULL;
+	memset(snap, 0, sizeof *snap);
+	snap->alloc = J->alloc;
+	snap->actx = J->actx;
+
+	if (js_try(J)) {
+		js_pop(J, 1);
+		js_freesnapshot(snap);
+		return NULL;
+	}
+
+	addregions(J, snap);
+
+	for (i = 0; i < snap->nregion; ++i) {
+		js_SnapRegion *r = &snap->region[i];
+		r->image = js_malloc(J, r->size > 0 ? r->size : 1);
+		memcpy(r->image, r->addr, r->size);
+	}
+
+	snap->sorted = js_malloc(J, snap->nregion * sizeof *snap->sorted);
+	for (i = 0; i < snap->nregion; ++i)
+		snap->sorted[i] = i;
+	sortsnap = snap;
+	qsort(snap->sorted, snap->nregion, sizeof *snap->sorted, cmpregion);
+
+	recordall(J, snap);
+
+	js_endtry(J);
+	js_free(J, snap->sorted);
+	snap->sorted = NULL;
+	for (i = 0; i < snap->nregion; ++i)
+		snap->region[i].addr = NULL;
+	return snap;
+}
+
+/* Cloning */
+
+js_State *js_clonesnapshot(js_Snapshot *snap)
+{
+	js_State *J;
+	char **base = NULL;
+	int i, linked = 0;
+
+	J = snap->alloc(snap->actx, NULL, sizeof *J);
+	if (!J)
+		return NULL;
+	memcpy(J, snap->region[SNAP_STATE].image, sizeof *J);
+
+	J->stack = J->alloc(J->actx, NULL, JS_STACKSIZE * sizeof *J->stack);
+	if (!J->stack) {
+		J->alloc(J->actx, J, 0);
+		return NULL;
+	}
+	memcpy(J->stack, snap->region[SNAP_STACK].image, snap->region[SNAP_STACK].size);
+
+	if (js_try(J)) {
+		/* until the pointers are replayed, nothing else knows the blocks */
+		if (base && !linked)
+			for (i = 0; i < snap->nregion; ++i)
+				if (snap->region[i].kind == SNAP_BLOCK)
+					js_free(J, base[i]);
+		js_free(J, base);
+		js_freestate(J);
+		return NULL;
+	}
+
+	base = js_malloc(J, snap->nregion * sizeof *base);
+	memset(base, 0, snap->nregion * sizeof *base);
+	base[SNAP_STATE] = (char*)J;
+	base[SNAP_STACK] = (char*)J->stack;
+
+	/* oldest slab first, so the newest ends up at the head of the list */
+	for (i = snap->nslab - 1; i >= 0; --i) {
+		js_SnapRegion *r = &snap->region[snap->slab[i]];
+		char *slab = js_malloc(J, JS_POOLSLAB);
+		memcpy(slab, r->image, JS_POOLSLAB);
+		jsP_addslab(J, slab);
+		base[snap->slab[i]] = slab;
+	}
+
+	for (i = 0; i < snap->nregion; ++i) {
+		js_SnapRegion *r = &snap->region[i];
+		if (r->kind == SNAP_BLOCK) {
+			base[i] = js_malloc(J, r->size);
+			memcpy(base[i], r->image, r->size);
+		} else if (r->kind == SNAP_INTERN) {
+			base[i] = (char*)js_intern(J, r->image);
+		}
+	}
+
+	for (i = 0; i < snap->nmove; ++i) {
+		js_SnapMove *m = &snap->move[i];
+		char *p = base[m->target] + m->toffset;
+		memcpy(base[m->region] + m->offset, &p, sizeof p);
+	}
+	linked = 1;
+
+	for (i = 0; i < snap->nregexp; ++i) {
+		js_SnapRegexp *x = &snap->regexp[i];
+		js_Object *obj = (js_Object*)(base[x->region] + x->offset);
+		js_Regprog *rp = js_compileregexp(J, x->pattern, x->opts);
+		obj->u.r.regprog = rp;
+		obj->u.r.prog = rp->prog;
+	}
+
+	js_endtry(J);
+	js_free(J, base);
+	return J;
+}
+
+#ifdef BENCH
+
+#include <time.h>
+
+/* cc -O2 -DBENCH -o snapbench one.c -lm */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+	const char *script = "var x = [1,2,3].map(function (v) { return v * 2; }).join(',');";
+	int i, n = argc > 1 ? atoi(argv[1]) : 2000;
+	js_Snapshot *snap;
+	js_State *J;
+	double t0, t1, t2, t3;
+
+	t0 = now();
+	for (i = 0; i < n; ++i) {
+		J = js_newstate(NULL, NULL, 0);
+		js_dostring(J, script);
+		js_freestate(J);
+	}
+	t1 = now();
+	J = js_newstate(NULL, NULL, 0);
+	snap = js_newsnapshot(J);
+	js_freestate(J);
+	t2 = now();
+	for (i = 0; i < n; ++i) {
+		J = js_clonesnapshot(snap);
+		js_dostring(J, script);
+		js_freestate(J);
+	}
+	t3 = now();
+	js_freesnapshot(snap);
+
+	printf("js_newstate       %8.1f us per page\n", (t1 - t0) / n);
+	printf("js_newsnapshot    %8.1f us once\n", t2 - t1);
+	printf("js_clonesnapshot  %8.1f us per page\n", (t3 - t2) / n);
+	return 0;
+}
+
+#endif
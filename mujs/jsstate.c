@@ -124,18 +124,31 @@ static void js_loadstringx(js_State *J, const char *filename, const char *source
 {
 	js_Ast *P;
 	js_Function *F;
+	double start;
+
+	if (!iseval && J->codecache) {
+		F = jsC_loadcache(J, filename, source, J->default_strict);
+		if (F) {
+			js_newscript(J, F, J->GE);
+			return;
+		}
+	}
 
 	if (js_try(J)) {
 		jsP_freeparse(J);
 		js_throw(J);
 	}
 
+	start = jsG_now();
 	P = jsP_parse(J, filename, source);
 	F = jsC_compilescript(J, P, iseval ? J->strict : J->default_strict);
 	jsP_freeparse(J);
 	js_newscript(J, F, iseval ? (J->strict ? J->E : NULL) : J->GE);
 
 	js_endtry(J);
+
+	if (!iseval && J->codecache)
+		jsC_storecache(J, F, filename, source, J->default_strict, jsG_now() - start);
 }
 
 void js_loadeval(js_State *J, const char *filename, const char *source)
@@ -76,7 +76,7 @@ int js_utfptrtoidx(const char *s, const char *p)
 	int i = 0;
 	while (s < p) {
 		if (*(unsigned char *)s < Runeself)
-			++s;
+			rune = *(unsigned char *)s++;
 		else
 			s += chartorune(&rune, s);
 		if (rune >= 0x10000)
@@ -87,6 +87,200 @@ int js_utfptrtoidx(const char *s, const char *p)
 	return i;
 }
 
+/*
+	Memory and interned strings count their UTF-16 length the first time it
+	is needed and remember whether they are all ASCII, in which case UTF-16
+	and byte offsets are the same. Long non-ASCII strings also get a sparse
+	index holding, for every JS_UTFSTEP'th code unit, the byte offset and
+	starting unit of the character that contains it, so a lookup walks at
+	most one step of text.
+*/
+
+static void jsS_counttext(js_UtfInfo *info, const char *p, int n)
+{
+	const unsigned char *s = (const unsigned char *)p;
+	int i;
+	for (i = 0; i < n; ++i)
+		if (s[i] >= Runeself)
+			break;
+	info->ascii = (i == n);
+	info->length = info->ascii ? n : js_utflen(p);
+}
+
+static void jsS_countutf(js_State *J, js_String *str)
+{
+	if (str->utf.length >= 0)
+		return;
+
+	if (!str->p) {
+		js_String *left = str->u.rope.left, *right = str->u.rope.right;
+		jsS_countutf(J, left);
+		jsS_countutf(J, right);
+		str->utf.length = left->utf.length + right->utf.length;
+		str->utf.ascii = left->utf.ascii && right->utf.ascii;
+		return;
+	}
+
+	jsS_counttext(&str->utf, str->p, str->length);
+}
+
+/* Find the character holding UTF-16 unit i, starting from unit u at s. */
+static const char *jsS_utfwalk(const char *s, int u, int i, int *start)
+{
+	Rune rune;
+	while (*s) {
+		int n = chartorune(&rune, s);
+		int w = rune >= 0x10000 ? 2 : 1;
+		if (u + w > i)
+			break;
+		s += n;
+		u += w;
+	}
+	*start = u;
+	return s;
+}
+
+static void jsS_buildindex(js_State *J, js_UtfInfo *info, const char *s)
+{
+	int n = info->length / JS_UTFSTEP + 1;
+	int *index = js_malloc(J, 2 * n * sizeof *index);
+	const char *p = s;
+	int u = 0, k = 0;
+	Rune rune;
+
+	for (;;) {
+		int len = 0, w = 1;
+		if (*p) {
+			len = chartorune(&rune, p);
+			w = rune >= 0x10000 ? 2 : 1;
+		}
+		while (k < n && k * JS_UTFSTEP < u + w) {
+			index[2*k] = p - s;
+			index[2*k+1] = u;
+			++k;
+		}
+		if (k == n || !*p)
+			break;
+		p += len;
+		u += w;
+	}
+
+	info->index = index;
+}
+
+/* The text of a string value, and its counted UTF-16 cache if it has one. */
+static const char *jsS_text(js_State *J, js_Value *v, js_UtfInfo **info)
+{
+	if (v->t.type == JS_TMEMSTR) {
+		js_String *str = v->u.memstr;
+		const char *s = JSV_STRTEXT(J, str);
+		jsS_countutf(J, str);
+		*info = &str->utf;
+		return s;
+	}
+	if (v->t.type == JS_TLITSTR) {
+		*info = jsS_utfinfo(J, v->u.litstr);
+		if (*info && (*info)->length < 0)
+			jsS_counttext(*info, v->u.litstr, jsS_length(v->u.litstr));
+		return v->u.litstr;
+	}
+	*info = NULL;
+	return jsV_tostring(J, v);
+}
+
+static const char *jsS_seek(js_State *J, js_UtfInfo *info, const char *s, int i, int *start)
+{
+	int k;
+	if (info->ascii) {
+		*start = i;
+		return s + i;
+	}
+	if (info->length <= JS_UTFSTEP)
+		return jsS_utfwalk(s, 0, i, start);
+	if (!info->index)
+		jsS_buildindex(J, info, s);
+	k = i / JS_UTFSTEP;
+	return jsS_utfwalk(s + info->index[2*k], info->index[2*k+1], i, start);
+}
+
+int jsV_strlength(js_State *J, js_Value *v)
+{
+	js_UtfInfo *info;
+	const char *s;
+	if (v->t.type == JS_TMEMSTR) {
+		/* ropes are counted without flattening them */
+		jsS_countutf(J, v->u.memstr);
+		return v->u.memstr->utf.length;
+	}
+	s = jsS_text(J, v, &info);
+	return info ? info->length : js_utflen(s);
+}
+
+/* Return the pointer to the character holding UTF-16 unit i, and the unit it starts at. */
+const char *jsV_strseek(js_State *J, js_Value *v, int i, int *start)
+{
+	js_UtfInfo *info;
+	const char *s = jsS_text(J, v, &info);
+	if (info)
+		return jsS_seek(J, info, s, i, start);
+	return jsS_utfwalk(s, 0, i, start);
+}
+
+int jsV_strrune(js_State *J, js_Value *v, int i)
+{
+	js_UtfInfo *info;
+	const char *s = jsS_text(J, v, &info);
+	const char *p;
+	Rune rune;
+	int start;
+
+	if (!info)
+		return js_runeat(J, s, i);
+
+	if (i < 0 || i >= info->length)
+		return EOF;
+	if (info->ascii)
+		return (unsigned char)s[i];
+
+	p = jsS_seek(J, info, s, i, &start);
+	chartorune(&rune, p);
+	if (rune >= 0x10000) {
+		if (i == start)
+			return 0xd800 + ((rune - 0x10000) >> 10);
+		return 0xdc00 + ((rune - 0x10000) & 0x3ff);
+	}
+	return rune;
+}
+
+int jsV_strptrtoidx(js_State *J, js_Value *v, const char *p)
+{
+	js_UtfInfo *info;
+	const char *s = jsS_text(J, v, &info);
+	int lo, hi, off;
+
+	if (!info)
+		return js_utfptrtoidx(s, p);
+	if (info->ascii)
+		return p - s;
+	if (info->length <= JS_UTFSTEP)
+		return js_utfptrtoidx(s, p);
+	if (!info->index)
+		jsS_buildindex(J, info, s);
+
+	/* last index entry at or before p */
+	off = p - s;
+	lo = 0;
+	hi = info->length / JS_UTFSTEP;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (info->index[2*mid] <= off)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return info->index[2*lo+1] + js_utfptrtoidx(s + info->index[2*lo], p);
+}
+
 static void jsB_new_String(js_State *J)
 {
 	js_newstring(J, js_gettop(J) > 1 ? js_tostring(J, 1) : "");
@@ -101,22 +295,23 @@ static void Sp_toString(js_State *J)
 {
 	js_Object *self = js_toobject(J, 0);
 	if (self->type != JS_CSTRING) js_typeerror(J, "not a string");
-	js_pushstring(J, self->u.s.string);
+	js_pushvalue(J, self->u.s.value);
 }
 
 static void Sp_valueOf(js_State *J)
 {
 	js_Object *self = js_toobject(J, 0);
 	if (self->type != JS_CSTRING) js_typeerror(J, "not a string");
-	js_pushstring(J, self->u.s.string);
+	js_pushvalue(J, self->u.s.value);
 }
 
 static void Sp_charAt(js_State *J)
 {
 	char buf[UTFmax + 1];
-	const char *s = checkstring(J, 0);
-	int pos = js_tointeger(J, 1);
-	Rune rune = js_runeat(J, s, pos);
+	int pos, rune;
+	checkstring(J, 0);
+	pos = js_tointeger(J, 1);
+	rune = jsV_strrune(J, js_tovalue(J, 0), pos);
 	if (rune >= 0) {
 		buf[runetochar(buf, &rune)] = 0;
 		js_pushstring(J, buf);
@@ -127,9 +322,10 @@ static void Sp_charAt(js_State *J)
 
 static void Sp_charCodeAt(js_State *J)
 {
-	const char *s = checkstring(J, 0);
-	int pos = js_tointeger(J, 1);
-	Rune rune = js_runeat(J, s, pos);
+	int pos, rune;
+	checkstring(J, 0);
+	pos = js_tointeger(J, 1);
+	rune = jsV_strrune(J, js_tovalue(J, 0), pos);
 	if (rune >= 0)
 		js_pushnumber(J, rune);
 	else
@@ -139,38 +335,22 @@ static void Sp_charCodeAt(js_State *J)
 static void Sp_concat(js_State *J)
 {
 	int i, top = js_gettop(J);
-	int n;
-	char * volatile out = NULL;
 	const char *s;
 
 	if (top == 1)
 		return;
 
+	/* concatenate pairwise so long results become ropes */
 	s = checkstring(J, 0);
-	n = 1 + strlen(s);
-
-	if (js_try(J)) {
-		js_free(J, out);
-		js_throw(J);
-	}
-
-	if (n > JS_STRLIMIT)
-		js_rangeerror(J, "invalid string length");
-	out = js_malloc(J, n);
-	strcpy(out, s);
-
+	if (js_isstring(J, 0))
+		js_copy(J, 0);
+	else
+		js_pushstring(J, s);
 	for (i = 1; i < top; ++i) {
-		s = js_tostring(J, i);
-		n += strlen(s);
-		if (n > JS_STRLIMIT)
-			js_rangeerror(J, "invalid string length");
-		out = js_realloc(J, out, n);
-		strcat(out, s);
+		js_copy(J, i);
+		js_tostring(J, -1);
+		js_concat(J);
 	}
-
-	js_pushstring(J, out);
-	js_endtry(J);
-	js_free(J, out);
 }
 
 static void Sp_indexOf(js_State *J)
@@ -216,27 +396,26 @@ static void Sp_localeCompare(js_State *J)
 	js_pushnumber(J, strcmp(a, b));
 }
 
-static void Sp_substring_imp(js_State *J, const char *s, int a, int n)
+static void Sp_substring_imp(js_State *J, js_Value *s, int a, int n)
 {
 	Rune head_rune = 0, tail_rune = 0;
 	const char *head, *tail;
 	char *p;
 	int i, k, head_len, tail_len;
 
-	/* find start of substring */
-	head = s;
-	for (i = 0; i < a; ++i) {
+	/* find start of substring, just after a character split by it */
+	head = jsV_strseek(J, s, a, &i);
+	if (i < a) {
 		head += chartorune(&head_rune, head);
-		if (head_rune >= 0x10000)
-			++i;
+		i += 2;
 	}
 
-	/* find end of substring */
-	tail = head;
-	for (k = i - a; k < n; ++k) {
+	/* find end of substring, just after a character split by it */
+	tail = jsV_strseek(J, s, a + n, &k);
+	k -= a;
+	if (k < n) {
 		tail += chartorune(&tail_rune, tail);
-		if (tail_rune >= 0x10000)
-			++k;
+		k += 2;
 	}
 
 	/* no surrogate pair splits! */
@@ -275,8 +454,11 @@ static void Sp_substring_imp(js_State *J, const char *s, int a, int n)
 
 static void Sp_slice(js_State *J)
 {
-	const char *str = checkstring(J, 0);
-	int len = js_utflen(str);
+	js_Value *str;
+	int len;
+	checkstring(J, 0);
+	str = js_tovalue(J, 0);
+	len = jsV_strlength(J, str);
 	int s = js_tointeger(J, 1);
 	int e = js_isdefined(J, 2) ? js_tointeger(J, 2) : len;
 
@@ -296,8 +478,11 @@ static void Sp_slice(js_State *J)
 
 static void Sp_substring(js_State *J)
 {
-	const char *str = checkstring(J, 0);
-	int len = js_utflen(str);
+	js_Value *str;
+	int len;
+	checkstring(J, 0);
+	str = js_tovalue(J, 0);
+	len = jsV_strlength(J, str);
 	int s = js_tointeger(J, 1);
 	int e = js_isdefined(J, 2) ? js_tointeger(J, 2) : len;
 
@@ -524,7 +709,7 @@ static void Sp_search(js_State *J)
 	re = js_toregexp(J, -1);
 
 	if (!js_doregexec(J, re->prog, text, &m, 0))
-		js_pushnumber(J, js_utfptrtoidx(text, m.sub[0].sp));
+		js_pushnumber(J, jsV_strptrtoidx(J, js_tovalue(J, 0), m.sub[0].sp));
 	else
 		js_pushnumber(J, -1);
 }
@@ -818,8 +1003,9 @@ static void Sp_split(js_State *J)
 
 void jsB_initstring(js_State *J)
 {
-	J->String_prototype->u.s.shrstr[0] = 0;
-	J->String_prototype->u.s.string = J->String_prototype->u.s.shrstr;
+	J->String_prototype->u.s.value.t.type = JS_TSHRSTR;
+	J->String_prototype->u.s.value.u.shrstr[0] = 0;
+	J->String_prototype->u.s.string = J->String_prototype->u.s.value.u.shrstr;
 	J->String_prototype->u.s.length = 0;
 
 	js_pushobject(J, J->String_prototype);
@@ -0,0 +1,596 @@
+#include "jsi.h"
+
+/*
+	ArrayBuffer and the typed arrays, Int8Array through Float64Array.
+
+	An ArrayBuffer owns a block of bytes that never moves or changes size.
+	A typed array is a view of a range of those bytes as elements of one
+	type, and several views may share a buffer. The elements are read and
+	written in place, as plain numbers: the interpreter's indexing fast
+	paths and the property accessors in jsrun.c go through jsV_getelement
+	and jsV_setelement, so indexing a typed array never boxes, allocates
+	or looks up a property name.
+*/
+
+static const struct {
+	const char *name;
+	int size;
+} jsB_elements[JS_ECOUNT] = {
+	{ "Int8Array", 1 },
+	{ "Uint8Array", 1 },
+	{ "Uint8ClampedArray", 1 },
+	{ "Int16Array", 2 },
+	{ "Uint16Array", 2 },
+	{ "Int32Array", 4 },
+	{ "Uint32Array", 4 },
+	{ "Float32Array", 4 },
+	{ "Float64Array", 8 },
+};
+
+int jsV_elementsize(int type)
+{
+	return jsB_elements[type].size;
+}
+
+const char *jsV_elementname(int type)
+{
+	return jsB_elements[type].name;
+}
+
+double jsV_getelement(js_Object *obj, int k)
+{
+	unsigned char *p = obj->u.ta.data;
+	switch (obj->u.ta.type) {
+	case JS_EINT8: return (signed char)p[k];
+	case JS_EUINT8: return p[k];
+	case JS_EUINT8CLAMPED: return p[k];
+	case JS_EINT16: { short x; memcpy(&x, p + k * 2, 2); return x; }
+	case JS_EUINT16: { unsigned short x; memcpy(&x, p + k * 2, 2); return x; }
+	case JS_EINT32: { int x; memcpy(&x, p + k * 4, 4); return x; }
+	case JS_EUINT32: { unsigned int x; memcpy(&x, p + k * 4, 4); return x; }
+	case JS_EFLOAT32: { float x; memcpy(&x, p + k * 4, 4); return x; }
+	case JS_EFLOAT64: { double x; memcpy(&x, p + k * 8, 8); return x; }
+	}
+	return 0;
+}
+
+/* ToInt32, without the fmod for the numbers that are already in range. */
+static unsigned int jsV_elementbits(double x)
+{
+	if (x > -2147483649.0 && x < 2147483648.0)
+		return (unsigned int)(int)x;
+	return jsV_numbertouint32(x);
+}
+
+static unsigned char jsV_clampbyte(double x)
+{
+	double f;
+	if (!(x > 0)) return 0; /* and NaN */
+	if (x >= 255) return 255;
+	f = floor(x);
+	if (x - f > 0.5 || (x - f == 0.5 && fmod(f, 2) != 0))
+		f += 1;
+	return f;
+}
+
+void jsV_setelement(js_Object *obj, int k, double x)
+{
+	unsigned char *p = obj->u.ta.data;
+	switch (obj->u.ta.type) {
+	case JS_EINT8:
+	case JS_EUINT8:
+		p[k] = jsV_elementbits(x);
+		break;
+	case JS_EUINT8CLAMPED:
+		p[k] = jsV_clampbyte(x);
+		break;
+	case JS_EINT16:
+	case JS_EUINT16:
+		{ unsigned short v = jsV_elementbits(x); memcpy(p + k * 2, &v, 2); }
+		break;
+	case JS_EINT32:
+	case JS_EUINT32:
+		{ unsigned int v = jsV_elementbits(x); memcpy(p + k * 4, &v, 4); }
+		break;
+	case JS_EFLOAT32:
+		{ float v = x; memcpy(p + k * 4, &v, 4); }
+		break;
+	case JS_EFLOAT64:
+		memcpy(p + k * 8, &x, 8);
+		break;
+	}
+}
+
+static js_Object *checktypedarray(js_State *J, int idx)
+{
+	js_Object *self = js_toobject(J, idx);
+	if (self->type != JS_CTYPEDARRAY)
+		js_typeerror(J, "not a typed array");
+	return self;
+}
+
+/* ToIndex: a non-negative integer, for lengths and offsets. */
+static int toindex(js_State *J, int idx, const char *what)
+{
+	double n;
+	if (js_isundefined(J, idx))
+		return 0;
+	n = js_tonumber(J, idx);
+	n = isnan(n) ? 0 : n < 0 ? -floor(-n) : floor(n);
+	if (n < 0 || n > JS_BUFFERLIMIT)
+		js_rangeerror(J, "invalid %s", what);
+	return n;
+}
+
+/* A start or end index, counted from the end if negative and clamped to [0, len]. */
+static int relindex(js_State *J, int idx, int len, int undef)
+{
+	double k;
+	if (js_isundefined(J, idx))
+		return undef;
+	k = js_tointeger(J, idx);
+	if (k < 0)
+		k += len;
+	return k < 0 ? 0 : k > len ? len : k;
+}
+
+static js_Object *newbuffer(js_State *J, double length)
+{
+	js_Object *obj;
+	if (length > JS_BUFFERLIMIT)
+		js_rangeerror(J, "invalid array buffer length");
+	obj = jsV_newobject(J, JS_CARRAYBUFFER, J->ArrayBuffer_prototype);
+	js_pushobject(J, obj);
+	if (length > 0) {
+		obj->u.ab.data = js_malloc(J, length);
+		memset(obj->u.ab.data, 0, length);
+		obj->u.ab.length = length;
+	}
+	return obj;
+}
+
+static js_Object *newview(js_State *J, int type, js_Object *buffer, int offset, int length)
+{
+	js_Object *obj = jsV_newobject(J, JS_CTYPEDARRAY, J->element_prototype[type]);
+	obj->u.ta.buffer = buffer;
+	obj->u.ta.data = buffer->u.ab.data ? buffer->u.ab.data + offset : NULL;
+	obj->u.ta.offset = offset;
+	obj->u.ta.length = length;
+	obj->u.ta.type = type;
+	js_pushobject(J, obj);
+	return obj;
+}
+
+/* Push a new typed array with a buffer of its own. */
+static js_Object *newtypedarray(js_State *J, int type, double length)
+{
+	js_Object *buffer = newbuffer(J, length * jsB_elements[type].size);
+	js_Object *obj = newview(J, type, buffer, 0, length);
+	js_rot2pop1(J);
+	return obj;
+}
+
+/* Copy n elements, converting between element types as needed. */
+static void copyelements(js_State *J, js_Object *dst, int d, js_Object *src, int s, int n)
+{
+	int i;
+	if (n <= 0)
+		return;
+	if (dst->u.ta.type == src->u.ta.type) {
+		int size = jsB_elements[dst->u.ta.type].size;
+		memmove(dst->u.ta.data + d * size, src->u.ta.data + s * size, n * size);
+	} else if (dst->u.ta.buffer == src->u.ta.buffer) {
+		/* the views may overlap, so read everything before writing */
+		double *tmp = js_malloc(J, n * sizeof *tmp);
+		for (i = 0; i < n; ++i)
+			tmp[i] = jsV_getelement(src, s + i);
+		for (i = 0; i < n; ++i)
+			jsV_setelement(dst, d + i, tmp[i]);
+		js_free(J, tmp);
+	} else {
+		for (i = 0; i < n; ++i)
+			jsV_setelement(dst, d + i, jsV_getelement(src, s + i));
+	}
+}
+
+static void jsB_new_TypedArray(js_State *J, int type)
+{
+	int size = jsB_elements[type].size;
+	js_Object *obj, *src, *buffer;
+	int offset, length, i;
+
+	if (!js_isobject(J, 1)) {
+		newtypedarray(J, type, toindex(J, 1, "typed array length"));
+		return;
+	}
+
+	src = js_toobject(J, 1);
+
+	if (src->type == JS_CARRAYBUFFER) {
+		buffer = src;
+		offset = toindex(J, 2, "typed array offset");
+		if (offset % size)
+			js_rangeerror(J, "%s offset must be a multiple of %d", jsB_elements[type].name, size);
+		if (js_isundefined(J, 3)) {
+			if (buffer->u.ab.length % size)
+				js_rangeerror(J, "%s buffer length must be a multiple of %d", jsB_elements[type].name, size);
+			if (offset > buffer->u.ab.length)
+				js_rangeerror(J, "typed array offset is out of bounds");
+			length = (buffer->u.ab.length - offset) / size;
+		} else {
+			length = toindex(J, 3, "typed array length");
+			if (offset + (double)length * size > buffer->u.ab.length)
+				js_rangeerror(J, "typed array length is out of bounds");
+		}
+		newview(J, type, buffer, offset, length);
+		return;
+	}
+
+	if (src->type == JS_CTYPEDARRAY) {
+		obj = newtypedarray(J, type, src->u.ta.length);
+		copyelements(J, obj, 0, src, 0, src->u.ta.length);
+		return;
+	}
+
+	/* an array or array-like object */
+	length = js_getlength(J, 1);
+	if (length < 0)
+		length = 0;
+	obj = newtypedarray(J, type, length);
+	for (i = 0; i < length; ++i) {
+		js_getindex(J, 1, i);
+		jsV_setelement(obj, i, js_tonumber(J, -1));
+		js_pop(J, 1);
+	}
+}
+
+static void jsB_TypedArray(js_State *J)
+{
+	js_typeerror(J, "typed array constructors require 'new'");
+}
+
+#define DTYPEDARRAY(Name, TYPE) \
+	static void jsB_new_##Name(js_State *J) { \
+		jsB_new_TypedArray(J, TYPE); \
+	}
+
+DTYPEDARRAY(Int8Array, JS_EINT8)
+DTYPEDARRAY(Uint8Array, JS_EUINT8)
+DTYPEDARRAY(Uint8ClampedArray, JS_EUINT8CLAMPED)
+DTYPEDARRAY(Int16Array, JS_EINT16)
+DTYPEDARRAY(Uint16Array, JS_EUINT16)
+DTYPEDARRAY(Int32Array, JS_EINT32)
+DTYPEDARRAY(Uint32Array, JS_EUINT32)
+DTYPEDARRAY(Float32Array, JS_EFLOAT32)
+DTYPEDARRAY(Float64Array, JS_EFLOAT64)
+
+#undef DTYPEDARRAY
+
+static void TAp_set(js_State *J)
+{
+	js_Object *self = checktypedarray(J, 0);
+	js_Object *src;
+	int offset = toindex(J, 2, "offset");
+	int i, n;
+
+	if (!js_isobject(J, 1))
+		js_typeerror(J, "set: source is not an object");
+	src = js_toobject(J, 1);
+
+	if (src->type == JS_CTYPEDARRAY) {
+		n = src->u.ta.length;
+		if ((double)offset + n > self->u.ta.length)
+			js_rangeerror(J, "set: source is too large");
+		copyelements(J, self, offset, src, 0, n);
+	} else {
+		n = js_getlength(J, 1);
+		if ((double)offset + n > self->u.ta.length)
+			js_rangeerror(J, "set: source is too large");
+		for (i = 0; i < n; ++i) {
+			js_getindex(J, 1, i);
+			jsV_setelement(self, offset + i, js_tonumber(J, -1));
+			js_pop(J, 1);
+		}
+	}
+
+	js_pushundefined(J);
+}
+
+static void TAp_subarray(js_State *J)
+{
+	js_Object *self = checktypedarray(J, 0);
+	int len = self->u.ta.length;
+	int s = relindex(J, 1, len, 0);
+	int e = relindex(J, 2, len, len);
+	int size = jsB_elements[self->u.ta.type].size;
+	newview(J, self->u.ta.type, self->u.ta.buffer, self->u.ta.offset + s * size, e > s ? e - s : 0);
+}
+
+static void TAp_slice(js_State *J)
+{
+	js_Object *self = checktypedarray(J, 0);
+	int len = self->u.ta.length;
+	int s = relindex(J, 1, len, 0);
+	int e = relindex(J, 2, len, len);
+	js_Object *obj = newtypedarray(J, self->u.ta.type, e > s ? e - s : 0);
+	copyelements(J, obj, 0, self, s, e - s);
+}
+
+static void TAp_fill(js_State *J)
+{
+	js_Object *self = checktypedarray(J, 0);
+	double x = js_tonumber(J, 1);
+	int len = self->u.ta.length;
+	int s = relindex(J, 2, len, 0);
+	int e = relindex(J, 3, len, len);
+	int i;
+	if (s < e && self->u.ta.type <= JS_EUINT8CLAMPED) {
+		jsV_setelement(self, s, x);
+		memset(self->u.ta.data + s, self->u.ta.data[s], e - s);
+	} else {
+		for (i = s; i < e; ++i)
+			jsV_setelement(self, i, x);
+	}
+	js_copy(J, 0);
+}
+
+/* Numbers in ascending order, -0 before +0 and NaN last. */
+static int TAp_sort_cmpnum(const void *pa, const void *pb)
+{
+	double a = *(const double *)pa, b = *(const double *)pb;
+	if (a < b) return -1;
+	if (a > b) return 1;
+	if (a == b) return a == 0 ? !!signbit(b) - !!signbit(a) : 0;
+	return !!isnan(a) - !!isnan(b);
+}
+
+static int TAp_sort_cmpfun(js_State *J, double a, double b)
+{
+	double v;
+	js_copy(J, 1);
+	js_pushundefined(J);
+	js_pushnumber(J, a);
+	js_pushnumber(J, b);
+	js_call(J, 2);
+	v = js_tonumber(J, -1);
+	js_pop(J, 1);
+	return v < 0 ? -1 : v > 0 ? 1 : 0;
+}
+
+/* A stable merge sort, since the comparator can tell equal numbers apart. */
+static void TAp_sort_merge(js_State *J, double *a, double *tmp, int n)
+{
+	int w, lo, i, j, d;
+	for (w = 1; w < n; w *= 2) {
+		for (lo = 0; lo + w < n; lo += 2 * w) {
+			int mid = lo + w, hi = mid + w < n ? mid + w : n;
+			memcpy(tmp, a + lo, w * sizeof *a);
+			i = 0, j = mid, d = lo;
+			while (i < w && j < hi) {
+				if (TAp_sort_cmpfun(J, a[j], tmp[i]) < 0)
+					a[d++] = a[j++];
+				else
+					a[d++] = tmp[i++];
+			}
+			memcpy(a + d, tmp + i, (w - i) * sizeof *a);
+		}
+	}
+}
+
+/*
+	Sort the elements as numbers rather than through the generic
+	Array.prototype.sort, which compares them as strings. The elements are
+	copied out so that a comparator that writes to the array cannot upset
+	the sort, and copied back at the end.
+*/
+static void TAp_sort(js_State *J)
+{
+	js_Object *self = checktypedarray(J, 0);
+	int n = self->u.ta.length;
+	double *val;
+	int i;
+
+	if (!js_iscallable(J, 1) && !js_isundefined(J, 1))
+		js_typeerror(J, "comparison function must be a function or undefined");
+
+	if (n > 1) {
+		val = js_malloc(J, 2 * (size_t)n * sizeof *val);
+		if (js_try(J)) {
+			js_free(J, val);
+			js_throw(J);
+		}
+		for (i = 0; i < n; ++i)
+			val[i] = jsV_getelement(self, i);
+		if (js_iscallable(J, 1))
+			TAp_sort_merge(J, val, val + n, n);
+		else
+			qsort(val, n, sizeof *val, TAp_sort_cmpnum);
+		for (i = 0; i < n; ++i)
+			jsV_setelement(self, i, val[i]);
+		js_endtry(J);
+		js_free(J, val);
+	}
+
+	js_copy(J, 0);
+}
+
+static void ABp_slice(js_State *J)
+{
+	js_Object *self = js_toobject(J, 0);
+	js_Object *obj;
+	int len, s, e;
+	if (self->type != JS_CARRAYBUFFER)
+		js_typeerror(J, "not an ArrayBuffer");
+	len = self->u.ab.length;
+	s = relindex(J, 1, len, 0);
+	e = relindex(J, 2, len, len);
+	obj = newbuffer(J, e > s ? e - s : 0);
+	if (e > s)
+		memcpy(obj->u.ab.data, self->u.ab.data + s, e - s);
+}
+
+static void AB_isView(js_State *J)
+{
+	js_pushboolean(J, js_isobject(J, 1) && js_toobject(J, 1)->type == JS_CTYPEDARRAY);
+}
+
+static void jsB_new_ArrayBuffer(js_State *J)
+{
+	newbuffer(J, toindex(J, 1, "array buffer length"));
+}
+
+static void jsB_ArrayBuffer(js_State *J)
+{
+	js_typeerror(J, "ArrayBuffer constructor requires 'new'");
+}
+
+/* Share a generic Array.prototype method, which works on any array-like. */
+static void jsB_arraymethod(js_State *J, const char *name)
+{
+	js_pushobject(J, J->Array_prototype);
+	js_getproperty(J, -1, name);
+	js_rot2pop1(J);
+	js_defproperty(J, -2, name, JS_DONTENUM);
+}
+
+void jsB_inittypedarray(js_State *J)
+{
+	static const js_CFunction constructors[JS_ECOUNT] = {
+		jsB_new_Int8Array,
+		jsB_new_Uint8Array,
+		jsB_new_Uint8ClampedArray,
+		jsB_new_Int16Array,
+		jsB_new_Uint16Array,
+		jsB_new_Int32Array,
+		jsB_new_Uint32Array,
+		jsB_new_Float32Array,
+		jsB_new_Float64Array,
+	};
+	int i;
+
+	js_pushobject(J, J->ArrayBuffer_prototype);
+	{
+		jsB_propf(J, "ArrayBuffer.prototype.slice", ABp_slice, 2);
+	}
+	js_newcconstructor(J, jsB_ArrayBuffer, jsB_new_ArrayBuffer, "ArrayBuffer", 1);
+	{
+		jsB_propf(J, "ArrayBuffer.isView", AB_isView, 1);
+	}
+	js_defglobal(J, "ArrayBuffer", JS_DONTENUM);
+
+	js_pushobject(J, J->TypedArray_prototype);
+	{
+		jsB_propf(J, "TypedArray.prototype.set", TAp_set, 1);
+		jsB_propf(J, "TypedArray.prototype.subarray", TAp_subarray, 2);
+		jsB_propf(J, "TypedArray.prototype.slice", TAp_slice, 2);
+		jsB_propf(J, "TypedArray.prototype.fill", TAp_fill, 1);
+		jsB_propf(J, "TypedArray.prototype.sort", TAp_sort, 1);
+		jsB_arraymethod(J, "toString");
+		jsB_arraymethod(J, "join");
+		jsB_arraymethod(J, "indexOf");
+		jsB_arraymethod(J, "lastIndexOf");
+		jsB_arraymethod(J, "reverse");
+		jsB_arraymethod(J, "forEach");
+		jsB_arraymethod(J, "every");
+		jsB_arraymethod(J, "some");
+		jsB_arraymethod(J, "reduce");
+		jsB_arraymethod(J, "reduceRight");
+	}
+	js_pop(J, 1);
+
+	for (i = 0; i < JS_ECOUNT; ++i) {
+		js_pushobject(J, J->element_prototype[i]);
+		jsB_propn(J, "BYTES_PER_ELEMENT", jsB_elements[i].size);
+		js_newcconstructor(J, jsB_TypedArray, constructors[i], jsB_elements[i].name, 3);
+		jsB_propn(J, "BYTES_PER_ELEMENT", jsB_elements[i].size);
+		js_defglobal(J, jsB_elements[i].name, JS_DONTENUM);
+	}
+}
+
+#ifdef TYPEDBENCH
+
+#include <time.h>
+
+/* cc -O2 -DTYPEDBENCH -o typedbench one.c -lm */
+
+static double bench(js_State *J, const char *source)
+{
+	struct timespec t0, t1;
+	double ms, best = 0;
+	int i;
+	for (i = 0; i < 5; ++i) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		js_dostring(J, source);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+		if (i == 0 || ms < best)
+			best = ms;
+	}
+	return best;
+}
+
+static const char *setup =
+	"function fill(a, n) { for (var i = 0; i < n; ++i) a[i] = (i * 31) & 255; return a[n - 1]; }"
+	"function adler32(a, n) {"
+	"  var s1 = 1, s2 = 0;"
+	"  for (var i = 0; i < n; ++i) { s1 = (s1 + a[i]) % 65521; s2 = (s2 + s1) % 65521; }"
+	"  return s2 * 65536 + s1;"
+	"}"
+	"function base64(a, n, out, table) {"
+	"  for (var i = 0, o = 0; i + 2 < n; i += 3) {"
+	"    var w = a[i] << 16 | a[i+1] << 8 | a[i+2];"
+	"    out[o++] = table[w >> 18]; out[o++] = table[w >> 12 & 63];"
+	"    out[o++] = table[w >> 6 & 63]; out[o++] = table[w & 63];"
+	"  }"
+	"  return out[o - 1];"
+	"}"
+	"function dot(xs, ys, n) { var t = 0; for (var i = 0; i < n; ++i) t += xs[i] * ys[i]; return t; }"
+	"function data(bytes, out, table, xs, ys) {"
+	"  for (var i = 0; i < 64; ++i)"
+	"    table[i] = 'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/'.charCodeAt(i);"
+	"  fill(bytes, n);"
+	"  for (var i = 0; i < n; ++i) { xs[i] = i / 3; ys[i] = 1 - i / 7; }"
+	"  return { bytes: bytes, out: out, table: table, xs: xs, ys: ys };"
+	"}"
+	"function zeros(n) { var a = []; for (var i = 0; i < n; ++i) a[i] = 0; return a; }"
+	"var A = data(zeros(n), zeros(n / 3 * 4 + 4), [], zeros(n), zeros(n));"
+	"var T = data(new Uint8Array(n), new Uint8Array(n / 3 * 4 + 4), new Uint8Array(64), new Float64Array(n), new Float64Array(n));";
+
+static const char *loops[][2] = {
+	{ "fill", "fill(%s.bytes, n)" },
+	{ "adler32", "adler32(%s.bytes, n)" },
+	{ "base64", "base64(%s.bytes, n, %s.out, %s.table)" },
+	{ "dot", "dot(%s.xs, %s.ys, n)" },
+};
+
+int main(int argc, char **argv)
+{
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	js_State *J = js_newstate(NULL, NULL, 0);
+	char source[256];
+	double plain, typed;
+	int i;
+
+	js_pushnumber(J, n);
+	js_setglobal(J, "n");
+	js_dostring(J, setup);
+
+	printf("%d elements\n", n);
+	for (i = 0; i < nelem(loops); ++i) {
+		snprintf(source, sizeof source, loops[i][1], "A", "A", "A");
+		plain = bench(J, source);
+		snprintf(source, sizeof source, loops[i][1], "T", "T", "T");
+		typed = bench(J, source);
+		printf("%-8s Array %7.1f ms, typed array %7.1f ms\n", loops[i][0], plain, typed);
+	}
+
+	/* the same answers either way */
+	js_dostring(J, "if (adler32(A.bytes, n) !== adler32(T.bytes, n) || dot(A.xs, A.ys, n) !== dot(T.xs, T.ys, n)"
+		" || base64(A.bytes, n, A.out, A.table) !== base64(T.bytes, n, T.out, T.table))"
+		" throw new Error('typed arrays disagree');");
+
+	js_freestate(J);
+	return 0;
+}
+
+#endif
@@ -2,7 +2,7 @@
 #include "utf.h"
 
 #define JSV_ISSTRING(v) (v->t.type==JS_TSHRSTR || v->t.type==JS_TMEMSTR || v->t.type==JS_TLITSTR)
-#define JSV_TOSTRING(v) (v->t.type==JS_TSHRSTR ? v->u.shrstr : v->t.type==JS_TLITSTR ? v->u.litstr : v->t.type==JS_TMEMSTR ? v->u.memstr->p : "")
+#define JSV_TOSTRING(J, v) (v->t.type==JS_TSHRSTR ? v->u.shrstr : v->t.type==JS_TLITSTR ? v->u.litstr : v->t.type==JS_TMEMSTR ? JSV_STRTEXT(J, v->u.memstr) : "")
 
 double js_strtol(const char *s, char **p, int base)
 {
@@ -159,7 +159,7 @@ int jsV_toboolean(js_State *J, js_Value *v)
 	case JS_TBOOLEAN: return v->u.boolean;
 	case JS_TNUMBER: return v->u.number != 0 && !isnan(v->u.number);
 	case JS_TLITSTR: return v->u.litstr[0] != 0;
-	case JS_TMEMSTR: return v->u.memstr->p[0] != 0;
+	case JS_TMEMSTR: return v->u.memstr->length != 0;
 	case JS_TOBJECT: return 1;
 	}
 }
@@ -254,7 +254,7 @@ double jsV_tonumber(js_State *J, js_Value *v)
 	case JS_TBOOLEAN: return v->u.boolean;
 	case JS_TNUMBER: return v->u.number;
 	case JS_TLITSTR: return jsV_stringtonumber(J, v->u.litstr);
-	case JS_TMEMSTR: return jsV_stringtonumber(J, v->u.memstr->p);
+	case JS_TMEMSTR: return jsV_stringtonumber(J, JSV_STRTEXT(J, v->u.memstr));
 	case JS_TOBJECT:
 		jsV_toprimitive(J, v, JS_HNUMBER);
 		return jsV_tonumber(J, v);
@@ -338,7 +338,7 @@ const char *jsV_tostring(js_State *J, js_Value *v)
 	case JS_TNULL: return "null";
 	case JS_TBOOLEAN: return v->u.boolean ? "true" : "false";
 	case JS_TLITSTR: return v->u.litstr;
-	case JS_TMEMSTR: return v->u.memstr->p;
+	case JS_TMEMSTR: return JSV_STRTEXT(J, v->u.memstr);
 	case JS_TNUMBER:
 		p = jsV_numbertostring(J, buf, v->u.number);
 		if (p == buf) {
@@ -378,17 +378,15 @@ static js_Object *jsV_newnumber(js_State *J, double v)
 	return obj;
 }
 
-static js_Object *jsV_newstring(js_State *J, const char *v)
+/* A String object keeps the primitive itself, sharing its text and UTF-16 index. */
+static js_Object *jsV_newstring(js_State *J, js_Value *v)
 {
+	const char *text = JSV_TOSTRING(J, v);
 	js_Object *obj = jsV_newobject(J, JS_CSTRING, J->String_prototype);
-	size_t n = strlen(v);
-	if (n < sizeof(obj->u.s.shrstr)) {
-		obj->u.s.string = obj->u.s.shrstr;
-		memcpy(obj->u.s.shrstr, v, n + 1);
-	} else {
-		obj->u.s.string = js_strdup(J, v);
-	}
-	obj->u.s.length = js_utflen(v);
+	obj->u.s.value = *v;
+	obj->u.s.string = v->t.type == JS_TSHRSTR ? obj->u.s.value.u.shrstr : text;
+	obj->u.s.length = jsV_strlength(J, &obj->u.s.value);
+	jsG_barrier(J, &obj->u.s.value);
 	return obj;
 }
 
@@ -401,9 +399,9 @@ js_Object *jsV_toobject(js_State *J, js_Value *v)
 	case JS_TUNDEFINED: js_typeerror(J, "cannot convert undefined to object");
 	case JS_TNULL: js_typeerror(J, "cannot convert null to object");
 	case JS_TOBJECT: return v->u.object;
-	case JS_TSHRSTR: o = jsV_newstring(J, v->u.shrstr); break;
-	case JS_TLITSTR: o = jsV_newstring(J, v->u.litstr); break;
-	case JS_TMEMSTR: o = jsV_newstring(J, v->u.memstr->p); break;
+	case JS_TSHRSTR:
+	case JS_TLITSTR:
+	case JS_TMEMSTR: o = jsV_newstring(J, v); break;
 	case JS_TBOOLEAN: o = jsV_newboolean(J, v->u.boolean); break;
 	case JS_TNUMBER: o = jsV_newnumber(J, v->u.number); break;
 	}
@@ -450,7 +448,8 @@ void js_newnumber(js_State *J, double v)
 
 void js_newstring(js_State *J, const char *v)
 {
-	js_pushobject(J, jsV_newstring(J, v));
+	js_pushstring(J, v);
+	js_toobject(J, -1);
 }
 
 void js_newfunction(js_State *J, js_Function *fun, js_Environment *scope)
@@ -597,27 +596,77 @@ int js_instanceof(js_State *J)
 	return 0;
 }
 
+static int jsV_stringlength(js_State *J, js_Value *v)
+{
+	if (v->t.type == JS_TMEMSTR)
+		return v->u.memstr->length;
+	return strlen(jsV_tostring(J, v));
+}
+
+/* Turn a string value into a js_String so it can be half of a rope. */
+static js_String *jsV_tomemstring(js_State *J, js_Value *v)
+{
+	if (v->t.type != JS_TMEMSTR) {
+		const char *s = jsV_tostring(J, v);
+		v->u.memstr = jsV_newmemstring(J, s, strlen(s));
+		v->t.type = JS_TMEMSTR;
+	}
+	return v->u.memstr;
+}
+
+/* Concatenate the texts of two short strings into a new flat string. */
+static js_String *jsV_joinflat(js_State *J, const char *a, int na, const char *b, int nb)
+{
+	char buf[JS_ROPEMIN];
+	memcpy(buf, a, na);
+	memcpy(buf + na, b, nb);
+	return jsV_newmemstring(J, buf, na + nb);
+}
+
 void js_concat(js_State *J)
 {
 	js_toprimitive(J, -2, JS_HNONE);
 	js_toprimitive(J, -1, JS_HNONE);
 
 	if (js_isstring(J, -2) || js_isstring(J, -1)) {
-		const char *sa = js_tostring(J, -2);
-		const char *sb = js_tostring(J, -1);
-		char * volatile sab = NULL;
-		/* TODO: create js_String directly */
-		if (js_try(J)) {
-			js_free(J, sab);
-			js_throw(J);
+		js_Value *va = js_tovalue(J, -2);
+		js_Value *vb = js_tovalue(J, -1);
+		int na = jsV_stringlength(J, va);
+		int nb = jsV_stringlength(J, vb);
+		js_String *a, *b, *l, *r;
+		js_Value ab;
+
+		if (na + nb > JS_STRLIMIT)
+			js_rangeerror(J, "invalid string length");
+
+		if (na + nb < JS_ROPEMIN) {
+			char buf[JS_ROPEMIN];
+			memcpy(buf, jsV_tostring(J, va), na);
+			memcpy(buf + na, jsV_tostring(J, vb), nb);
+			js_pop(J, 2);
+			js_pushlstring(J, buf, na + nb);
+			return;
 		}
-		sab = js_malloc(J, strlen(sa) + strlen(sb) + 1);
-		strcpy(sab, sa);
-		strcat(sab, sb);
+
+		a = jsV_tomemstring(J, va);
+		b = jsV_tomemstring(J, vb);
+
+		/*
+			Appending a short string to a rope whose last piece is short
+			copies the two into a new last piece instead of growing the
+			rope, and likewise for prepending, so building a string a few
+			bytes at a time makes one rope node per JS_ROPEMIN bytes.
+		*/
+		ab.t.type = JS_TMEMSTR;
+		if (!a->p && (r = a->u.rope.right)->p && r->length + nb < JS_ROPEMIN)
+			ab.u.memstr = jsV_newrope(J, a->u.rope.left, jsV_joinflat(J, r->p, r->length, b->p, nb));
+		else if (!b->p && (l = b->u.rope.left)->p && na + l->length < JS_ROPEMIN)
+			ab.u.memstr = jsV_newrope(J, jsV_joinflat(J, a->p, na, l->p, l->length), b->u.rope.right);
+		else
+			ab.u.memstr = jsV_newrope(J, a, b);
+
 		js_pop(J, 2);
-		js_pushstring(J, sab);
-		js_endtry(J);
-		js_free(J, sab);
+		js_pushvalue(J, ab);
 	} else {
 		double x = js_tonumber(J, -2);
 		double y = js_tonumber(J, -1);
@@ -650,7 +699,7 @@ int js_equal(js_State *J)
 
 retry:
 	if (JSV_ISSTRING(x) && JSV_ISSTRING(y))
-		return !strcmp(JSV_TOSTRING(x), JSV_TOSTRING(y));
+		return !strcmp(JSV_TOSTRING(J, x), JSV_TOSTRING(J, y));
 	if (x->t.type == y->t.type) {
 		if (x->t.type == JS_TUNDEFINED) return 1;
 		if (x->t.type == JS_TNULL) return 1;
@@ -696,7 +745,7 @@ int js_strictequal(js_State *J)
 	js_Value *y = js_tovalue(J, -1);
 
 	if (JSV_ISSTRING(x) && JSV_ISSTRING(y))
-		return !strcmp(JSV_TOSTRING(x), JSV_TOSTRING(y));
+		return !strcmp(JSV_TOSTRING(J, x), JSV_TOSTRING(J, y));
 
 	if (x->t.type != y->t.type) return 0;
 	if (x->t.type == JS_TUNDEFINED) return 1;
@@ -706,3 +755,57 @@ int js_strictequal(js_State *J)
 	if (x->t.type == JS_TOBJECT) return x->u.object == y->u.object;
 	return 0;
 }
+
+#ifdef ROPEBENCH
+
+#include <time.h>
+
+/*
+	Building long strings by concatenation. Each script appends (or
+	prepends) pieces until the string is 10 MB, then reads its length and
+	last character, which flattens it once. "join" builds the same text
+	flat through an array for reference. The "read" pair appends 1 KB at a
+	time to 1 MB with and without reading the string after every append; a
+	read flattens the rope, so the second one copies the whole string each
+	time as a flat concatenation would.
+
+	cc -O2 -DROPEBENCH -o ropebench one.c -lm
+*/
+
+static const struct {
+	const char *name;
+	double bytes;
+	const char *source;
+} ropescripts[] = {
+	{ "append 10", 10e6, "var s = ''; for (var i = 0; i < 1e6; i++) s += 'abcdefghij'; s.length + s.charCodeAt(s.length - 1);" },
+	{ "append 1K", 10e6, "var k = new Array(1025).join('x'), s = ''; for (var i = 0; i < 10e6 / 1024; i++) s += k; s.length + s.charCodeAt(s.length - 1);" },
+	{ "prepend 10", 10e6, "var s = ''; for (var i = 0; i < 1e6; i++) s = 'abcdefghij' + s; s.length + s.charCodeAt(s.length - 1);" },
+	{ "join", 10e6, "var a = []; for (var i = 0; i < 1e6; i++) a.push('abcdefghij'); var s = a.join(''); s.length + s.charCodeAt(s.length - 1);" },
+	{ "no read", 1e6, "var k = new Array(1025).join('x'), s = ''; for (var i = 0; i < 1e6 / 1024; i++) s += k; s.charCodeAt(s.length - 1);" },
+	{ "read", 1e6, "var k = new Array(1025).join('x'), s = ''; for (var i = 0; i < 1e6 / 1024; i++) { s += k; s.charCodeAt(s.length - 1); }" },
+};
+
+int main(void)
+{
+	struct timespec t0, t1;
+	double ms, best;
+	int i, run;
+	for (i = 0; i < nelem(ropescripts); ++i) {
+		best = 0;
+		for (run = 0; run < 5; ++run) {
+			js_State *J = js_newstate(NULL, NULL, 0);
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			js_dostring(J, ropescripts[i].source);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+			if (run == 0 || ms < best)
+				best = ms;
+			js_freestate(J);
+		}
+		printf("%-10s %5.0f MB %8.1f ms %8.1f MB/s\n", ropescripts[i].name,
+			ropescripts[i].bytes / 1e6, best, ropescripts[i].bytes / 1e6 / best * 1e3);
+	}
+	return 0;
+}
+
+#endif
@@ -38,6 +38,7 @@ extern "C" {
 #endif
 
 typedef struct js_State js_State;
+typedef struct js_Snapshot js_Snapshot;
 
 typedef void *(*js_Alloc)(void *memctx, void *ptr, int size);
 typedef void (*js_Panic)(js_State *J);
@@ -47,6 +48,7 @@ typedef int (*js_HasProperty)(js_State *J, void *p, const char *name);
 typedef int (*js_Put)(js_State *J, void *p, const char *name);
 typedef int (*js_Delete)(js_State *J, void *p, const char *name);
 typedef void (*js_Report)(js_State *J, const char *message);
+typedef void (*js_Interrupt)(js_State *J, void *data);
 
 /* Basic functions */
 js_State *js_newstate(js_Alloc alloc, void *actx, int flags);
@@ -55,8 +57,60 @@ void *js_getcontext(js_State *J);
 void js_setreport(js_State *J, js_Report report);
 js_Panic js_atpanic(js_State *J, js_Panic panic);
 void js_freestate(js_State *J);
+
+/* Snapshots of a state at rest, to stamp out copies of it */
+js_Snapshot *js_newsnapshot(js_State *J); /* NULL if the state cannot be copied */
+js_State *js_clonesnapshot(js_Snapshot *snap); /* NULL if out of memory */
+void js_freesnapshot(js_Snapshot *snap);
 void js_gc(js_State *J, int report);
 void js_setlimit(js_State *J, int runlimit, int memlimit);
+void js_setinterrupt(js_State *J, js_Interrupt interrupt, void *data, int interval); /* may throw, or block to suspend the script */
+
+/* Garbage collector tuning and statistics */
+
+typedef struct {
+	unsigned int cycles;	/* completed collections */
+	unsigned int steps;	/* collector pauses, incremental or not */
+	double last_pause;	/* milliseconds */
+	double max_pause;
+	double total_pause;
+	unsigned int pauses[8];	/* pause histogram: <0.1, <0.25, <0.5, <1, <2, <5, <10, >=10 ms */
+	unsigned long last_freed;	/* approximate bytes freed by the last cycle */
+	unsigned long total_freed;
+	unsigned int live;	/* allocations that survived the last cycle */
+} js_GCStats;
+
+void js_setgcbudget(js_State *J, int usec); /* 0 collects in one pause */
+void js_getgcstats(js_State *J, js_GCStats *stats);
+
+/* Memory pool statistics */
+
+typedef struct {
+	unsigned long allocs;	/* pooled allocations */
+	unsigned long frees;
+	unsigned long reused;	/* allocations served from a free list */
+	unsigned long large;	/* allocations too big for a pool */
+	unsigned long slabs;	/* slabs held */
+	unsigned long slab_bytes;
+	unsigned long used_bytes;	/* pooled bytes handed out and not yet freed */
+} js_PoolStats;
+
+void js_getpoolstats(js_State *J, js_PoolStats *stats);
+
+/* Compiled script cache */
+
+typedef struct {
+	unsigned int hits;	/* scripts loaded from the cache */
+	unsigned int misses;	/* scripts compiled from source */
+	unsigned int stores;	/* cache entries written */
+	unsigned int errors;	/* stale, corrupt or unwritable entries */
+	double compile_ms;	/* time spent compiling on misses */
+	double load_ms;	/* time spent loading hits */
+	double saved_ms;	/* compile time avoided by hits, less their load time */
+} js_CodeCacheStats;
+
+void js_setcodecache(js_State *J, const char *dir); /* NULL turns the cache off */
+void js_getcodecachestats(js_State *J, js_CodeCacheStats *stats);
 
 int js_dostring(js_State *J, const char *source);
 int js_dofile(js_State *J, const char *filename);
@@ -1,6 +1,7 @@
 #include "jsarray.c"
 #include "jsboolean.c"
 #include "jsbuiltin.c"
+#include "jsbytecode.c"
 #include "jscompile.c"
 #include "jsdate.c"
 #include "jsdtoa.c"
@@ -14,12 +15,15 @@
 #include "jsobject.c"
 #include "json.c"
 #include "jsparse.c"
+#include "jspool.c"
 #include "jsproperty.c"
 #include "jsregexp.c"
 #include "jsrepr.c"
 #include "jsrun.c"
+#include "jssnapshot.c"
 #include "jsstate.c"
 #include "jsstring.c"
+#include "jstypedarray.c"
 #include "jsvalue.c"
 #include "regexp.c"
 #include "utf.c"
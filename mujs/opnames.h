@@ -20,6 +20,10 @@
 "getlocal",
 "setlocal",
 "dellocal",
+"putlocal",
+"inclocal",
+"declocal",
+"addlocal",
 "hasvar",
 "getvar",
 "setvar",
@@ -32,6 +36,7 @@
 "initsetter",
 "getprop",
 "getprop_s",
+"getlocalprop",
 "setprop",
 "setprop_s",
 "delprop",
@@ -82,4 +87,16 @@
 "jump",
 "jtrue",
 "jfalse",
+"jlt",
+"jgt",
+"jle",
+"jge",
+"jnlt",
+"jngt",
+"jnle",
+"jnge",
+"jeq",
+"jne",
+"jstricteq",
+"jstrictne",
 "return",
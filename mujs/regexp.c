@@ -26,11 +26,25 @@
 #ifndef REG_MAXCLASS
 #define REG_MAXCLASS 128
 #endif
+#ifndef REG_MAXPREFIX
+#define REG_MAXPREFIX 32
+#endif
+#ifndef REG_MAXDFA
+#define REG_MAXDFA 256
+#endif
+#ifndef REG_DFAMIN
+#define REG_DFAMIN 64
+#endif
+#define REG_DFAHASH 64
 
 typedef struct Reclass Reclass;
 typedef struct Renode Renode;
 typedef struct Reinst Reinst;
 typedef struct Rethread Rethread;
+typedef struct Restack Restack;
+typedef struct Revm Revm;
+typedef struct Restate Restate;
+typedef struct Redfa Redfa;
 
 struct Reclass {
 	Rune *end;
@@ -39,9 +53,20 @@ struct Reclass {
 
 struct Reprog {
 	Reinst *start, *end;
+	Reinst *entry; /* the anchored match, after the search loop */
 	Reclass *cclass;
 	int flags;
 	int nsub;
+
+	/* linear-time matcher state, see regexec */
+	void *(*alloc)(void *ctx, void *p, int n);
+	void *ctx;
+	int backtrack; /* needs back-references or lookaheads */
+	int ctxmask; /* contexts the assertions of the program look at */
+	int anchored; /* every match starts with '^' */
+	char prefix[REG_MAXPREFIX]; /* literal every match starts with */
+	Revm *vm;
+	Redfa *dfa;
 };
 
 struct cstate {
@@ -806,6 +831,82 @@ loop:
 	}
 }
 
+enum {
+	CTX_BOL = 1, /* '^' holds here */
+	CTX_WORD = 2, /* the previous character is a word character */
+};
+
+struct Restate {
+	Restate *link;
+	Restate *next[128]; /* cached transitions on ASCII characters */
+	int ctx;
+	int n;
+	int inst[1]; /* instructions live before the next character */
+};
+
+struct Redfa {
+	Restate *hash[REG_DFAHASH];
+	int count;
+};
+
+static Restate dfaaccept;
+
+static void analyze(Reprog *prog)
+{
+	Reinst *pc;
+	char *p;
+
+	prog->backtrack = 0;
+	prog->ctxmask = 0;
+	for (pc = prog->start; pc < prog->end; ++pc) {
+		switch (pc->opcode) {
+		case I_REF: case I_PLA: case I_NLA:
+			prog->backtrack = 1;
+			break;
+		case I_BOL:
+			prog->ctxmask |= CTX_BOL;
+			break;
+		case I_WORD: case I_NWORD:
+			prog->ctxmask |= CTX_WORD;
+			break;
+		}
+	}
+
+	pc = prog->entry;
+	while (pc->opcode == I_LPAR)
+		++pc;
+	prog->anchored = pc->opcode == I_BOL;
+
+	/* every match starts with the characters on the straight path from the entry */
+	p = prog->prefix;
+	if (!(prog->flags & REG_ICASE)) {
+		for (pc = prog->entry; pc < prog->end; ++pc) {
+			if (pc->opcode == I_LPAR || pc->opcode == I_RPAR)
+				continue;
+			if (pc->opcode != I_CHAR || pc->c == 0)
+				break;
+			if (p + UTFmax >= prog->prefix + REG_MAXPREFIX)
+				break;
+			p += runetochar(p, &pc->c);
+		}
+	}
+	*p = 0;
+}
+
+static void dfaflush(Redfa *dfa, void *(*alloc)(void *ctx, void *p, int n), void *ctx)
+{
+	Restate *s, *next;
+	int i;
+	for (i = 0; i < REG_DFAHASH; ++i) {
+		for (s = dfa->hash[i]; s; s = next) {
+			next = s->link;
+			alloc(ctx, s, 0);
+		}
+		dfa->hash[i] = NULL;
+	}
+	dfa->count = 0;
+}
+
 #ifdef TEST
 static void dumpnode(struct cstate *g, Renode *node)
 {
@@ -916,6 +1017,8 @@ Reprog *regcompx(void *(*alloc)(void *ctx, void *p, int n), void *ctx,
 		die(&g, "cannot allocate regular expression");
 	g.prog->start = NULL;
 	g.prog->cclass = NULL;
+	g.prog->vm = NULL;
+	g.prog->dfa = NULL;
 
 	n = strlen(pattern) * 2;
 	if (n > REG_MAXPROG)
@@ -970,7 +1073,7 @@ Reprog *regcompx(void *(*alloc)(void *ctx, void *p, int n), void *ctx,
 	emit(g.prog, I_ANYNL);
 	jump = emit(g.prog, I_JUMP);
 	jump->x = split;
-	emit(g.prog, I_LPAR);
+	g.prog->entry = emit(g.prog, I_LPAR);
 	compile(g.prog, node);
 	emit(g.prog, I_RPAR);
 	emit(g.prog, I_END);
@@ -979,6 +1082,10 @@ Reprog *regcompx(void *(*alloc)(void *ctx, void *p, int n), void *ctx,
 	dumpprog(g.prog);
 #endif
 
+	g.prog->alloc = alloc;
+	g.prog->ctx = ctx;
+	analyze(g.prog);
+
 	alloc(ctx, g.pstart, 0);
 
 	if (errorp) *errorp = NULL;
@@ -988,6 +1095,12 @@ Reprog *regcompx(void *(*alloc)(void *ctx, void *p, int n), void *ctx,
 void regfreex(void *(*alloc)(void *ctx, void *p, int n), void *ctx, Reprog *prog)
 {
 	if (prog) {
+		if (prog->dfa) {
+			dfaflush(prog->dfa, alloc, ctx);
+			alloc(ctx, prog->dfa, 0);
+		}
+		if (prog->vm)
+			alloc(ctx, prog->vm, 0);
 		if (prog->cclass)
 			alloc(ctx, prog->cclass, 0);
 		alloc(ctx, prog->start, 0);
@@ -1224,11 +1337,450 @@ static int match(Reinst *pc, const char *sp, const char *bol, int flags, Resub *
 	}
 }
 
+/*
+ * Programs without back-references or lookaheads run on a Pike VM instead:
+ * all threads step through the string together, in priority order, and a
+ * thread that reaches an instruction some higher priority thread already
+ * holds at the same position is dropped. This finds the same match and
+ * captures as the backtracking matcher above, in time linear in the length
+ * of the string.
+ *
+ * When the caller does not want the captures, the sets of live instructions
+ * are cached as the states of a lazily built DFA, so that most characters
+ * cost one table lookup. Building states costs more than running the VM
+ * over a few characters, so short strings do not start a DFA.
+ */
+
+struct Rethread {
+	Reinst *pc;
+	const char **cap;
+};
+
+struct Restack {
+	Reinst *pc; /* NULL to restore a capture slot */
+	int slot;
+	const char *old;
+};
+
+struct Revm {
+	int ninst, ncap, gen;
+	Rethread *list[2];
+	int count[2];
+	const char **work;
+	Restack *stack;
+	int *mark;
+	int *set;
+};
+
+static Revm *getvm(Reprog *prog)
+{
+	Revm *vm;
+	const char **cap;
+	char *p;
+	int ninst, ncap, i, k;
+
+	if (prog->vm)
+		return prog->vm;
+
+	ninst = prog->end - prog->start;
+	ncap = prog->nsub * 2;
+	p = prog->alloc(prog->ctx, NULL, sizeof (Revm) +
+		2 * ninst * sizeof (Rethread) +
+		(2 * ninst + 1) * ncap * sizeof (const char *) +
+		(ninst + 1) * sizeof (Restack) +
+		2 * ninst * sizeof (int));
+	if (!p)
+		return NULL;
+
+	vm = (Revm *)p; p += sizeof (Revm);
+	vm->ninst = ninst;
+	vm->ncap = ncap;
+	vm->gen = 0;
+	for (k = 0; k < 2; ++k) {
+		vm->list[k] = (Rethread *)p; p += ninst * sizeof (Rethread);
+		vm->count[k] = 0;
+	}
+	cap = (const char **)p; p += (2 * ninst + 1) * ncap * sizeof (const char *);
+	for (k = 0; k < 2; ++k)
+		for (i = 0; i < ninst; ++i, cap += ncap)
+			vm->list[k][i].cap = cap;
+	vm->work = cap;
+	vm->stack = (Restack *)p; p += (ninst + 1) * sizeof (Restack);
+	vm->mark = (int *)p; p += ninst * sizeof (int);
+	vm->set = (int *)p;
+	for (i = 0; i < ninst; ++i)
+		vm->mark[i] = 0;
+
+	prog->vm = vm;
+	return vm;
+}
+
+static int context(const char *sp, const char *bol, int flags)
+{
+	int ctx = 0;
+	if (sp == bol ? !(flags & REG_NOTBOL) : (flags & REG_NEWLINE) && isnewline(sp[-1]))
+		ctx |= CTX_BOL;
+	if (sp > bol && iswordchar(sp[-1]))
+		ctx |= CTX_WORD;
+	return ctx;
+}
+
+/* Check an assertion given the context and the next character (0 at the end). */
+static int assertion(int opcode, int ctx, Rune c, int flags)
+{
+	int i;
+	switch (opcode) {
+	case I_BOL:
+		return ctx & CTX_BOL;
+	case I_EOL:
+		return c == 0 || ((flags & REG_NEWLINE) && c < 128 && isnewline(c));
+	case I_WORD:
+	case I_NWORD:
+		i = (ctx & CTX_WORD) != 0;
+		i ^= c < 128 && iswordchar(c);
+		return opcode == I_WORD ? i : !i;
+	}
+	return 0;
+}
+
+static int consume(Reinst *pc, Rune c, int flags)
+{
+	switch (pc->opcode) {
+	case I_ANYNL:
+		return 1;
+	case I_ANY:
+		return !isnewline(c);
+	case I_CHAR:
+		return ((flags & REG_ICASE) ? canon(c) : c) == pc->c;
+	case I_CCLASS:
+		if (flags & REG_ICASE)
+			return incclasscanon(pc->cc, canon(c));
+		return incclass(pc->cc, c);
+	case I_NCCLASS:
+		if (flags & REG_ICASE)
+			return !incclasscanon(pc->cc, canon(c));
+		return !incclass(pc->cc, c);
+	}
+	return 0;
+}
+
+/*
+ * Follow the empty transitions from pc at position sp, appending the
+ * threads that stop at an instruction consuming a character (or at the
+ * end) to list k. Threads inherit the captures in cap, or none if NULL.
+ */
+static void addthread(Reprog *prog, Revm *vm, int k, Reinst *pc, const char **cap,
+	const char *sp, int ctx, Rune c, int flags)
+{
+	Restack *stack = vm->stack;
+	Rethread *t;
+	int top, i;
+
+	for (i = 0; i < vm->ncap; ++i)
+		vm->work[i] = cap ? cap[i] : NULL;
+
+	top = 0;
+	stack[top++].pc = pc;
+	while (top > 0) {
+		--top;
+		pc = stack[top].pc;
+		if (!pc) {
+			vm->work[stack[top].slot] = stack[top].old;
+			continue;
+		}
+follow:
+		i = pc - prog->start;
+		if (vm->mark[i] == vm->gen)
+			continue;
+		vm->mark[i] = vm->gen;
+		switch (pc->opcode) {
+		case I_JUMP:
+			pc = pc->x;
+			goto follow;
+		case I_SPLIT:
+			stack[top++].pc = pc->y;
+			pc = pc->x;
+			goto follow;
+		case I_LPAR:
+		case I_RPAR:
+			i = pc->n * 2 + (pc->opcode == I_RPAR);
+			stack[top].pc = NULL;
+			stack[top].slot = i;
+			stack[top].old = vm->work[i];
+			++top;
+			vm->work[i] = sp;
+			pc = pc + 1;
+			goto follow;
+		case I_BOL:
+		case I_EOL:
+		case I_WORD:
+		case I_NWORD:
+			if (assertion(pc->opcode, ctx, c, flags)) {
+				pc = pc + 1;
+				goto follow;
+			}
+			break;
+		default:
+			t = &vm->list[k][vm->count[k]++];
+			t->pc = pc;
+			memcpy(t->cap, vm->work, vm->ncap * sizeof *t->cap);
+			break;
+		}
+	}
+}
+
+static int decode(Rune *c, const char *sp)
+{
+	if (!*sp) {
+		*c = 0;
+		return 0;
+	}
+	return chartorune(c, sp);
+}
+
+static int pikematch(Reprog *prog, Revm *vm, const char *sp, const char *bol, int flags, Resub *out)
+{
+	Rethread *t;
+	const char *np;
+	int matched, restart, ctx, k, n, nn, i;
+	Rune c, nc;
+
+	if (prog->prefix[0]) {
+		sp = strstr(sp, prog->prefix);
+		if (!sp)
+			return 1;
+	}
+
+	/* without REG_NEWLINE an anchored match can only start at the beginning */
+	restart = !prog->anchored || (flags & REG_NEWLINE);
+	matched = 0;
+	k = 0;
+	vm->gen++;
+	vm->count[k] = 0;
+	n = decode(&c, sp);
+	addthread(prog, vm, k, prog->entry, NULL, sp, context(sp, bol, flags), c, flags);
+
+	for (;;) {
+		np = sp + n;
+		nn = c ? decode(&nc, np) : 0;
+		ctx = c ? context(np, bol, flags) : 0;
+		vm->gen++;
+		vm->count[!k] = 0;
+		for (i = 0; i < vm->count[k]; ++i) {
+			t = &vm->list[k][i];
+			if (t->pc->opcode == I_END) {
+				/* lower priority threads can only find a worse match */
+				matched = 1;
+				for (n = 0; n < prog->nsub; ++n) {
+					out->sub[n].sp = t->cap[n * 2];
+					out->sub[n].ep = t->cap[n * 2 + 1];
+				}
+				break;
+			}
+			if (c && consume(t->pc, c, flags))
+				addthread(prog, vm, !k, t->pc + 1, t->cap, np, ctx, nc, flags);
+		}
+		if (!c)
+			break;
+
+		k = !k;
+		sp = np;
+		c = nc;
+		n = nn;
+		if (!matched && restart) {
+			if (vm->count[k] == 0 && prog->prefix[0]) {
+				np = strstr(sp, prog->prefix);
+				if (!np)
+					break;
+				if (np != sp) {
+					sp = np;
+					n = decode(&c, sp);
+					ctx = context(sp, bol, flags);
+					vm->gen++;
+				}
+			}
+			addthread(prog, vm, k, prog->entry, NULL, sp, ctx, c, flags);
+		} else if (vm->count[k] == 0) {
+			break;
+		}
+	}
+
+	return !matched;
+}
+
+static Redfa *getdfa(Reprog *prog)
+{
+	Redfa *dfa = prog->dfa;
+	int i;
+	if (!dfa) {
+		dfa = prog->alloc(prog->ctx, NULL, sizeof (Redfa));
+		if (!dfa)
+			return NULL;
+		for (i = 0; i < REG_DFAHASH; ++i)
+			dfa->hash[i] = NULL;
+		dfa->count = 0;
+		prog->dfa = dfa;
+	}
+	return dfa;
+}
+
+static Restate *dfastate(Reprog *prog, Redfa *dfa, const int *set, int n, int ctx)
+{
+	Restate *s;
+	unsigned int h = ctx;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		h = h * 31 + set[i];
+	h %= REG_DFAHASH;
+
+	for (s = dfa->hash[h]; s; s = s->link)
+		if (s->ctx == ctx && s->n == n && !memcmp(s->inst, set, n * sizeof *set))
+			return s;
+
+	s = prog->alloc(prog->ctx, NULL, sizeof (Restate) + n * sizeof *set);
+	if (!s)
+		return NULL;
+	for (i = 0; i < 128; ++i)
+		s->next[i] = NULL;
+	s->ctx = ctx;
+	s->n = n;
+	memcpy(s->inst, set, n * sizeof *set);
+	s->link = dfa->hash[h];
+	dfa->hash[h] = s;
+	dfa->count++;
+	return s;
+}
+
+static int intcmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Step from state s over the character c, starting a new match attempt at
+ * this position too. Returns &dfaaccept if a match ends before c.
+ */
+static Restate *dfastep(Reprog *prog, Revm *vm, Redfa *dfa, Restate *s, Rune c, int flags)
+{
+	Reinst *pc;
+	int i, n, ctx;
+
+	vm->gen++;
+	vm->count[0] = 0;
+	for (i = 0; i < s->n; ++i)
+		addthread(prog, vm, 0, prog->start + s->inst[i], NULL, NULL, s->ctx, c, flags);
+	if (!prog->anchored || (s->ctx & CTX_BOL))
+		addthread(prog, vm, 0, prog->entry, NULL, NULL, s->ctx, c, flags);
+
+	n = 0;
+	for (i = 0; i < vm->count[0]; ++i) {
+		pc = vm->list[0][i].pc;
+		if (pc->opcode == I_END)
+			return &dfaaccept;
+		if (c && consume(pc, c, flags))
+			vm->set[n++] = pc + 1 - prog->start;
+	}
+	if (!c)
+		return s;
+
+	qsort(vm->set, n, sizeof *vm->set, intcmp);
+	ctx = 0;
+	if (c < 128 && (flags & REG_NEWLINE) && isnewline(c))
+		ctx |= CTX_BOL;
+	if (c < 128 && iswordchar(c))
+		ctx |= CTX_WORD;
+	return dfastate(prog, dfa, vm->set, n, ctx & prog->ctxmask);
+}
+
+static int dfamatch(Reprog *prog, Revm *vm, const char *sp, const char *bol, int flags)
+{
+	Redfa *dfa;
+	Restate *s, *t;
+	const char *np;
+	Rune c;
+	int n, ctx;
+
+	dfa = getdfa(prog);
+	if (!dfa)
+		return -1;
+
+	if (prog->prefix[0]) {
+		sp = strstr(sp, prog->prefix);
+		if (!sp)
+			return 1;
+	}
+
+	s = dfastate(prog, dfa, vm->set, 0, context(sp, bol, flags) & prog->ctxmask);
+	if (!s)
+		return -1;
+
+	for (;;) {
+		c = *(const unsigned char *)sp;
+		if (c > 0 && c < 128 && s->next[c]) {
+			t = s->next[c];
+			n = 1;
+		} else {
+			if (dfa->count >= REG_MAXDFA) {
+				/* start over with an empty cache */
+				n = s->n;
+				ctx = s->ctx;
+				memcpy(vm->set, s->inst, n * sizeof *vm->set);
+				dfaflush(dfa, prog->alloc, prog->ctx);
+				s = dfastate(prog, dfa, vm->set, n, ctx);
+				if (!s)
+					return -1;
+			}
+			n = decode(&c, sp);
+			t = dfastep(prog, vm, dfa, s, c, flags);
+			if (!t)
+				return -1;
+			if (c > 0 && c < 128)
+				s->next[c] = t;
+		}
+		if (t == &dfaaccept)
+			return 0;
+		if (!c)
+			return 1;
+
+		sp += n;
+		s = t;
+		if (s->n == 0 && prog->anchored && !(flags & REG_NEWLINE))
+			return 1;
+		if (s->n == 0 && prog->prefix[0]) {
+			np = strstr(sp, prog->prefix);
+			if (!np)
+				return 1;
+			if (np != sp) {
+				sp = np;
+				s = dfastate(prog, dfa, vm->set, 0, context(sp, bol, flags) & prog->ctxmask);
+				if (!s)
+					return -1;
+			}
+		}
+	}
+}
+
 int regexec(Reprog *prog, const char *sp, Resub *sub, int eflags)
 {
 	Resub scratch;
+	Revm *vm = NULL;
+	int flags = prog->flags | eflags;
 	int i;
 
+	if (!prog->backtrack) {
+		vm = getvm(prog);
+		if (vm && !sub) {
+			for (i = 0; i < REG_DFAMIN && sp[i]; ++i)
+				;
+			if (prog->dfa || i == REG_DFAMIN) {
+				i = dfamatch(prog, vm, sp, sp, flags);
+				if (i >= 0)
+					return i;
+			}
+		}
+	}
+
 	if (!sub)
 		sub = &scratch;
 
@@ -1236,10 +1788,52 @@ int regexec(Reprog *prog, const char *sp, Resub *sub, int eflags)
 	for (i = 0; i < REG_MAXSUB; ++i)
 		sub->sub[i].sp = sub->sub[i].ep = NULL;
 
-	return match(prog->start, sp, sp, prog->flags | eflags, sub, 0);
+	if (vm)
+		return pikematch(prog, vm, sp, sp, flags, sub);
+	return match(prog->start, sp, sp, flags, sub, 0);
 }
 
 #ifdef TEST
+#include <time.h>
+
+/* Time pathological patterns on the backtracking matcher and on regexec. */
+static void bench(void)
+{
+	static const char *patterns[] = { "(a+)+$", "(a|aa)*b", "(a|a)*b", "(x+x+)+y" };
+	static const int sizes[] = { 16, 20, 24, 100000 };
+	char *s = malloc(100001);
+	Reprog *p;
+	Resub m;
+	clock_t t;
+	int i, k, n, r;
+
+	for (i = 0; i < nelem(patterns); ++i) {
+		p = regcomp(patterns[i], 0, NULL);
+		for (k = 0; k < nelem(sizes); ++k) {
+			n = sizes[k];
+			memset(s, patterns[i][1] == 'x' ? 'x' : 'a', n);
+			s[n] = '!';
+			s[n+1] = 0;
+			printf("%-10s n=%-6d", patterns[i], n);
+			if (n <= 24) {
+				t = clock();
+				r = match(p->start, s, s, p->flags, &m, 0);
+				printf(" backtrack %8.2fms (%d)", (clock() - t) * 1000.0 / CLOCKS_PER_SEC, r);
+			} else {
+				printf(" %*s", 26, "");
+			}
+			t = clock();
+			r = regexec(p, s, &m, 0);
+			printf(" regexec %6.2fms (%d)", (clock() - t) * 1000.0 / CLOCKS_PER_SEC, r);
+			t = clock();
+			r = regexec(p, s, NULL, 0);
+			printf(" test %6.2fms (%d)\n", (clock() - t) * 1000.0 / CLOCKS_PER_SEC, r);
+		}
+		regfree(p);
+	}
+	free(s);
+}
+
 int main(int argc, char **argv)
 {
 	const char *error;
@@ -1248,6 +1842,11 @@ int main(int argc, char **argv)
 	Resub m;
 	int i;
 
+	if (argc == 2 && !strcmp(argv[1], "-b")) {
+		bench();
+		return 0;
+	}
+
 	if (argc > 1) {
 		p = regcomp(argv[1], 0, &error);
 		if (!p) {
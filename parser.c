@@ -16,6 +16,20 @@ void add_child(DOMNode* parent, DOMNode* child) {
         parent->children_capacity = newcap;
     }
     parent->children[parent->children_count++] = child;
+    child->parent = parent;
+}
+
+void remove_child(DOMNode* parent, DOMNode* child) {
+    if (!parent || !child) return;
+    for (int i = 0; i < parent->children_count; i++) {
+        if (parent->children[i] == child) {
+            memmove(parent->children + i, parent->children + i + 1,
+                    sizeof(DOMNode*) * (parent->children_count - i - 1));
+            parent->children_count--;
+            child->parent = NULL;
+            return;
+        }
+    }
 }
 
 /* --- Node creation --- */
@@ -47,6 +61,20 @@ static void parse_gumbo_node(GumboNode* gumbo_node, DOMNode* parent) {
             }
         }
 
+        /* Keep id/class for selector matching, style for inline declarations */
+        GumboAttribute* id_attr = gumbo_get_attribute(&element->attributes, "id");
+        if (id_attr && id_attr->value && *id_attr->value) {
+            node->id = strdup(id_attr->value);
+        }
+        GumboAttribute* class_attr = gumbo_get_attribute(&element->attributes, "class");
+        if (class_attr && class_attr->value && *class_attr->value) {
+            node->class_name = strdup(class_attr->value);
+        }
+        GumboAttribute* style_attr = gumbo_get_attribute(&element->attributes, "style");
+        if (style_attr && style_attr->value && *style_attr->value) {
+            node->style_attr = strdup(style_attr->value);
+        }
+
         if (parent) {
             add_child(parent, node);
         }
@@ -77,19 +105,49 @@ DOMNode* parse_html(const char* html) {
     return root;
 }
 
+/* Parse markup as the content of a <body>; the nodes become children of a
+   "#fragment" node (used for innerHTML). */
+DOMNode* parse_html_fragment(const char* html) {
+    GumboOutput* output = gumbo_parse(html);
+    if (!output) {
+        return NULL;
+    }
+    DOMNode* fragment = create_dom_node("#fragment", NULL);
+    GumboVector* sections = &output->root->v.element.children;
+    for (unsigned int i = 0; i < sections->length; i++) {
+        GumboNode* section = sections->data[i];
+        if (section->type == GUMBO_NODE_ELEMENT && section->v.element.tag == GUMBO_TAG_BODY) {
+            GumboVector* children = &section->v.element.children;
+            for (unsigned int j = 0; j < children->length; j++) {
+                parse_gumbo_node(children->data[j], fragment);
+            }
+        }
+    }
+    gumbo_destroy_output(&kGumboDefaultOptions, output);
+    return fragment;
+}
+
+/* Drop one reference; styles may be shared between sibling nodes. */
+void free_computed_style(ComputedStyle* style) {
+    if (!style || __atomic_sub_fetch(&style->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (style->width) free(style->width);
+    if (style->height) free(style->height);
+    if (style->background) free(style->background);
+    if (style->text_align) free(style->text_align);
+    if (style->font_size) free(style->font_size);
+    if (style->display) free(style->display);
+    free(style);
+}
+
 void free_dom(DOMNode* node) {
     if (!node) return;
     if (node->name) free(node->name);
     if (node->text) free(node->text);
     if (node->href) free(node->href);
-    if (node->style) {
-        if (node->style->width) free(node->style->width);
-        if (node->style->height) free(node->style->height);
-        if (node->style->background) free(node->style->background);
-        if (node->style->text_align) free(node->style->text_align);
-        if (node->style->font_size) free(node->style->font_size);
-        free(node->style);
-    }
+    if (node->id) free(node->id);
+    if (node->class_name) free(node->class_name);
+    if (node->style_attr) free(node->style_attr);
+    free_computed_style(node->style);
     for (int i = 0; i < node->children_count; i++) {
         free_dom(node->children[i]);
     }
@@ -127,13 +185,19 @@ static void collect_style_text(DOMNode* node, char** buf, size_t* len, size_t* c
 void split_text_nodes(DOMNode* node) {
     if (!node) return;
 
+    /* Script and style text is source code, not words to wrap */
+    if (node->name && (strcasecmp(node->name, "script") == 0 ||
+                       strcasecmp(node->name, "style") == 0))
+        return;
+
     for (int i = 0; i < node->children_count; i++) {
         DOMNode* child = node->children[i];
         if (!child || !child->name) continue;
 
         if (strcmp(child->name, "#text") == 0 && child->text && strchr(child->text, ' ')) {
             /* Split this text node into word nodes */
-            const char* src = child->text;
+            char* text = child->text;
+            const char* src = text;
 
             /* Skip leading whitespace */
             while (*src && *src == ' ') src++;
@@ -149,7 +213,8 @@ void split_text_nodes(DOMNode* node) {
             }
             if (nwords <= 1) { split_text_nodes(child); continue; }
 
-            /* Build word nodes */
+            /* Build word nodes; the first word reuses the text node itself, so
+               anything holding on to it (a script wrapper) stays valid */
             DOMNode** words = malloc(sizeof(DOMNode*) * nwords);
             if (!words) continue;
             p = src;
@@ -161,8 +226,14 @@ void split_text_nodes(DOMNode* node) {
                 char* word = malloc(len + 1);
                 memcpy(word, start, len);
                 word[len] = '\0';
-                words[wi] = create_dom_node("#text", word);
-                free(word);
+                if (wi == 0) {
+                    words[wi] = child;
+                    child->text = word;
+                } else {
+                    words[wi] = create_dom_node("#text", word);
+                    words[wi]->parent = node;
+                    free(word);
+                }
                 wi++;
                 while (*p == ' ') p++;
             }
@@ -181,8 +252,8 @@ void split_text_nodes(DOMNode* node) {
             }
             free(words);
 
-            /* Free old text node and swap arrays */
-            free_dom(child);
+            /* Free the old text and swap arrays */
+            free(text);
             free(node->children);
             node->children = new_children;
             node->children_count = new_count;
@@ -1,28 +1,47 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+/* Box generation computed by the style pass (css.c) */
+typedef enum {
+    DISPLAY_UNSET,     // not styled yet: layout falls back to tag defaults
+    DISPLAY_INLINE,
+    DISPLAY_BLOCK,
+    DISPLAY_CONTENTS,  // no box of its own: html, body, unknown tags
+    DISPLAY_NONE       // subtree is not rendered at all
+} DisplayType;
+
 typedef struct ComputedStyle {
     char* width;       // e.g., "600px"
     char* height;      // e.g., "30px"
     char* background;  // e.g., "#FFCC00"
     char* text_align;  // e.g., "left", "center", or "right"
     char* font_size;   // e.g., "24px"
+    char* display;     // e.g., "none", "block" or "inline"
+    int refcount;      // nodes pointing at this style (shared via css.c cache)
 } ComputedStyle;
 
 typedef struct DOMNode {
     char* name;              // e.g., "div", "p", "#text", "h1", etc.
     char* text;              // content for text nodes
     char* href;              // link target for <a> tags (NULL otherwise)
+    char* id;                // "id" attribute (NULL if absent)
+    char* class_name;        // raw "class" attribute (NULL if absent)
+    char* style_attr;        // raw "style" attribute (NULL if absent)
+    struct DOMNode* parent;  // NULL for the root and detached nodes
     struct DOMNode** children;
     int children_count;
     int children_capacity;   // pre-allocated capacity for children array
     ComputedStyle* style;    // may be NULL if no style is applied
+    DisplayType display;     // set by the style pass
 } DOMNode;
 
 DOMNode* create_dom_node(const char* name, const char* text);
 void add_child(DOMNode* parent, DOMNode* child);
+void remove_child(DOMNode* parent, DOMNode* child);
 DOMNode* parse_html(const char* html);
+DOMNode* parse_html_fragment(const char* html);
 void free_dom(DOMNode* node);
+void free_computed_style(ComputedStyle* style);
 void split_text_nodes(DOMNode* node);
 char* extract_style_text(DOMNode* root);
 
@@ -28,12 +28,14 @@
 #define BG_G 248
 #define BG_B 245
 
-static int  window_w              = 950;
-static int  window_h              = 700;
+static int  window_w              = INITIAL_WINDOW_W;
+static int  window_h              = INITIAL_WINDOW_H;
 static int  scroll_offset         = 0;
 static char search_query[SEARCH_BUFFER_SIZE] = "";
 static char current_url[2048]     = "";
 static Layout *currentLayout      = NULL;
+static CSSStyleSheet *currentSheet = NULL;  /* kept for restyle on resize */
+static PageScripts *currentScripts = NULL;  /* timers and frames of the page */
 static int  content_height        = 0;
 static bool needs_redraw          = true;
 static bool search_focused        = true;
@@ -479,7 +481,10 @@ static DOMNode *make_error_dom(const char *url) {
     return root;
 }
 
-static Layout *reload_page(const char *url) {
+/* Loads, styles and lays out a page; the stylesheet and script state are
+   returned in *sheet_out and *scripts_out */
+static Layout *reload_page(const char *url, CSSStyleSheet **sheet_out,
+                           PageScripts **scripts_out) {
     printf("Loading: %s\n", url);
     char *html = fetch_url(url);
     DOMNode *dom = NULL;
@@ -498,32 +503,52 @@ static Layout *reload_page(const char *url) {
 
     split_text_nodes(dom);
 
+    /* The style pass also computes display, so run it even without <style> */
     char *style_text = extract_style_text(dom);
-    if (style_text) {
-        CSSStyleSheet *sheet = parse_css(style_text);
-        if (sheet) {
-            apply_stylesheet_to_dom(sheet, dom);
-            free_stylesheet(sheet);
-        }
-        free(style_text);
+    CSSStyleSheet *sheet = parse_css(style_text ? style_text : "");
+    if (sheet) {
+        apply_stylesheet_to_dom(sheet, dom, window_w);
+
+        CSSStyleStats stats;
+        css_style_stats(&stats);
+        printf("Styled %d nodes with %d computed styles "
+               "(%d shared, %d hidden subtrees, %d inline blocks parsed)\n",
+               stats.nodes_styled, stats.styles_allocated, stats.share_hits,
+               stats.subtrees_pruned, stats.inline_blocks_parsed);
     }
+    free(style_text);
+    *sheet_out = sheet;
 
-    run_scripts_in_dom(dom);
+    /* The scripts compile while this lays the page out; they run after the
+       first paint */
+    *scripts_out = run_scripts_in_dom(dom, sheet);
 
     /* Use base font for measurement */
     TTF_Font *mfont = get_font(16, 0);
     Layout *lo = layout_dom(dom, mfont, window_w);
+    page_scripts_laid_out(*scripts_out);
     return lo;
 }
 
+/* Replace the current page (layout + DOM + stylesheet + scripts) with a loaded one */
+static void install_page(Layout *nl, CSSStyleSheet *sheet, PageScripts *scripts) {
+    tcache_clear();
+    free_page_scripts(currentScripts);  /* before the DOM it points into */
+    if (currentLayout) free_layout(currentLayout);
+    free_stylesheet(currentSheet);
+    currentLayout = nl;
+    currentSheet = sheet;
+    currentScripts = scripts;
+    content_height = calc_content_height(nl);
+    scroll_offset = 0;
+}
+
 static void navigate_to(const char *url) {
-    Layout *nl = reload_page(url);
+    CSSStyleSheet *sheet = NULL;
+    PageScripts *scripts = NULL;
+    Layout *nl = reload_page(url, &sheet, &scripts);
     if (nl) {
-        tcache_clear();
-        if (currentLayout) free_layout(currentLayout);
-        currentLayout = nl;
-        content_height = calc_content_height(nl);
-        scroll_offset = 0;
+        install_page(nl, sheet, scripts);
         snprintf(current_url, sizeof(current_url), "%s", url);
         history_push(url);
         *search_query = '\0';
@@ -531,6 +556,19 @@ static void navigate_to(const char *url) {
     }
 }
 
+/* Lay the current DOM out again, e.g. after a resize or a script change */
+static void relayout(void) {
+    DOMNode *dom_ref = currentLayout->dom;
+    currentLayout->dom = NULL;
+    free_layout(currentLayout);
+    TTF_Font *mfont = get_font(16, 0);
+    currentLayout = layout_dom(dom_ref, mfont, window_w);
+    content_height = calc_content_height(currentLayout);
+    clamp_scroll();
+    tcache_clear();  /* textures are keyed by text that may be gone */
+    page_scripts_laid_out(currentScripts);  /* nothing points at removed nodes now */
+}
+
 // ---------------------------------------------------------------------------
 //     EVENT HANDLING
 // ---------------------------------------------------------------------------
@@ -546,14 +584,12 @@ static void handle_event(SDL_Event *e, bool *running) {
             window_w = e->window.data1;
             window_h = e->window.data2;
             if (currentLayout && currentLayout->dom) {
-                DOMNode *dom_ref = currentLayout->dom;
-                currentLayout->dom = NULL;
-                free_layout(currentLayout);
-                TTF_Font *mfont = get_font(16, 0);
-                currentLayout = layout_dom(dom_ref, mfont, window_w);
-                content_height = calc_content_height(currentLayout);
-                clamp_scroll();
-                tcache_clear();
+                /* Computed styles stay valid unless an @media breakpoint was crossed */
+                if (currentSheet && css_breakpoint_crossed(currentSheet, window_w)) {
+                    apply_stylesheet_to_dom(currentSheet, currentLayout->dom, window_w);
+                    printf("Restyled for %dpx (media breakpoint crossed)\n", window_w);
+                }
+                relayout();
             }
             needs_redraw = true;
         }
@@ -606,13 +642,11 @@ static void handle_event(SDL_Event *e, bool *running) {
         if (mod & KMOD_ALT) {
             if (e->key.keysym.sym == SDLK_LEFT && history_pos > 0) {
                 history_pos--;
-                Layout *nl = reload_page(history_urls[history_pos]);
+                CSSStyleSheet *sheet = NULL;
+                PageScripts *scripts = NULL;
+                Layout *nl = reload_page(history_urls[history_pos], &sheet, &scripts);
                 if (nl) {
-                    tcache_clear();
-                    if (currentLayout) free_layout(currentLayout);
-                    currentLayout = nl;
-                    content_height = calc_content_height(nl);
-                    scroll_offset = 0;
+                    install_page(nl, sheet, scripts);
                     snprintf(current_url, sizeof(current_url), "%s", history_urls[history_pos]);
                     *search_query = '\0';
                     needs_redraw = true;
@@ -621,13 +655,11 @@ static void handle_event(SDL_Event *e, bool *running) {
             }
             if (e->key.keysym.sym == SDLK_RIGHT && history_pos < history_count - 1) {
                 history_pos++;
-                Layout *nl = reload_page(history_urls[history_pos]);
+                CSSStyleSheet *sheet = NULL;
+                PageScripts *scripts = NULL;
+                Layout *nl = reload_page(history_urls[history_pos], &sheet, &scripts);
                 if (nl) {
-                    tcache_clear();
-                    if (currentLayout) free_layout(currentLayout);
-                    currentLayout = nl;
-                    content_height = calc_content_height(nl);
-                    scroll_offset = 0;
+                    install_page(nl, sheet, scripts);
                     snprintf(current_url, sizeof(current_url), "%s", history_urls[history_pos]);
                     *search_query = '\0';
                     needs_redraw = true;
@@ -703,7 +735,11 @@ static void handle_event(SDL_Event *e, bool *running) {
 // ---------------------------------------------------------------------------
 //     MAIN ENTRY
 // ---------------------------------------------------------------------------
-void render_layout(DOMNode *dom, const char *initial_url) {
+void render_layout(DOMNode *dom, CSSStyleSheet *sheet, PageScripts *scripts,
+                   const char *initial_url) {
+    currentSheet = sheet;
+    currentScripts = scripts;
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) { fprintf(stderr, "%s\n", SDL_GetError()); return; }
     if (TTF_Init() == -1)             { fprintf(stderr, "%s\n", TTF_GetError()); SDL_Quit(); return; }
 
@@ -730,6 +766,8 @@ void render_layout(DOMNode *dom, const char *initial_url) {
 
     /* Initial layout */
     if (dom) {
+        if (currentSheet && css_breakpoint_crossed(currentSheet, window_w))
+            apply_stylesheet_to_dom(currentSheet, dom, window_w);
         currentLayout = layout_dom(dom, base_font, window_w);
         if (currentLayout)
             content_height = calc_content_height(currentLayout);
@@ -745,14 +783,21 @@ void render_layout(DOMNode *dom, const char *initial_url) {
     while (running) {
         SDL_Event e;
 
+        /* Sleep until an event or the page's next timer or frame is due */
         if (!needs_redraw) {
-            if (!SDL_WaitEvent(&e)) continue;
-            handle_event(&e, &running);
+            int timeout = page_scripts_timeout(currentScripts);
+            if (timeout < 0) {
+                if (!SDL_WaitEvent(&e)) continue;
+                handle_event(&e, &running);
+            } else if (timeout > 0 && SDL_WaitEventTimeout(&e, timeout)) {
+                handle_event(&e, &running);
+            }
         }
 
         while (SDL_PollEvent(&e))
             handle_event(&e, &running);
 
+        /* Paint before running scripts, so a new page shows up first */
         if (needs_redraw) {
             SDL_SetRenderDrawColor(ren, BG_R, BG_G, BG_B, 255);
             SDL_RenderClear(ren);
@@ -761,6 +806,11 @@ void render_layout(DOMNode *dom, const char *initial_url) {
             SDL_RenderPresent(ren);
             needs_redraw = false;
         }
+
+        if (page_scripts_tick(currentScripts) && currentLayout && currentLayout->dom) {
+            relayout();
+            needs_redraw = true;
+        }
     }
 
     SDL_StopTextInput();
@@ -772,6 +822,10 @@ void render_layout(DOMNode *dom, const char *initial_url) {
 quit_sdl:
     TTF_Quit();
     SDL_Quit();
+    free_page_scripts(currentScripts);
+    currentScripts = NULL;
     if (currentLayout) free_layout(currentLayout);
+    free_stylesheet(currentSheet);
+    currentSheet = NULL;
     history_free();
 }
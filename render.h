@@ -2,9 +2,18 @@
 #define RENDER_H
 
 #include "parser.h"
+#include "css.h"
+#include "javascript.h"
+
+// Initial window size; the first page is styled for this width.
+#define INITIAL_WINDOW_W 950
+#define INITIAL_WINDOW_H 700
 
 // Creates an SDL window, lays out the DOM, and runs the event loop.
-// Takes ownership of the DOM tree (will be freed on exit).
-void render_layout(DOMNode *dom, const char *initial_url);
+// Takes ownership of the DOM tree, stylesheet and script state (will be freed
+// on exit); the stylesheet is re-applied when a resize crosses an @media
+// breakpoint, and the page's timers and animation frames run from the loop.
+void render_layout(DOMNode *dom, CSSStyleSheet *sheet, PageScripts *scripts,
+                   const char *initial_url);
 
 #endif
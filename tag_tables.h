@@ -1,4 +1,4 @@
-/* Block-level tags (sorted, lowercase) — used by binary search in layout.c */
+/* Block-level tags (sorted, lowercase) — used by binary search in css.c */
 static const char *const block_tags[] = {
     "article", "aside", "blockquote", "dd", "details", "dialog",
     "div", "dl", "dt", "figcaption", "figure", "footer", "form",
@@ -15,3 +15,9 @@ static const char *const inline_tags[] = {
     "samp", "small", "span", "strong", "sub", "sup", "time", "u", "var"
 };
 #define INLINE_TAGS_N (sizeof inline_tags / sizeof *inline_tags)
+
+/* Tags that never generate boxes (sorted, lowercase) */
+static const char *const hidden_tags[] = {
+    "head", "link", "meta", "script", "style", "template", "title"
+};
+#define HIDDEN_TAGS_N (sizeof hidden_tags / sizeof *hidden_tags)